@@ -0,0 +1,251 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+/*!
+ * Helpers to read raw advertising PDUs (the "PDU" bytes from the decoder):
+ * a 2-byte header, then a payload laid out according to the PDU type.
+ * Legacy advertising PDUs hold the 6-byte advertiser address, then AD structures.
+ * Extended advertising PDUs hold the common extended advertising payload:
+ * an extended header with optional fields, then AD structures.
+ */
+
+//! Offset of the AD structures in a legacy advertising PDU
+static const size_t BTLE_ADV_DATA_OFFSET = 8;
+
+//! Largest PDU: the 2-byte header and up to 255 payload bytes
+static const size_t BTLE_MAX_PDU_LENGTH = 2+255;
+
+//! PDU types of the advertising physical channel (the low 4 bits of the header)
+static const uint8_t BTLE_PDU_ADV_IND = 0x0;
+static const uint8_t BTLE_PDU_ADV_DIRECT_IND = 0x1;
+static const uint8_t BTLE_PDU_ADV_NONCONN_IND = 0x2;
+static const uint8_t BTLE_PDU_SCAN_REQ = 0x3;
+static const uint8_t BTLE_PDU_SCAN_RSP = 0x4;
+static const uint8_t BTLE_PDU_CONNECT_IND = 0x5;
+static const uint8_t BTLE_PDU_ADV_SCAN_IND = 0x6;
+static const uint8_t BTLE_PDU_ADV_EXT_IND = 0x7;
+static const uint8_t BTLE_PDU_AUX_CONNECT_RSP = 0x8;
+
+//! AD type for 16-bit UUID service data
+static const uint8_t BTLE_AD_SERVICE_DATA16 = 0x16;
+
+/*!
+ * Read a 6-byte device address (least significant octet first) as a 48-bit integer,
+ * the first octet printed in "aa:bb:cc:dd:ee:ff" form is the most significant.
+ */
+inline uint64_t btleReadAddress(const uint8_t *addr)
+{
+    uint64_t mac = 0;
+    for (int i = 5; i >= 0; i--) mac = (mac << 8) | addr[i];
+    return mac;
+}
+
+/*!
+ * The name of a PDU type, or nullptr for reserved types.
+ * On the secondary advertising channels (0 to 36),
+ * the extended advertising types have their AUX names.
+ */
+inline const char *btlePduTypeName(const uint8_t type, const int channel)
+{
+    const bool secondary = channel < 37;
+    switch (type)
+    {
+    case BTLE_PDU_ADV_IND: return "ADV_IND";
+    case BTLE_PDU_ADV_DIRECT_IND: return "ADV_DIRECT_IND";
+    case BTLE_PDU_ADV_NONCONN_IND: return "ADV_NONCONN_IND";
+    case BTLE_PDU_SCAN_REQ: return secondary?"AUX_SCAN_REQ":"SCAN_REQ";
+    case BTLE_PDU_SCAN_RSP: return "SCAN_RSP";
+    case BTLE_PDU_CONNECT_IND: return secondary?"AUX_CONNECT_REQ":"CONNECT_IND";
+    case BTLE_PDU_ADV_SCAN_IND: return "ADV_SCAN_IND";
+    case BTLE_PDU_ADV_EXT_IND: return secondary?"AUX_ADV_IND":"ADV_EXT_IND"; //also AUX_SYNC_IND, AUX_CHAIN_IND, AUX_SCAN_RSP
+    case BTLE_PDU_AUX_CONNECT_RSP: return "AUX_CONNECT_RSP";
+    default: return nullptr;
+    }
+}
+
+/*!
+ * The fields of an advertising PDU, located by type.
+ * Offsets are into the raw PDU bytes, with 0 for an absent field.
+ */
+struct BTLEAdvLayout
+{
+    uint8_t type; //!< the PDU type
+    bool chSel; //!< channel selection algorithm #2 supported
+    bool txAdd; //!< the advertiser (or scanner, initiator) address is random
+    bool rxAdd; //!< the target address is random
+    size_t addressOffset; //!< the advertiser address AdvA
+    size_t peerOffset; //!< the other address: TargetA, ScanA, or InitA
+    size_t dataOffset; //!< the AD structures, from dataOffset to dataEnd
+    size_t dataEnd;
+
+    //extended header fields (ADV_EXT_IND and AUX_CONNECT_RSP)
+    uint8_t advMode; //!< 0 non-connectable non-scannable, 1 connectable, 2 scannable
+    bool hasADI;
+    uint16_t adiDID; //!< advertising data id
+    uint8_t adiSID; //!< advertising set id
+    bool hasAuxPtr;
+    uint8_t auxChannel; //!< the secondary channel index of the auxiliary packet
+    uint8_t auxPHY; //!< 0 LE 1M, 1 LE 2M, 2 LE Coded
+    uint32_t auxOffset; //!< microseconds from the start of this packet to the auxiliary packet
+    bool hasTxPower;
+    int8_t txPower; //!< dBm
+};
+
+/*!
+ * Locate the fields of an advertising PDU.
+ * \return false when the PDU is shorter than its header length or the extended header is malformed
+ */
+inline bool btleAdvLayout(const uint8_t *pdu, const size_t length, BTLEAdvLayout &layout)
+{
+    layout = BTLEAdvLayout();
+    if (length < 2) return false;
+    layout.type = pdu[0] & 0xf;
+    layout.chSel = (pdu[0] & 0x20) != 0;
+    layout.txAdd = (pdu[0] & 0x40) != 0;
+    layout.rxAdd = (pdu[0] & 0x80) != 0;
+    const size_t end = 2+size_t(pdu[1]);
+    if (end > length) return false;
+
+    switch (layout.type)
+    {
+    case BTLE_PDU_ADV_IND:
+    case BTLE_PDU_ADV_NONCONN_IND:
+    case BTLE_PDU_SCAN_RSP:
+    case BTLE_PDU_ADV_SCAN_IND:
+        if (end < 8) return false;
+        layout.addressOffset = 2;
+        layout.dataOffset = 8;
+        layout.dataEnd = end;
+        return true;
+
+    case BTLE_PDU_ADV_DIRECT_IND:
+        if (end < 14) return false;
+        layout.addressOffset = 2;
+        layout.peerOffset = 8;
+        return true;
+
+    case BTLE_PDU_SCAN_REQ:
+    case BTLE_PDU_CONNECT_IND:
+        if (end < 14) return false;
+        layout.peerOffset = 2;
+        layout.addressOffset = 8;
+        return true;
+
+    case BTLE_PDU_ADV_EXT_IND:
+    case BTLE_PDU_AUX_CONNECT_RSP: break;
+    default: return true;
+    }
+
+    //common extended advertising payload
+    if (end < 3) return false;
+    layout.advMode = pdu[2] >> 6;
+    const size_t headerEnd = 3+(pdu[2] & 0x3f);
+    if (headerEnd > end) return false;
+    layout.dataOffset = headerEnd;
+    layout.dataEnd = end;
+    if (headerEnd == 3) return true; //no extended header, the AdvData follows the length byte
+
+    const uint8_t flags = pdu[3];
+    size_t p = 4;
+    if (flags & 0x01) {layout.addressOffset = p; p += 6;}
+    if (flags & 0x02) {layout.peerOffset = p; p += 6;}
+    if (flags & 0x04) p += 1; //CTEInfo
+    if (flags & 0x08)
+    {
+        if (p+2 > headerEnd) return false;
+        const unsigned adi = pdu[p] | (pdu[p+1] << 8);
+        layout.hasADI = true;
+        layout.adiDID = uint16_t(adi & 0xfff);
+        layout.adiSID = uint8_t(adi >> 12);
+        p += 2;
+    }
+    if (flags & 0x10)
+    {
+        if (p+3 > headerEnd) return false;
+        const unsigned offset = pdu[p+1] | (pdu[p+2] << 8);
+        layout.hasAuxPtr = true;
+        layout.auxChannel = pdu[p] & 0x3f;
+        layout.auxOffset = (offset & 0x1fff)*((pdu[p] & 0x80)?300:30);
+        layout.auxPHY = uint8_t(offset >> 13);
+        p += 3;
+    }
+    if (flags & 0x20) p += 18; //SyncInfo
+    if (flags & 0x40)
+    {
+        if (p+1 > headerEnd) return false;
+        layout.hasTxPower = true;
+        layout.txPower = int8_t(pdu[p]);
+        p += 1;
+    }
+    if (p > headerEnd) return false;
+
+    //the additional controller advertising data (ACAD) fills the rest of the header
+    return true;
+}
+
+/*!
+ * The advertiser address of a PDU as a 48-bit integer.
+ * The address is 0 when the PDU does not hold one (ex: an anonymous ADV_EXT_IND).
+ */
+inline uint64_t btleAdvAddress(const uint8_t *pdu, const size_t length)
+{
+    BTLEAdvLayout layout;
+    if (not btleAdvLayout(pdu, length, layout) or layout.addressOffset == 0) return 0;
+    return btleReadAddress(pdu+layout.addressOffset);
+}
+
+/*!
+ * One AD structure: the type and the data after the type octet.
+ */
+struct BTLEAdvField
+{
+    uint8_t type;
+    const uint8_t *data;
+    size_t length;
+};
+
+/*!
+ * Iterate the AD structures of an advertising payload.
+ * Call repeatedly with the same cursor until it returns false.
+ */
+inline bool btleNextAdvField(const uint8_t *&cursor, const uint8_t *end, BTLEAdvField &field)
+{
+    if (cursor+2 > end) return false;
+    const size_t len = cursor[0]; //includes the type octet
+    if (len == 0 or cursor+1+len > end) return false;
+    field.type = cursor[1];
+    field.data = cursor+2;
+    field.length = len-1;
+    cursor += 1+len;
+    return true;
+}
+
+/*!
+ * Find the first 16-bit UUID service data in an advertising PDU.
+ * \param pdu the raw pdu bytes
+ * \param length the number of pdu bytes
+ * \param [out] uuid16 the service UUID
+ * \param [out] data the service data after the UUID
+ * \param [out] dataLength the number of service data bytes
+ * \return true when service data was found
+ */
+inline bool btleFindServiceData(const uint8_t *pdu, const size_t length, uint16_t &uuid16, const uint8_t *&data, size_t &dataLength)
+{
+    BTLEAdvLayout layout;
+    if (not btleAdvLayout(pdu, length, layout)) return false;
+    const uint8_t *cursor = pdu + layout.dataOffset;
+    BTLEAdvField field;
+    while (btleNextAdvField(cursor, pdu+layout.dataEnd, field))
+    {
+        if (field.type != BTLE_AD_SERVICE_DATA16 or field.length < 2) continue;
+        uuid16 = uint16_t(field.data[0] | (field.data[1] << 8));
+        data = field.data+2;
+        dataLength = field.length-2;
+        return true;
+    }
+    return false;
+}
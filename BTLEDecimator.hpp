@@ -0,0 +1,155 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstddef>
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <algorithm>
+
+/*!
+ * Decimating low pass filter for complex baseband input.
+ *
+ * The taps are a Blackman windowed sinc designed once at setup,
+ * normalized to unity gain at DC, and stored reversed and duplicated
+ * for the real and imaginary parts, so each output is one contiguous
+ * dot product over interleaved floats that the compiler can vectorize.
+ * Only every decim'th output is computed, which is the cost of
+ * a polyphase decimator: numTaps multiplies per output sample.
+ *
+ * The last numTaps-1 input samples are kept between calls,
+ * so the output is continuous across buffers of any size.
+ */
+class BTLEDecimator
+{
+public:
+    /*!
+     * \param decim the decimation factor
+     * \param cutoff the cutoff frequency over the input sample rate (0 to 0.5)
+     * \param numTaps the filter length, or 0 for a length from the decimation
+     */
+    BTLEDecimator(const size_t decim = 1, const double cutoff = 0.5, const size_t numTaps = 0):
+        _decim(std::max<size_t>(decim, 1)),
+        _next(0)
+    {
+        //the transition band is about 5.5/numTaps with the blackman window
+        size_t L = (numTaps == 0)?(14*_decim+1):numTaps;
+        if (_decim == 1 and numTaps == 0) L = 1;
+
+        std::vector<double> h(L);
+        double sum = 0.0;
+        for (size_t i = 0; i < L; i++)
+        {
+            const double t = i - (L-1)/2.0;
+            const double x = 2*cutoff*t;
+            const double sinc = (x == 0.0)?1.0:std::sin(M_PI*x)/(M_PI*x);
+            const double w = (L == 1)?1.0:(0.42 - 0.5*std::cos(2*M_PI*i/(L-1)) + 0.08*std::cos(4*M_PI*i/(L-1)));
+            h[i] = sinc*w;
+            sum += h[i];
+        }
+
+        //reversed, duplicated for re/im, and zero padded to a multiple of 4 taps
+        _numTaps = (L+3) & ~size_t(3);
+        _taps.assign(2*_numTaps, 0.0f);
+        for (size_t i = 0; i < L; i++)
+        {
+            _taps[2*i+0] = _taps[2*i+1] = float(h[L-1-i]/sum);
+        }
+        _history.assign(_numTaps-1, std::complex<float>(0.0f));
+    }
+
+    size_t decimation(void) const
+    {
+        return _decim;
+    }
+
+    void reset(void)
+    {
+        std::fill(_history.begin(), _history.end(), std::complex<float>(0.0f));
+        _next = 0;
+    }
+
+    /*!
+     * Filter and decimate a buffer of input samples.
+     * The output callback is called as out(std::complex<float>) for each output in order.
+     */
+    template <typename Out>
+    void process(const std::complex<float> *in, const size_t N, Out &&out)
+    {
+        //the windows start at _next in the concatenation of the history and the input,
+        //those that overlap the history are computed from a small stitched buffer
+        const size_t H = _history.size();
+        size_t s = _next;
+        if (s < H)
+        {
+            _stitch.assign(_history.begin(), _history.end());
+            _stitch.insert(_stitch.end(), in, in+std::min(N, H));
+            for (; s < H and s+_numTaps <= _stitch.size(); s += _decim) out(this->dot(_stitch.data()+s));
+        }
+
+        //the remaining windows read the input directly
+        for (; s >= H and s+_numTaps <= H+N; s += _decim) out(this->dot(in+(s-H)));
+
+        //keep the tail of the concatenation for the next call
+        if (N >= H) _history.assign(in+N-H, in+N);
+        else
+        {
+            _history.erase(_history.begin(), _history.begin()+N);
+            _history.insert(_history.end(), in, in+N);
+        }
+        _next = s-N;
+    }
+
+private:
+    //independent partial sums so that the loop vectorizes
+    std::complex<float> dot(const std::complex<float> *x) const
+    {
+        const float *f = reinterpret_cast<const float *>(x);
+        const float *t = _taps.data();
+        float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        for (size_t i = 0; i < 2*_numTaps; i += 8)
+        {
+            for (size_t k = 0; k < 8; k++) acc[k] += f[i+k]*t[i+k];
+        }
+        return std::complex<float>((acc[0]+acc[2])+(acc[4]+acc[6]), (acc[1]+acc[3])+(acc[5]+acc[7]));
+    }
+
+    size_t _decim;
+    size_t _numTaps;
+    std::vector<float> _taps;
+    std::vector<std::complex<float>> _history;
+    std::vector<std::complex<float>> _stitch;
+    size_t _next;
+};
+
+/*!
+ * DC offset removal with a one pole tracking average,
+ * which removes the LO leakage of direct conversion receivers.
+ */
+class BTLEDCBlocker
+{
+public:
+    //! \param averageSize the time constant of the average in samples
+    BTLEDCBlocker(const size_t averageSize = 512):
+        _alpha(1.0f/std::max<size_t>(averageSize, 1)),
+        _avg(0.0f)
+    {
+        return;
+    }
+
+    void reset(void)
+    {
+        _avg = std::complex<float>(0.0f);
+    }
+
+    std::complex<float> feed(const std::complex<float> &x)
+    {
+        _avg += (x - _avg)*_alpha;
+        return x - _avg;
+    }
+
+private:
+    float _alpha;
+    std::complex<float> _avg;
+};
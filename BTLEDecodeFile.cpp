@@ -0,0 +1,384 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include "BTLEUtils.hpp"
+#include "BTLEPacketRecord.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <complex>
+#include <cmath>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/***********************************************************************
+ * btle_decode_file - decode BTLE packets from a capture file
+ *
+ * The capture is memory mapped and split into chunks that are decoded
+ * in parallel, each chunk with its own decoder instance. Every chunk is
+ * preceded by enough samples to hold the longest packet, and a packet
+ * is reported by the chunk that holds its last sample, so a
+ * packet that straddles a boundary is reported by exactly one chunk.
+ * Results are written in file order as JSON lines or binary records.
+ **********************************************************************/
+
+enum SampleFormat
+{
+    FORMAT_CF32, //complex float32 baseband
+    FORMAT_CI16, //complex int16 baseband
+    FORMAT_CI8, //complex int8 baseband
+    FORMAT_S16, //frequency demodulated int16
+    FORMAT_F32, //frequency demodulated float32 (-pi to +pi)
+    FORMAT_UNKNOWN,
+};
+
+static size_t formatSize(const SampleFormat format)
+{
+    switch (format)
+    {
+    case FORMAT_CF32: return 8;
+    case FORMAT_CI16: return 4;
+    case FORMAT_CI8: return 2;
+    case FORMAT_S16: return 2;
+    case FORMAT_F32: return 4;
+    default: return 0;
+    }
+}
+
+static SampleFormat formatFromString(const std::string &name)
+{
+    if (name == "cf32" or name == "fc32" or name == "cfile") return FORMAT_CF32;
+    if (name == "ci16" or name == "cs16" or name == "sc16") return FORMAT_CI16;
+    if (name == "ci8" or name == "cs8" or name == "sc8") return FORMAT_CI8;
+    if (name == "s16") return FORMAT_S16;
+    if (name == "f32") return FORMAT_F32;
+    return FORMAT_UNKNOWN;
+}
+
+struct DecodeOptions
+{
+    SampleFormat format;
+    int sps;
+    int channel;
+    double rate;
+    size_t chunkSize;
+    size_t numThreads;
+    bool binary;
+};
+
+/***********************************************************************
+ * Sample readers: produce the decoder's int16 frequency value
+ * using the same scaling as the BTLE decoder block
+ **********************************************************************/
+static const float DEMOD_GAIN = (1 << 15)/M_PI;
+
+static inline int16_t clipInt16(const float x)
+{
+    if (x >= 32767.0f) return 32767;
+    if (x <= -32768.0f) return -32768;
+    return int16_t(x);
+}
+
+struct ReaderS16
+{
+    const int16_t *in;
+    int16_t operator()(const size_t i) const {return in[i];}
+};
+
+struct ReaderF32
+{
+    const float *in;
+    int16_t operator()(const size_t i) const {return clipInt16(in[i]*DEMOD_GAIN);}
+};
+
+template <typename T>
+struct ReaderComplex
+{
+    const T *in; //interleaved I, Q
+    int16_t operator()(const size_t i) const
+    {
+        if (i == 0) return 0;
+        const std::complex<float> x0(in[2*i-2], in[2*i-1]);
+        const std::complex<float> x1(in[2*i+0], in[2*i+1]);
+        return clipInt16(std::arg(x1*std::conj(x0))*DEMOD_GAIN);
+    }
+};
+
+/***********************************************************************
+ * Output formatting
+ **********************************************************************/
+static void appendJsonString(std::string &out, const std::string &s)
+{
+    out.push_back('"');
+    for (const char ch : s)
+    {
+        if (ch == '"' or ch == '\\') {out.push_back('\\'); out.push_back(ch);}
+        else if (std::iscntrl((unsigned char)ch))
+        {
+            char buff[8];
+            std::snprintf(buff, sizeof(buff), "\\u%04x", unsigned((unsigned char)ch));
+            out += buff;
+        }
+        else out.push_back(ch);
+    }
+    out.push_back('"');
+}
+
+static void appendJson(std::string &out, const BTLEUtilsDecoder &decoder, const uint64_t sampleIndex, const double rate)
+{
+    char buff[64];
+    std::snprintf(buff, sizeof(buff), "{\"SampleIndex\":%llu,\"Time\":%.7f",
+        (unsigned long long)sampleIndex, sampleIndex/rate);
+    out += buff;
+
+    for (const auto &pair : decoder.packetData)
+    {
+        //wall clock and decoder-relative counters mean nothing offline
+        if (pair.first == "Timestamp" or pair.first == "SampleIndex") continue;
+        if (pair.first == "PDU") continue; //written as hex below
+        out.push_back(',');
+        appendJsonString(out, pair.first);
+        out.push_back(':');
+        if (pair.second.type() == typeid(std::string))
+            appendJsonString(out, pair.second.extract<std::string>());
+        else out += pair.second.toString();
+    }
+
+    out += ",\"PDU\":\"";
+    for (size_t i = 0; i < decoder.pduLength; i++)
+    {
+        std::snprintf(buff, sizeof(buff), "%02x", unsigned(decoder.pduBytes[i]));
+        out += buff;
+    }
+    out += "\"}\n";
+}
+
+static void appendBinary(std::string &out, const BTLEUtilsDecoder &decoder, const uint64_t sampleIndex)
+{
+    BTLEPacketRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.sampleIndex = sampleIndex;
+    record.accessAddress = decoder.pduAddress;
+    record.crc = decoder.pduCRC;
+    record.threshold = decoder.g_threshold;
+    record.pduLength = uint16_t(decoder.pduLength);
+    record.channel = uint8_t(decoder.channel);
+    out.append((const char *)&record, sizeof(record));
+    out.append((const char *)decoder.pduBytes, decoder.pduLength);
+}
+
+/***********************************************************************
+ * Decode samples [begin, end) of the capture into a result string
+ **********************************************************************/
+template <typename Reader>
+static void decodeRange(const Reader &reader, const DecodeOptions &opts, const size_t begin, const size_t end, std::string &out)
+{
+    BTLEUtilsDecoder decoder(opts.sps);
+    decoder.formatPacketData = not opts.binary;
+    decoder.channel = opts.channel;
+
+    //warm up the ring buffer with the samples of the longest packet before the chunk
+    const size_t warmup = std::min(begin, size_t(RB_SIZE));
+    for (size_t i = begin-warmup; i < end; i++)
+    {
+        if (not decoder.feedOne(uint16_t(reader(i)))) continue;
+        if (i < begin) continue; //reported by the previous chunk
+
+        //the decoder counts samples from the start of the warmup
+        const uint64_t sampleIndex = begin-warmup+uint64_t(decoder.pduSample);
+        if (opts.binary) appendBinary(out, decoder, sampleIndex);
+        else appendJson(out, decoder, sampleIndex, opts.rate);
+    }
+}
+
+static std::string decodeChunk(const void *data, const DecodeOptions &opts, const size_t begin, const size_t end)
+{
+    std::string out;
+    switch (opts.format)
+    {
+    case FORMAT_CF32: decodeRange(ReaderComplex<float>{(const float *)data}, opts, begin, end, out); break;
+    case FORMAT_CI16: decodeRange(ReaderComplex<int16_t>{(const int16_t *)data}, opts, begin, end, out); break;
+    case FORMAT_CI8: decodeRange(ReaderComplex<int8_t>{(const int8_t *)data}, opts, begin, end, out); break;
+    case FORMAT_S16: decodeRange(ReaderS16{(const int16_t *)data}, opts, begin, end, out); break;
+    case FORMAT_F32: decodeRange(ReaderF32{(const float *)data}, opts, begin, end, out); break;
+    default: break;
+    }
+    return out;
+}
+
+/***********************************************************************
+ * Command line
+ **********************************************************************/
+static void printUsage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [options] <capture file>" << std::endl
+        << "  --format=FMT   sample format: cf32, ci16, ci8 (complex baseband)" << std::endl
+        << "                 or s16, f32 (frequency demodulated), default from file extension" << std::endl
+        << "  --sps=N        samples per symbol (default 2, 2 Msps for 1 Mbps)" << std::endl
+        << "  --channel=N    advertising channel index for dewhitening (default 38)" << std::endl
+        << "  --output=FILE  output file (default stdout)" << std::endl
+        << "  --binary       write binary packet records instead of JSON lines" << std::endl
+        << "  --threads=N    number of decode threads (default all cores)" << std::endl
+        << "  --chunk=N      samples per chunk (default 16M)" << std::endl;
+}
+
+static bool parseOption(const std::string &arg, const std::string &name, std::string &value)
+{
+    const std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    DecodeOptions opts;
+    opts.format = FORMAT_UNKNOWN;
+    opts.sps = 2;
+    opts.channel = 38;
+    opts.chunkSize = size_t(1) << 24;
+    opts.numThreads = std::max(1u, std::thread::hardware_concurrency());
+    opts.binary = false;
+    std::string inPath, outPath;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+        std::string value;
+        if (parseOption(arg, "format", value)) opts.format = formatFromString(value);
+        else if (parseOption(arg, "sps", value)) opts.sps = std::stoi(value);
+        else if (parseOption(arg, "channel", value)) opts.channel = std::stoi(value);
+        else if (parseOption(arg, "output", value)) outPath = value;
+        else if (parseOption(arg, "threads", value)) opts.numThreads = std::stoul(value);
+        else if (parseOption(arg, "chunk", value)) opts.chunkSize = std::stoul(value);
+        else if (arg == "--binary") opts.binary = true;
+        else if (arg == "--help" or arg == "-h") {printUsage(argv[0]); return EXIT_SUCCESS;}
+        else if (not arg.empty() and arg[0] != '-' and inPath.empty()) inPath = arg;
+        else {printUsage(argv[0]); return EXIT_FAILURE;}
+    }
+
+    if (inPath.empty()) {printUsage(argv[0]); return EXIT_FAILURE;}
+    if (opts.format == FORMAT_UNKNOWN)
+    {
+        const auto dot = inPath.find_last_of('.');
+        if (dot != std::string::npos) opts.format = formatFromString(inPath.substr(dot+1));
+    }
+    if (opts.format == FORMAT_UNKNOWN)
+    {
+        std::cerr << "Unknown sample format, specify --format" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (opts.sps < 1 or opts.channel < 0 or opts.channel > 39 or opts.numThreads == 0 or opts.chunkSize == 0)
+    {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    opts.rate = opts.sps*1e6;
+
+    //map the capture file
+    const int fd = open(inPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot open " << inPath << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        std::cerr << "Cannot stat " << inPath << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    const size_t numSamples = size_t(st.st_size)/formatSize(opts.format);
+    if (numSamples == 0)
+    {
+        std::cerr << "No samples in " << inPath << std::endl;
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    void *data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "Cannot map " << inPath << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    madvise(data, size_t(st.st_size), MADV_SEQUENTIAL);
+
+    //open the output
+    std::ofstream outFile;
+    if (not outPath.empty())
+    {
+        outFile.open(outPath.c_str(), std::ios::out | std::ios::binary);
+        if (not outFile)
+        {
+            std::cerr << "Cannot open " << outPath << std::endl;
+            munmap(data, size_t(st.st_size));
+            return EXIT_FAILURE;
+        }
+    }
+    std::ostream &os = outPath.empty()?std::cout:outFile;
+
+    //decode chunks in parallel, results are collected in file order
+    const size_t numChunks = (numSamples+opts.chunkSize-1)/opts.chunkSize;
+    std::vector<std::string> results(numChunks);
+    std::vector<bool> ready(numChunks, false);
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<size_t> nextChunk(0);
+
+    const auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min(opts.numThreads, numChunks); t++)
+    {
+        workers.emplace_back([&]()
+        {
+            size_t idx;
+            while ((idx = nextChunk++) < numChunks)
+            {
+                const size_t begin = idx*opts.chunkSize;
+                const size_t end = std::min(numSamples, begin+opts.chunkSize);
+                auto result = decodeChunk(data, opts, begin, end);
+                std::lock_guard<std::mutex> lock(mutex);
+                results[idx].swap(result);
+                ready[idx] = true;
+                cond.notify_all();
+            }
+        });
+    }
+
+    size_t numBytes = 0;
+    for (size_t idx = 0; idx < numChunks; idx++)
+    {
+        std::string result;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&](){return ready[idx];});
+            result.swap(results[idx]);
+        }
+        os.write(result.data(), result.size());
+        numBytes += result.size();
+    }
+    for (auto &worker : workers) worker.join();
+    os.flush();
+    munmap(data, size_t(st.st_size));
+
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    const double duration = numSamples/opts.rate;
+    std::cerr << "Decoded " << numSamples << " samples (" << duration << " s) in "
+        << elapsed << " s, " << (duration/elapsed) << "x real time, "
+        << numBytes << " bytes written" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -3,8 +3,12 @@
 
 #include <Pothos/Framework.hpp>
 #include "BTLEUtils.hpp"
+#include "BTLEDemod.hpp"
+#include "BTLESquelch.hpp"
+#include "BTLEPacketHandler.hpp"
 #include <iostream>
 #include <cmath>
+#include <complex>
 
 /***********************************************************************
  * |PothosDoc BTLE Decoder
@@ -20,23 +24,155 @@
  * The scaling of the input samples does not matter, and the input sample rate should be 2 Msps.
  * A typical upstream flow involves raw complex baseband samples and the "Freq Demod" block.
  *
+ * The input port also accepts complex baseband samples directly,
+ * in which case the decoder runs its own frequency discriminator.
+ * In complex mode each packet is annotated with link estimates
+ * computed from the samples already held for decoding:
+ * "RSSI" (mean packet power in dBFS), "Noise" (noise floor in dBFS),
+ * "SNR" (dB), and "CFO" (carrier frequency offset in Hz).
+ * Packets below the minimum RSSI or SNR are dropped before formatting,
+ * and the "cfo" signal emits a smoothed frequency offset after each packet,
+ * which can be used to retune the receiver or steer the channel filter.
+ *
+ * An energy detect squelch can gate the complex input before demodulation.
+ * Only bursts that rise above the noise floor by the squelch level,
+ * with margins before and after, are demodulated and decoded,
+ * which saves most of the decoding work on an idle channel.
+ * The squelch noise floor is then used for the "Noise" and "SNR" estimates.
+ *
  * <h2>Output format</h2>
  *
  * Each decoded BTLE packet results in a dictionary message of type Pothos::ObjectKwargs.
  * The keyword and value pairs correspond with the fields in the BTLE packet.
+ * The "PDU" key holds the raw dewhitened PDU bytes as a std::vector<uint8_t>
+ * and the "Channel" key holds the advertising channel index.
+ * The "PDU Type" key names the PDU type from the header (ex: "ADV_IND", "SCAN_RSP", "ADV_EXT_IND"),
+ * and "TxAdd" and "RxAdd" tell whether the addresses are "public" or "random".
+ * PDUs of up to 255 payload bytes are decoded, including extended advertising PDUs,
+ * for which the extended header fields are reported when present:
+ * "AdvMode", "ADI DID", "ADI SID", "TxPower", and the auxiliary pointer
+ * "Aux Channel", "Aux Offset" (microseconds), and "Aux PHY".
+ * The decoder listens on one channel and does not follow the auxiliary pointer,
+ * but a second decoder tuned and dewhitened for a secondary channel (0 to 36)
+ * will decode the AUX_ADV_IND packets sent there.
+ * Data channel packets are not decoded.
+ *
+ * <h2>Batched output</h2>
+ *
+ * Under heavy advertising load, the cost of one message per packet adds up
+ * in allocations and in scheduler wake-ups of the downstream blocks.
+ * In batch mode, the packets decoded in one call to work() are posted together
+ * as a single BTLEPacketBatch message: one contiguous arena holding
+ * a BTLEPacketRecord header, the link estimates, and the raw PDU of each packet.
+ * The packets are not formatted into keywords in this mode.
+ * The BTLE Sensor Monitor, the BTLE PCAP Writer, and the BTLE Shared Memory Sink
+ * accept batches as well as the dictionary messages; other consumers ignore them.
+ *
+ * <h2>Duplicate suppression</h2>
+ *
+ * Advertisers repeat the same PDU on every advertising event.
+ * The optional duplicate suppression drops repeated packets before they are formatted,
+ * keyed on the advertiser address and PDU type, and compared by a hash of the payload.
+ * In window mode, an unchanged payload is forwarded at most once per window.
+ * In change mode, an unchanged payload is never forwarded again.
+ * Note that the sensor monitor raises its alarm when it sees no packets,
+ * so use a window shorter than the alarm timeout when feeding the monitor.
+ *
+ * <h2>Address and UUID filter</h2>
+ *
+ * The filter list selects packets by advertiser address and service UUID.
+ * A packet matches when its address, or any 16, 32, or 128-bit UUID in its
+ * service UUID lists or service data, is in the list.
+ * In allow mode, only matching packets pass; in deny mode, matching packets are dropped.
+ * The filter runs on the raw PDU right after the CRC check,
+ * before the link estimates, duplicate suppression, and formatting,
+ * so dropped packets cost almost nothing. Long lists are screened with a Bloom filter.
  *
  * |category /Decode
  * |keywords bluetooth low energy
  *
+ * |param channel[Channel] The advertising channel index used for dewhitening.
+ * The channel should match the tuned frequency: 37 (2402 MHz), 38 (2426 MHz), or 39 (2480 MHz).
+ * |default 38
+ * |option [37] 37
+ * |option [38] 38
+ * |option [39] 39
+ *
+ * |param dedupMode[Dedup Mode] The duplicate suppression mode.
+ * |default "OFF"
+ * |option [Off] "OFF"
+ * |option [Window] "WINDOW"
+ * |option [On Change] "CHANGE"
+ *
+ * |param dedupWindow[Dedup Window] Identical packets within this window are dropped.
+ * |units seconds
+ * |default 1.0
+ * |preview when(enum=dedupMode, "WINDOW")
+ *
+ * |param filterMode[Filter Mode] The address and UUID filter mode.
+ * |default "OFF"
+ * |option [Off] "OFF"
+ * |option [Allow] "ALLOW"
+ * |option [Deny] "DENY"
+ *
+ * |param filterList[Filter List] Addresses and UUIDs separated by commas.
+ * Ex: "aa:bb:cc:dd:ee:ff, fe9f, 6e400001-b5a3-f393-e0a9-e50e24dcca9e"
+ * |default ""
+ * |widget StringEntry()
+ * |preview when(enum=filterMode, "ALLOW", "DENY")
+ *
+ * |param minRSSI[Min RSSI] Drop packets with a lower mean power (complex input only).
+ * |units dBFS
+ * |default -200.0
+ * |preview valid
+ *
+ * |param minSNR[Min SNR] Drop packets with a lower signal to noise ratio (complex input only).
+ * |units dB
+ * |default -200.0
+ * |preview valid
+ *
+ * |param squelch[Squelch] Only decode complex input bursts this far above the noise floor, or 0 to decode everything.
+ * |units dB
+ * |default 0.0
+ * |preview valid
+ *
+ * |param batchOutput[Batch Output] Post the packets of each work() call as one batch message.
+ * |default false
+ * |option [Off] false
+ * |option [On] true
+ * |preview valid
+ *
  * |factory /btle/btle_decoder()
+ * |setter setChannel(channel)
+ * |setter setDedupMode(dedupMode)
+ * |setter setDedupWindow(dedupWindow)
+ * |setter setFilterMode(filterMode)
+ * |setter setFilterList(filterList)
+ * |setter setMinRSSI(minRSSI)
+ * |setter setMinSNR(minSNR)
+ * |setter setSquelch(squelch)
+ * |setter setBatchOutput(batchOutput)
  **********************************************************************/
 class BTLEDecoder : public Pothos::Block
 {
 public:
-    BTLEDecoder(void)
+    BTLEDecoder(void):
+        _squelch(128, RB_SIZE+64), //a false header match can hold the decode for the longest packet
+        _squelchLevel(0.0)
     {
         this->setupInput(0); //unspecified type, handles conversion
         this->setupOutput(0);
+        this->registerSignal("cfo");
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setChannel));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setDedupMode));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setDedupWindow));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setFilterMode));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setFilterList));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setMinRSSI));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setMinSNR));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setSquelch));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEDecoder, setBatchOutput));
+        _decoder.formatPacketData = false; //formatted after filtering
     }
 
     static Block *make(void)
@@ -44,6 +180,85 @@ public:
         return new BTLEDecoder();
     }
 
+    void setChannel(const int channel)
+    {
+        if (channel < 0 or channel > 39) throw Pothos::InvalidArgumentException(
+            "BTLEDecoder::setChannel("+std::to_string(channel)+")", "channel index out of range");
+        _decoder.channel = channel;
+    }
+
+    void setDedupMode(const std::string &mode)
+    {
+        try
+        {
+            _handler.setDedupMode(mode);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLEDecoder::setDedupMode("+mode+")", ex.what());
+        }
+    }
+
+    void setDedupWindow(const double window)
+    {
+        _handler.setDedupWindow(window);
+    }
+
+    void setFilterMode(const std::string &mode)
+    {
+        try
+        {
+            _handler.setFilterMode(mode);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLEDecoder::setFilterMode("+mode+")", ex.what());
+        }
+    }
+
+    void setFilterList(const std::string &list)
+    {
+        try
+        {
+            _handler.setFilterList(list);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLEDecoder::setFilterList("+list+")", ex.what());
+        }
+    }
+
+    void setMinRSSI(const double minRSSI)
+    {
+        _handler.setMinRSSI(minRSSI);
+    }
+
+    void setMinSNR(const double minSNR)
+    {
+        _handler.setMinSNR(minSNR);
+    }
+
+    void setSquelch(const double level)
+    {
+        if (level < 0.0) throw Pothos::InvalidArgumentException(
+            "BTLEDecoder::setSquelch("+std::to_string(level)+")", "level must be positive");
+        _squelchLevel = level;
+        _squelch.setLevel(level);
+    }
+
+    void setBatchOutput(const bool batch)
+    {
+        _handler.setBatchOutput(batch);
+    }
+
+    void activate(void)
+    {
+        _decoder.reset();
+        _demod.reset();
+        _squelch.reset();
+        _handler.reset();
+    }
+
     void work(void)
     {
         auto inPort = this->input(0);
@@ -51,19 +266,34 @@ public:
         auto N = inBuff.elements();
         if (N == 0) return; //nothing available
 
+        //complex baseband support
+        if (inBuff.dtype.isComplex())
+        {
+            auto cf32Buff = inBuff.convert(typeid(std::complex<float>));
+            auto in = cf32Buff.as<const std::complex<float> *>();
+            const auto decode = [this](const std::complex<float> *x, const size_t n)
+            {
+                for (size_t i = 0; i < n; i++)
+                {
+                    if (_decoder.feedOne(uint16_t(_demod.feed(x[i])))) this->handleComplexPacket();
+                }
+            };
+
+            //skipped samples still count towards the packet sample index
+            if (_squelchLevel > 0.0) _squelch.process(in, N, decode,
+                [this](const size_t n){_decoder.samples += int64_t(n);});
+            else decode(in, N);
+        }
+
         //floating point support
-        if (inBuff.dtype.isFloat())
+        else if (inBuff.dtype.isFloat())
         {
             auto float32Buff = inBuff.convert(typeid(float));
             auto in = float32Buff.as<const float *>();
             const float gain = (1 << 15)/M_PI;
             for (size_t i = 0; i < N; i++)
             {
-                if (_decoder.feedOne(uint16_t(in[i]*gain)))
-                {
-                    this->output(0)->postMessage(_decoder.packetData);
-                    //std::cout << Pothos::Object(_decoder.packetData).toString() << std::endl;
-                }
+                if (_decoder.feedOne(uint16_t(in[i]*gain))) _handler.handle(_decoder, this->output(0));
             }
         }
 
@@ -74,20 +304,33 @@ public:
             auto in = int16Buff.as<const uint16_t *>();
             for (size_t i = 0; i < N; i++)
             {
-                if (_decoder.feedOne(in[i]))
-                {
-                    this->output(0)->postMessage(_decoder.packetData);
-                    //std::cout << Pothos::Object(_decoder.packetData).toString() << std::endl;
-                }
+                if (_decoder.feedOne(in[i])) _handler.handle(_decoder, this->output(0));
             }
         }
 
         //consume all input elements
         inPort->consume(inPort->elements());
+
+        //one message for all packets of this call
+        _handler.flush(this->output(0));
     }
 
 private:
+    void handleComplexPacket(void)
+    {
+        const auto estimate = [this]
+        {
+            if (_squelchLevel > 0.0) _demod.setNoiseFloor(_squelch.noiseFloor());
+            return _demod.estimate(_decoder, _decoder.srate*1e6);
+        };
+        if (_handler.handle(_decoder, estimate, this->output(0))) this->callVoid("cfo", _handler.cfo());
+    }
+
     BTLEUtilsDecoder _decoder;
+    BTLEComplexDemod _demod;
+    BTLESquelch _squelch;
+    double _squelchLevel;
+    BTLEPacketHandler _handler;
 };
 
 static Pothos::BlockRegistry registerBTLEDecoder(
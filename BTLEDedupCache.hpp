@@ -0,0 +1,132 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+
+/*!
+ * 64-bit FNV-1a hash over a byte range.
+ */
+inline uint64_t btleHashBytes(const uint8_t *data, const size_t len, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*!
+ * Finalizer to spread a 64-bit key over the bits used for indexing.
+ */
+inline uint64_t btleMixKey(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+/*!
+ * Duplicate suppression cache for decoded packets.
+ *
+ * Each entry is keyed on the advertiser and PDU type,
+ * and remembers a hash of the last payload that was forwarded.
+ * The table is a fixed-size open-addressing array: a key may live in
+ * any of PROBE_LENGTH slots after its home slot, and when all of them
+ * are taken the least recently seen entry in that window is evicted.
+ * No allocation happens after construction.
+ */
+class BTLEDedupCache
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    //! Create a cache, the capacity must be a power of two
+    BTLEDedupCache(const size_t capacity = 4096):
+        _mask(capacity-1),
+        _slots(capacity+PROBE_LENGTH),
+        _window(0),
+        _forwardOnChange(false)
+    {
+        return;
+    }
+
+    //! Duplicates seen within this duration of the last forwarded copy are dropped
+    void setWindow(const Clock::duration &window)
+    {
+        _window = window;
+    }
+
+    //! When set, a payload is only forwarded when it differs from the last one
+    void setForwardOnChange(const bool forwardOnChange)
+    {
+        _forwardOnChange = forwardOnChange;
+    }
+
+    void clear(void)
+    {
+        for (auto &slot : _slots) slot.used = false;
+    }
+
+    /*!
+     * Check a packet against the cache and record it.
+     * \param key identifies the source (advertiser address and PDU type)
+     * \param payloadHash hash over the payload bytes
+     * \param now the current time
+     * \return true when the packet should be forwarded
+     */
+    bool check(const uint64_t key, const uint64_t payloadHash, const Clock::time_point &now)
+    {
+        const size_t home = size_t(btleMixKey(key)) & _mask;
+        Slot *victim = nullptr;
+        for (size_t i = home; i < home+PROBE_LENGTH; i++)
+        {
+            auto &slot = _slots[i];
+            if (slot.used and slot.key == key)
+            {
+                slot.lastSeen = now;
+                const bool changed = slot.payloadHash != payloadHash;
+                const bool expired = not _forwardOnChange and now >= slot.lastForward + _window;
+                if (not changed and not expired) return false;
+                slot.payloadHash = payloadHash;
+                slot.lastForward = now;
+                return true;
+            }
+            if (victim == nullptr or not slot.used or
+                (victim->used and slot.lastSeen < victim->lastSeen)) victim = &slot;
+        }
+
+        //new source: take a free slot or evict the least recently seen one
+        victim->used = true;
+        victim->key = key;
+        victim->payloadHash = payloadHash;
+        victim->lastSeen = now;
+        victim->lastForward = now;
+        return true;
+    }
+
+private:
+    static const size_t PROBE_LENGTH = 8;
+
+    struct Slot
+    {
+        Slot(void): used(false), key(0), payloadHash(0) {}
+        bool used;
+        uint64_t key;
+        uint64_t payloadHash;
+        Clock::time_point lastSeen;
+        Clock::time_point lastForward;
+    };
+
+    const size_t _mask;
+    std::vector<Slot> _slots;
+    Clock::duration _window;
+    bool _forwardOnChange;
+};
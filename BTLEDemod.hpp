@@ -0,0 +1,143 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include "BTLEUtils.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <complex>
+#include <algorithm>
+
+/*!
+ * Link quality of one decoded packet.
+ * Power levels are in dB relative to a full scale of 1.0,
+ * so they are dBFS for normalized complex samples.
+ */
+struct BTLELinkEstimate
+{
+    double rssi; //mean packet power, dB
+    double noise; //noise floor before the packet, dB
+    double snr; //rssi over noise, dB
+    double cfo; //carrier frequency offset, Hz
+};
+
+/*!
+ * Frequency discriminator for complex baseband input to the BTLE decoder.
+ *
+ * Each sample is demodulated to the same scale as the "Freq Demod" block
+ * output (pi radians per sample = 32768), and its power is recorded in a
+ * ring that runs in step with the decoder ring buffer.
+ * The noise floor follows the minimum of 256-sample block powers with a slow rise.
+ * When the decoder finds a packet, the estimates come from the samples
+ * of the packet that are still in the rings, so there is no extra pass
+ * over the stream.
+ */
+class BTLEComplexDemod
+{
+public:
+    BTLEComplexDemod(void)
+    {
+        this->reset();
+    }
+
+    //! Restart the rings, call with BTLEUtilsDecoder::reset() to keep them in step
+    void reset(void)
+    {
+        _last = std::complex<float>(0.0f, 0.0f);
+        _head = -1;
+        for (size_t i = 0; i < RB_SIZE; i++) _power[i] = 0.0f;
+        _blockSum = 0.0;
+        _blockCount = 0;
+        _noiseFloor = 0.0;
+    }
+
+    //! Demodulate one sample, the result is fed to BTLEUtilsDecoder::feedOne()
+    int16_t feed(const std::complex<float> &x)
+    {
+        const auto d = x*std::conj(_last);
+        _last = x;
+
+        //power ring in step with the decoder ring buffer
+        const float p = std::norm(x);
+        _head = (_head+1)%RB_SIZE;
+        _power[_head] = p;
+
+        //noise floor: fall to quiet blocks immediately, rise slowly through bursts
+        _blockSum += p;
+        if (++_blockCount == BLOCK_SIZE)
+        {
+            const double mean = _blockSum/BLOCK_SIZE;
+            if (mean < _noiseFloor or _noiseFloor == 0.0) _noiseFloor = mean;
+            else _noiseFloor += (mean - _noiseFloor)*NOISE_RISE;
+            _blockSum = 0.0;
+            _blockCount = 0;
+        }
+
+        const float phase = std::atan2(d.imag(), d.real())*float(32768/M_PI);
+        return int16_t(std::max(-32768.0f, std::min(32767.0f, phase)));
+    }
+
+    //! Override the noise floor, ex: with the floor of a squelch that skips the quiet samples
+    void setNoiseFloor(const double power)
+    {
+        _noiseFloor = power;
+    }
+
+    /*!
+     * Estimate the link quality of the packet that the decoder just found.
+     * \param decoder the decoder after feedOne() returned true
+     * \param sampleRate the input sample rate in Hz
+     */
+    BTLELinkEstimate estimate(const BTLEUtilsDecoder &decoder, const double sampleRate) const
+    {
+        //the packet in the rings: preamble, access address, pdu, and crc,
+        //both rings have the same index for the same sample
+        const size_t numBits = (1+4+decoder.pduLength+3)*8;
+        const size_t numSamples = std::min<size_t>(numBits*decoder.srate, RB_SIZE);
+
+        double powerSum = 0.0;
+        int64_t markSum = 0, spaceSum = 0;
+        size_t numMarks = 0;
+        for (size_t l = 0; l < numSamples; l++)
+        {
+            const size_t index = (decoder.pduStart+l)%RB_SIZE;
+            powerSum += _power[index];
+            const int16_t phase = decoder.rb_buf[index];
+            if (phase > decoder.g_threshold) {markSum += phase; numMarks++;}
+            else spaceSum += phase;
+        }
+
+        //the frequency offset is the midpoint of the mark and space tones,
+        //which unlike the plain mean does not depend on the balance of the data
+        double offset = decoder.g_threshold;
+        if (numMarks != 0 and numMarks != numSamples)
+        {
+            offset = (double(markSum)/numMarks + double(spaceSum)/(numSamples-numMarks))/2;
+        }
+
+        BTLELinkEstimate est;
+        const double power = powerSum/numSamples;
+        est.rssi = toDB(power);
+        est.noise = toDB(_noiseFloor);
+        est.snr = toDB(std::max(power - _noiseFloor, 0.0)) - est.noise;
+        est.cfo = offset*(M_PI/32768)*sampleRate/(2*M_PI);
+        return est;
+    }
+
+private:
+    static const size_t BLOCK_SIZE = 256;
+    static constexpr double NOISE_RISE = 0.02;
+
+    static double toDB(const double power)
+    {
+        return 10*std::log10(std::max(power, 1e-20));
+    }
+
+    std::complex<float> _last;
+    int _head;
+    float _power[RB_SIZE];
+    double _blockSum;
+    size_t _blockCount;
+    double _noiseFloor;
+};
@@ -0,0 +1,174 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include "BTLEDedupCache.hpp" //btleMixKey
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*!
+ * Pack a 48-bit device address and a 16-bit service UUID into a table key.
+ */
+inline uint64_t btleDeviceKey(const uint64_t mac, const uint16_t uuid16)
+{
+    return (mac << 16) | uuid16;
+}
+
+/*!
+ * Parse a "aa:bb:cc:dd:ee:ff" formatted address into a 48-bit integer.
+ * \return false if the string is not a valid address
+ */
+inline bool btleParseMAC(const std::string &str, uint64_t &mac)
+{
+    if (str.size() != 17) return false;
+    mac = 0;
+    for (size_t i = 0; i < 17; i++)
+    {
+        const char ch = str[i];
+        if (i % 3 == 2)
+        {
+            if (ch != ':') return false;
+            continue;
+        }
+        unsigned nibble;
+        if (ch >= '0' and ch <= '9') nibble = ch - '0';
+        else if (ch >= 'a' and ch <= 'f') nibble = ch - 'a' + 10;
+        else if (ch >= 'A' and ch <= 'F') nibble = ch - 'A' + 10;
+        else return false;
+        mac = (mac << 4) | nibble;
+    }
+    return true;
+}
+
+/*!
+ * Format a device key as "aa:bb:cc:dd:ee:ff/uuid".
+ */
+inline std::string btleDeviceKeyToString(const uint64_t key)
+{
+    char buff[32];
+    const uint64_t mac = key >> 16;
+    std::snprintf(buff, sizeof(buff), "%02x:%02x:%02x:%02x:%02x:%02x/%04x",
+        unsigned(mac >> 40) & 0xff, unsigned(mac >> 32) & 0xff, unsigned(mac >> 24) & 0xff,
+        unsigned(mac >> 16) & 0xff, unsigned(mac >> 8) & 0xff, unsigned(mac >> 0) & 0xff,
+        unsigned(key & 0xffff));
+    return buff;
+}
+
+/*!
+ * Parse a device key formatted by btleDeviceKeyToString().
+ */
+inline bool btleParseDeviceKey(const std::string &str, uint64_t &key)
+{
+    uint64_t mac;
+    if (str.size() < 19 or str[17] != '/') return false;
+    if (not btleParseMAC(str.substr(0, 17), mac)) return false;
+    const auto uuid = std::strtoul(str.c_str()+18, nullptr, 16);
+    key = btleDeviceKey(mac, uint16_t(uuid));
+    return true;
+}
+
+/*!
+ * Flat hash table of per-device records keyed by a 64-bit key.
+ *
+ * Records are stored densely in insertion order and are never removed
+ * (except by clear), so a record's index is a stable handle for other structures.
+ * The index is an open-addressing array with linear probing,
+ * kept at most half full, so lookups are O(1) with one or two probes.
+ */
+template <typename Value>
+class BTLEDeviceTable
+{
+public:
+    BTLEDeviceTable(void)
+    {
+        this->clear();
+    }
+
+    void clear(void)
+    {
+        _keys.clear();
+        _values.clear();
+        _slots.assign(64, Slot());
+    }
+
+    size_t size(void) const
+    {
+        return _values.size();
+    }
+
+    Value &operator[](const size_t index)
+    {
+        return _values[index];
+    }
+
+    const Value &operator[](const size_t index) const
+    {
+        return _values[index];
+    }
+
+    uint64_t keyAt(const size_t index) const
+    {
+        return _keys[index];
+    }
+
+    //! Find a record by key, return the index or size() when not found
+    size_t find(const uint64_t key) const
+    {
+        const size_t mask = _slots.size()-1;
+        for (size_t i = size_t(btleMixKey(key)) & mask;; i = (i+1) & mask)
+        {
+            const auto &slot = _slots[i];
+            if (slot.index == 0) return this->size();
+            if (slot.key == key) return slot.index-1;
+        }
+    }
+
+    //! Find a record by key, or insert a default record
+    size_t findOrInsert(const uint64_t key, bool &inserted)
+    {
+        const size_t mask = _slots.size()-1;
+        for (size_t i = size_t(btleMixKey(key)) & mask;; i = (i+1) & mask)
+        {
+            auto &slot = _slots[i];
+            if (slot.index != 0 and slot.key != key) continue;
+            inserted = slot.index == 0;
+            if (not inserted) return slot.index-1;
+
+            slot.key = key;
+            slot.index = uint32_t(_values.size()+1);
+            _keys.push_back(key);
+            _values.emplace_back();
+            if (_values.size()*2 > _slots.size()) this->grow();
+            return _values.size()-1;
+        }
+    }
+
+private:
+    void grow(void)
+    {
+        const size_t mask = _slots.size()*2-1;
+        _slots.assign(mask+1, Slot());
+        for (size_t index = 0; index < _keys.size(); index++)
+        {
+            size_t i = size_t(btleMixKey(_keys[index])) & mask;
+            while (_slots[i].index != 0) i = (i+1) & mask;
+            _slots[i].key = _keys[index];
+            _slots[i].index = uint32_t(index+1);
+        }
+    }
+
+    struct Slot
+    {
+        Slot(void): key(0), index(0) {}
+        uint64_t key;
+        uint32_t index; //record index + 1, 0 when empty
+    };
+
+    std::vector<Slot> _slots;
+    std::vector<uint64_t> _keys;
+    std::vector<Value> _values;
+};
@@ -0,0 +1,784 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!
+ * Append-only history of sensor values on disk, for months of readings per device.
+ *
+ * The store is a directory with one segment file per UTC day, ex: 20160301.bth.
+ * A segment is a 16 byte file header followed by chunks of consecutive readings
+ * of one device. The writer thread keeps one open chunk per device across batches,
+ * and closes it after 1024 readings, 10 minutes, 60 seconds without a reading,
+ * or at the end of the day. Each chunk has a fixed 64 byte header with the device key,
+ * the point count, the time range, and the min, max, and sum of the values,
+ * followed by two compressed columns:
+ *
+ *  - timestamps: delta of delta in nanoseconds, zigzag varints,
+ *    so readings at a steady interval take one byte each
+ *  - values: the XOR with the previous value, stored as a control byte
+ *    (leading and trailing zero bytes) and the remaining middle bytes,
+ *    so a repeated value takes one byte
+ *
+ * Queries map the segments read-only and walk the chunk headers.
+ * Chunks outside the time range or of other devices are skipped,
+ * chunks wholly inside an aggregation bucket are merged from the header,
+ * and only chunks across a boundary have their columns decoded.
+ * The open chunks are still in memory and are queried through the writer.
+ *
+ * A crash loses the open chunks, at most 10 minutes of readings.
+ * A chunk torn by a crash or a failed write at the end of a segment is ignored,
+ * and cut off when the writer starts again, so later chunks are appended after valid data.
+ */
+
+static const uint32_t BTLE_HISTORY_FILE_MAGIC = 0x54534842; //"BHST"
+static const uint32_t BTLE_HISTORY_CHUNK_MAGIC = 0x4b434842; //"BHCK"
+static const uint32_t BTLE_HISTORY_VERSION = 1;
+static const int64_t BTLE_HISTORY_DAY_NS = 86400ll*1000000000ll;
+
+struct BTLEHistoryFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t dayStartNs; //!< UTC midnight of the segment day
+};
+
+struct BTLEHistoryChunk
+{
+    uint32_t magic;
+    uint32_t count; //!< number of points
+    uint64_t device; //!< device key, see btleDeviceKey()
+    int64_t firstNs; //!< first timestamp, nanoseconds since the epoch
+    int64_t lastNs; //!< last timestamp
+    double min;
+    double max;
+    double sum;
+    uint32_t timeBytes; //!< size of the timestamp column
+    uint32_t valueBytes; //!< size of the value column, followed by padding to 8 bytes
+};
+
+static_assert(sizeof(BTLEHistoryFileHeader) == 16, "BTLEHistoryFileHeader layout");
+static_assert(sizeof(BTLEHistoryChunk) == 64, "BTLEHistoryChunk layout");
+
+//! Aggregate of the values in a time range
+struct BTLEHistoryAggregate
+{
+    BTLEHistoryAggregate(void):
+        count(0),
+        sum(0.0),
+        min(std::numeric_limits<double>::quiet_NaN()),
+        max(std::numeric_limits<double>::quiet_NaN()),
+        firstNs(0),
+        lastNs(0)
+    {
+        return;
+    }
+
+    double mean(void) const
+    {
+        return (count == 0)?std::numeric_limits<double>::quiet_NaN():sum/count;
+    }
+
+    void add(const int64_t timeNs, const double value)
+    {
+        if (count == 0 or value < min) min = value;
+        if (count == 0 or value > max) max = value;
+        if (count == 0 or timeNs < firstNs) firstNs = timeNs;
+        if (count == 0 or timeNs > lastNs) lastNs = timeNs;
+        sum += value;
+        count++;
+    }
+
+    void merge(const BTLEHistoryChunk &chunk)
+    {
+        if (count == 0 or chunk.min < min) min = chunk.min;
+        if (count == 0 or chunk.max > max) max = chunk.max;
+        if (count == 0 or chunk.firstNs < firstNs) firstNs = chunk.firstNs;
+        if (count == 0 or chunk.lastNs > lastNs) lastNs = chunk.lastNs;
+        sum += chunk.sum;
+        count += chunk.count;
+    }
+
+    uint64_t count;
+    double sum;
+    double min;
+    double max;
+    int64_t firstNs; //!< time of the first point
+    int64_t lastNs; //!< time of the last point
+};
+
+/***********************************************************************
+ * Column codecs
+ **********************************************************************/
+inline void btleHistoryPutVarint(std::vector<uint8_t> &out, const int64_t value)
+{
+    uint64_t u = (uint64_t(value) << 1) ^ uint64_t(value >> 63); //zigzag
+    while (u >= 0x80)
+    {
+        out.push_back(uint8_t(u | 0x80));
+        u >>= 7;
+    }
+    out.push_back(uint8_t(u));
+}
+
+inline bool btleHistoryGetVarint(const uint8_t *&p, const uint8_t *end, int64_t &value)
+{
+    uint64_t u = 0;
+    for (int shift = 0; p != end and shift < 64; shift += 7)
+    {
+        const uint8_t b = *p++;
+        u |= uint64_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+        {
+            value = int64_t(u >> 1) ^ -int64_t(u & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void btleHistoryPutXor(std::vector<uint8_t> &out, const uint64_t x)
+{
+    if (x == 0)
+    {
+        out.push_back(0x80);
+        return;
+    }
+    const int lz = __builtin_clzll(x)/8;
+    const int tz = __builtin_ctzll(x)/8;
+    out.push_back(uint8_t((lz << 4) | tz));
+    for (int i = tz; i < 8-lz; i++) out.push_back(uint8_t(x >> (8*i)));
+}
+
+inline bool btleHistoryGetXor(const uint8_t *&p, const uint8_t *end, uint64_t &x)
+{
+    if (p == end) return false;
+    const uint8_t control = *p++;
+    const int lz = control >> 4, tz = control & 0xf;
+    x = 0;
+    if (lz == 8) return true;
+    if (lz+tz > 7 or end-p < 8-lz-tz) return false;
+    for (int i = tz; i < 8-lz; i++) x |= uint64_t(*p++) << (8*i);
+    return true;
+}
+
+//! Visit the points of a chunk as fcn(timeNs, value)
+template <typename Fcn>
+void btleHistoryDecodeChunk(const BTLEHistoryChunk &chunk, const uint8_t *columns, Fcn &&fcn)
+{
+    const uint8_t *t = columns, *tEnd = columns+chunk.timeBytes;
+    const uint8_t *v = tEnd, *vEnd = tEnd+chunk.valueBytes;
+    int64_t time = chunk.firstNs, delta = 0;
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < chunk.count; i++)
+    {
+        int64_t dod = 0;
+        uint64_t x;
+        if (i != 0 and not btleHistoryGetVarint(t, tEnd, dod)) return;
+        if (not btleHistoryGetXor(v, vEnd, x)) return;
+        delta += dod;
+        time += delta;
+        bits ^= x;
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        fcn(time, value);
+    }
+}
+
+//! The size of a chunk with its columns and padding
+inline size_t btleHistoryChunkSize(const BTLEHistoryChunk &chunk)
+{
+    return (sizeof(chunk) + size_t(chunk.timeBytes) + size_t(chunk.valueBytes) + 7) & ~size_t(7);
+}
+
+/*!
+ * Cut off a chunk torn by a crash or a failed write at the end of a segment,
+ * so that chunks appended later are not hidden behind it.
+ * \return false when the segment could not be checked or truncated
+ */
+inline bool btleHistoryRepairSegment(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    const size_t size = size_t(st.st_size);
+
+    //a header torn before it was complete, the writer starts the segment again
+    BTLEHistoryFileHeader header;
+    size_t valid = 0;
+    if (size >= sizeof(header) and pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)))
+    {
+        //not a segment, leave it alone
+        if (header.magic != BTLE_HISTORY_FILE_MAGIC)
+        {
+            close(fd);
+            return true;
+        }
+        valid = sizeof(header);
+        BTLEHistoryChunk chunk;
+        while (valid + sizeof(chunk) <= size and pread(fd, &chunk, sizeof(chunk), off_t(valid)) == ssize_t(sizeof(chunk)))
+        {
+            const size_t length = btleHistoryChunkSize(chunk);
+            if (chunk.magic != BTLE_HISTORY_CHUNK_MAGIC or chunk.count == 0 or valid + length > size) break;
+            valid += length;
+        }
+    }
+    const bool ok = (valid == size) or ftruncate(fd, off_t(valid)) == 0;
+    close(fd);
+    return ok;
+}
+
+//! The segment file name of a UTC day, ex: "20160301.bth"
+inline std::string btleHistorySegmentName(const int64_t timeNs)
+{
+    const std::time_t secs = std::time_t(timeNs/1000000000);
+    std::tm tm;
+    gmtime_r(&secs, &tm);
+    char name[32];
+    std::strftime(name, sizeof(name), "%Y%m%d.bth", &tm);
+    return name;
+}
+
+/***********************************************************************
+ * Writer: batches points on the caller's thread, writes on its own thread
+ **********************************************************************/
+class BTLEHistoryWriter
+{
+public:
+    BTLEHistoryWriter(void):
+        _running(false),
+        _dropped(0),
+        _failedWrites(0)
+    {
+        return;
+    }
+
+    ~BTLEHistoryWriter(void)
+    {
+        this->stop();
+    }
+
+    /*!
+     * Start writing into a directory, which is created when missing.
+     * \throws std::runtime_error when the directory is not usable
+     */
+    void start(const std::string &dir)
+    {
+        this->stop();
+        if (mkdir(dir.c_str(), 0755) != 0 and errno != EEXIST) throw std::runtime_error("mkdir("+dir+"): "+std::strerror(errno));
+        if (access(dir.c_str(), W_OK) != 0) throw std::runtime_error(dir+": "+std::strerror(errno));
+
+        //cut off chunks torn by a crash before appending again
+        if (DIR *d = opendir(dir.c_str()))
+        {
+            while (const auto entry = readdir(d))
+            {
+                const std::string name(entry->d_name);
+                if (name.size() != 12 or name.compare(8, 4, ".bth") != 0) continue;
+                if (not btleHistoryRepairSegment(dir + "/" + name)) _failedWrites++;
+            }
+            closedir(d);
+        }
+
+        _dir = dir;
+        _batch.clear();
+        _running = true;
+        _thread = std::thread(&BTLEHistoryWriter::writerLoop, this);
+    }
+
+    //! Write the pending points and open chunks and stop the writer thread
+    void stop(void)
+    {
+        if (not _thread.joinable()) return;
+        this->flush();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+        _cond.notify_one();
+        _thread.join();
+    }
+
+    //! Add a point to the current batch, no system calls
+    void append(const uint64_t device, const int64_t timeNs, const double value)
+    {
+        Point point;
+        point.device = device;
+        point.timeNs = timeNs;
+        point.value = value;
+        _batch.push_back(point);
+    }
+
+    //! The number of points in the current batch
+    size_t pending(void) const
+    {
+        return _batch.size();
+    }
+
+    /*!
+     * Hand the current batch to the writer thread.
+     * When the writer is 16 batches behind, the batch is dropped rather than wait.
+     */
+    void flush(void)
+    {
+        if (_batch.empty()) return;
+        std::vector<Point> next;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_pending.size() >= MAX_PENDING_BATCHES)
+            {
+                _dropped += _batch.size();
+                _batch.clear();
+                return;
+            }
+            _pending.emplace_back(std::move(_batch));
+            if (not _recycled.empty())
+            {
+                next.swap(_recycled.back());
+                _recycled.pop_back();
+            }
+        }
+        _cond.notify_one();
+        next.clear();
+        _batch.swap(next);
+    }
+
+    //! The number of points dropped because the writer fell behind
+    unsigned long long dropped(void) const
+    {
+        return _dropped;
+    }
+
+    //! The number of chunks that could not be written
+    unsigned long long failedWrites(void) const
+    {
+        return _failedWrites;
+    }
+
+    /*!
+     * Lock the chunks for a query. While the lock is held no chunk
+     * is closed or written, so the segments and the open chunks
+     * together hold every point exactly once. Called from any thread.
+     */
+    std::unique_lock<std::mutex> lockChunks(void) const
+    {
+        return std::unique_lock<std::mutex>(_chunkMutex);
+    }
+
+    /*!
+     * Visit the chunks not yet written as fcn(chunk, columns),
+     * like the chunks of the segments. Call with lockChunks() held.
+     */
+    template <typename Fcn>
+    void forEachOpenChunk(Fcn &&fcn) const
+    {
+        std::vector<uint8_t> columns;
+        for (const auto &pair : _open)
+        {
+            const auto &open = pair.second;
+            auto chunk = open.header;
+            chunk.timeBytes = uint32_t(open.times.size());
+            chunk.valueBytes = uint32_t(open.values.size());
+            columns.assign(open.times.begin(), open.times.end());
+            columns.insert(columns.end(), open.values.begin(), open.values.end());
+            fcn(chunk, columns.data());
+        }
+    }
+
+private:
+    static const size_t MAX_PENDING_BATCHES = 16;
+    static const uint32_t CHUNK_MAX_POINTS = 1024;
+    static const int64_t CHUNK_MAX_SPAN_NS = 600ll*1000000000ll;
+    static const int64_t CHUNK_IDLE_NS = 60ll*1000000000ll;
+
+    struct Point
+    {
+        uint64_t device;
+        int64_t timeNs;
+        double value;
+    };
+
+    //a chunk being filled by the writer thread
+    struct OpenChunk
+    {
+        BTLEHistoryChunk header;
+        int64_t day;
+        int64_t prevDelta;
+        uint64_t prevBits;
+        std::vector<uint8_t> times;
+        std::vector<uint8_t> values;
+    };
+
+    void writerLoop(void)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            //no readings at all for the idle time: write the open chunks
+            if (not _cond.wait_for(lock, std::chrono::nanoseconds(int64_t(CHUNK_IDLE_NS)),
+                [this](){return not _running or not _pending.empty();}))
+            {
+                lock.unlock();
+                this->closeChunks(std::numeric_limits<int64_t>::max());
+                lock.lock();
+                continue;
+            }
+            if (_pending.empty()) //not running and all written
+            {
+                lock.unlock();
+                this->closeChunks(std::numeric_limits<int64_t>::max());
+                break;
+            }
+
+            auto batch = std::move(_pending.front());
+            _pending.pop_front();
+            lock.unlock();
+
+            {
+                std::lock_guard<std::mutex> chunkLock(_chunkMutex);
+                this->writeBatch(batch);
+            }
+
+            lock.lock();
+            _recycled.emplace_back(std::move(batch));
+        }
+    }
+
+    //add the points to the open chunk of each device, and write the chunks that close
+    void writeBatch(std::vector<Point> &batch)
+    {
+        std::stable_sort(batch.begin(), batch.end(), [](const Point &a, const Point &b)
+        {
+            if (a.device != b.device) return a.device < b.device;
+            return a.timeNs < b.timeNs;
+        });
+
+        int64_t newestNs = std::numeric_limits<int64_t>::min();
+        {
+            OpenChunk *open = nullptr;
+            for (const auto &point : batch)
+            {
+                const int64_t day = point.timeNs/BTLE_HISTORY_DAY_NS;
+                if (open == nullptr or open->header.device != point.device)
+                {
+                    const auto it = _open.find(point.device);
+                    open = (it == _open.end())?nullptr:&it->second;
+                }
+
+                //chunks are in time order within one day and bounded in size and span
+                if (open != nullptr and (open->day != day or point.timeNs < open->header.lastNs or
+                    open->header.count >= CHUNK_MAX_POINTS or point.timeNs - open->header.firstNs >= CHUNK_MAX_SPAN_NS))
+                {
+                    this->closeChunk(*open);
+                    _open.erase(point.device);
+                    open = nullptr;
+                }
+                if (open == nullptr)
+                {
+                    open = &_open[point.device];
+                    this->startChunk(*open, point, day);
+                }
+                this->appendPoint(*open, point);
+                newestNs = std::max(newestNs, point.timeNs);
+            }
+        }
+
+        //devices that stopped reporting
+        if (not batch.empty()) this->closeChunksBefore(newestNs - CHUNK_IDLE_NS);
+        else this->writeClosed();
+    }
+
+    //close and write the open chunks with a last point before the given time
+    void closeChunks(const int64_t beforeNs)
+    {
+        std::lock_guard<std::mutex> lock(_chunkMutex);
+        this->closeChunksBefore(beforeNs);
+    }
+
+    //the same with the chunk lock held
+    void closeChunksBefore(const int64_t beforeNs)
+    {
+        for (auto it = _open.begin(); it != _open.end();)
+        {
+            if (it->second.header.lastNs >= beforeNs) {++it; continue;}
+            this->closeChunk(it->second);
+            it = _open.erase(it);
+        }
+        this->writeClosed();
+    }
+
+    void startChunk(OpenChunk &open, const Point &point, const int64_t day)
+    {
+        std::memset(&open.header, 0, sizeof(open.header));
+        open.header.magic = BTLE_HISTORY_CHUNK_MAGIC;
+        open.header.device = point.device;
+        open.header.firstNs = open.header.lastNs = point.timeNs;
+        open.header.min = open.header.max = point.value;
+        open.day = day;
+        open.prevDelta = 0;
+        open.prevBits = 0;
+        open.times.clear();
+        open.values.clear();
+    }
+
+    void appendPoint(OpenChunk &open, const Point &point)
+    {
+        auto &chunk = open.header;
+        const double v = point.value;
+        chunk.min = std::min(chunk.min, v);
+        chunk.max = std::max(chunk.max, v);
+        chunk.sum += v;
+
+        const int64_t delta = point.timeNs - chunk.lastNs;
+        if (chunk.count != 0) btleHistoryPutVarint(open.times, delta - open.prevDelta);
+        chunk.lastNs = point.timeNs;
+        open.prevDelta = delta;
+
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        btleHistoryPutXor(open.values, bits ^ open.prevBits);
+        open.prevBits = bits;
+        chunk.count++;
+    }
+
+    //move a chunk into the output of its day segment
+    void closeChunk(OpenChunk &open)
+    {
+        auto &chunk = open.header;
+        chunk.timeBytes = uint32_t(open.times.size());
+        chunk.valueBytes = uint32_t(open.values.size());
+
+        auto &out = _closed[open.day];
+        const auto p = reinterpret_cast<const uint8_t *>(&chunk);
+        out.insert(out.end(), p, p+sizeof(chunk));
+        out.insert(out.end(), open.times.begin(), open.times.end());
+        out.insert(out.end(), open.values.begin(), open.values.end());
+        out.resize((out.size()+7) & ~size_t(7), 0);
+    }
+
+    void writeClosed(void)
+    {
+        for (auto &pair : _closed) this->appendSegment(pair.first, pair.second);
+        _closed.clear();
+    }
+
+    void appendSegment(const int64_t day, std::vector<uint8_t> &out)
+    {
+        const auto path = _dir + "/" + btleHistorySegmentName(day*BTLE_HISTORY_DAY_NS);
+        FILE *file = std::fopen(path.c_str(), "ab");
+        struct stat st;
+        if (file == nullptr or fstat(fileno(file), &st) != 0)
+        {
+            if (file != nullptr) std::fclose(file);
+            _failedWrites++;
+            out.clear();
+            return;
+        }
+
+        //a new segment starts with the file header
+        bool ok = true;
+        if (st.st_size == 0)
+        {
+            BTLEHistoryFileHeader header;
+            header.magic = BTLE_HISTORY_FILE_MAGIC;
+            header.version = BTLE_HISTORY_VERSION;
+            header.dayStartNs = day*BTLE_HISTORY_DAY_NS;
+            ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        }
+        ok = ok and std::fwrite(out.data(), 1, out.size(), file) == out.size();
+        ok = (std::fflush(file) == 0) and ok;
+
+        //cut off a partial write, so later chunks follow valid data
+        if (not ok)
+        {
+            _failedWrites++;
+            if (ftruncate(fileno(file), st.st_size) != 0) _failedWrites++;
+        }
+        if (std::fclose(file) != 0) _failedWrites++;
+        out.clear();
+    }
+
+    std::string _dir;
+    std::vector<Point> _batch;
+
+    //open chunks per device, written by the writer thread;
+    //the lock is held from a change to the open chunks until the closed ones are in the files
+    mutable std::mutex _chunkMutex;
+    std::unordered_map<uint64_t, OpenChunk> _open;
+    std::map<int64_t, std::vector<uint8_t>> _closed;
+
+    //batch exchange with the writer thread
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _running;
+    std::deque<std::vector<Point>> _pending;
+    std::vector<std::vector<Point>> _recycled;
+    std::atomic<unsigned long long> _dropped;
+    std::atomic<unsigned long long> _failedWrites;
+};
+
+/***********************************************************************
+ * Reader: time range queries over the mapped segments
+ **********************************************************************/
+class BTLEHistoryReader
+{
+public:
+    //! \param dir the store directory
+    BTLEHistoryReader(const std::string &dir):
+        _dir(dir)
+    {
+        return;
+    }
+
+    /*!
+     * Aggregate the values of a device in [startNs, endNs).
+     * \param device the device key, or 0 for all devices
+     * \param bucketNs the bucket length, or 0 for a single aggregate over the range
+     * \param writer the writer of the store, to include its open chunks
+     * \return one aggregate per bucket, in time order
+     * \throws std::invalid_argument for an empty range or too many buckets
+     */
+    std::vector<BTLEHistoryAggregate> query(const uint64_t device, const int64_t startNs, const int64_t endNs, const int64_t bucketNs = 0,
+        const BTLEHistoryWriter *writer = nullptr) const
+    {
+        if (endNs <= startNs) throw std::invalid_argument("empty time range");
+        const int64_t bucket = (bucketNs <= 0)?(endNs-startNs):bucketNs;
+        const int64_t numBuckets = (endNs-startNs-1)/bucket+1;
+        if (numBuckets > MAX_BUCKETS) throw std::invalid_argument("too many buckets");
+        std::vector<BTLEHistoryAggregate> result(static_cast<size_t>(numBuckets));
+
+        this->forEachChunk(startNs, endNs, writer, [&](const BTLEHistoryChunk &chunk, const uint8_t *columns)
+        {
+            if (device != 0 and chunk.device != device) return;
+
+            //the whole chunk is in one bucket: use the header
+            if (chunk.firstNs >= startNs and chunk.lastNs < endNs and
+                (chunk.firstNs-startNs)/bucket == (chunk.lastNs-startNs)/bucket)
+            {
+                result[size_t((chunk.firstNs-startNs)/bucket)].merge(chunk);
+                return;
+            }
+
+            btleHistoryDecodeChunk(chunk, columns, [&](const int64_t timeNs, const double value)
+            {
+                if (timeNs < startNs or timeNs >= endNs) return;
+                result[size_t((timeNs-startNs)/bucket)].add(timeNs, value);
+            });
+        });
+        return result;
+    }
+
+    /*!
+     * Visit the points in [startNs, endNs) as fcn(device, timeNs, value),
+     * in segment order and time order within each device chunk,
+     * followed by the open chunks of the writer when given.
+     */
+    template <typename Fcn>
+    void scan(const uint64_t device, const int64_t startNs, const int64_t endNs, Fcn &&fcn,
+        const BTLEHistoryWriter *writer = nullptr) const
+    {
+        this->forEachChunk(startNs, endNs, writer, [&](const BTLEHistoryChunk &chunk, const uint8_t *columns)
+        {
+            if (device != 0 and chunk.device != device) return;
+            btleHistoryDecodeChunk(chunk, columns, [&](const int64_t timeNs, const double value)
+            {
+                if (timeNs >= startNs and timeNs < endNs) fcn(chunk.device, timeNs, value);
+            });
+        });
+    }
+
+private:
+    static const int64_t MAX_BUCKETS = 1 << 20;
+
+    //map each segment that may overlap the range and visit the chunks that do,
+    //then the open chunks of the writer, with no chunk written in between
+    template <typename Fcn>
+    void forEachChunk(const int64_t startNs, const int64_t endNs, const BTLEHistoryWriter *writer, Fcn &&fcn) const
+    {
+        if (writer == nullptr) return this->forEachSegmentChunk(startNs, endNs, fcn);
+        const auto lock = writer->lockChunks();
+        this->forEachSegmentChunk(startNs, endNs, fcn);
+        writer->forEachOpenChunk([&](const BTLEHistoryChunk &chunk, const uint8_t *columns)
+        {
+            if (chunk.lastNs >= startNs and chunk.firstNs < endNs) fcn(chunk, columns);
+        });
+    }
+
+    template <typename Fcn>
+    void forEachSegmentChunk(const int64_t startNs, const int64_t endNs, Fcn &&fcn) const
+    {
+        const auto first = btleHistorySegmentName(std::max<int64_t>(startNs, 0));
+        const auto last = btleHistorySegmentName(std::max<int64_t>(endNs-1, 0));
+        std::vector<std::string> names;
+        DIR *dir = opendir(_dir.c_str());
+        if (dir == nullptr) return;
+        while (const auto entry = readdir(dir))
+        {
+            const std::string name(entry->d_name);
+            if (name.size() != first.size() or name.compare(8, 4, ".bth") != 0) continue;
+            if (name >= first and name <= last) names.push_back(name);
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+
+        for (const auto &name : names)
+        {
+            const int fd = open((_dir + "/" + name).c_str(), O_RDONLY);
+            if (fd < 0) continue;
+            struct stat st;
+            const size_t size = (fstat(fd, &st) == 0)?size_t(st.st_size):0;
+            void *mem = (size < sizeof(BTLEHistoryFileHeader))?MAP_FAILED:mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mem == MAP_FAILED) continue;
+            madvise(mem, size, MADV_SEQUENTIAL);
+
+            const auto base = static_cast<const uint8_t *>(mem);
+            BTLEHistoryFileHeader header;
+            std::memcpy(&header, base, sizeof(header));
+            size_t offset = sizeof(header);
+            while (header.magic == BTLE_HISTORY_FILE_MAGIC and offset + sizeof(BTLEHistoryChunk) <= size)
+            {
+                BTLEHistoryChunk chunk;
+                std::memcpy(&chunk, base+offset, sizeof(chunk));
+                const size_t length = btleHistoryChunkSize(chunk);
+                if (chunk.magic != BTLE_HISTORY_CHUNK_MAGIC or chunk.count == 0 or offset + length > size) break; //torn tail
+                if (chunk.lastNs >= startNs and chunk.firstNs < endNs) fcn(chunk, base+offset+sizeof(chunk));
+                offset += length;
+            }
+            munmap(mem, size);
+        }
+    }
+
+    std::string _dir;
+};
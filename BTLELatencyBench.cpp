@@ -0,0 +1,399 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <Pothos/Init.hpp>
+#include "BTLEUtils.hpp"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <complex>
+#include <algorithm>
+#include <cstdlib>
+
+/***********************************************************************
+ * btle_latency_bench - closed loop sensor to switch latency benchmark
+ *
+ * A synthetic source feeds frequency demodulated advertisements at 2 Msps
+ * in real time into a headless btle_decoder -> btle_sensor_monitor ->
+ * brennenstuhl_3600 topology, with the monitor's "active" signal
+ * connected to the switch's "setMode" slot.
+ *
+ * The sensor value crosses the activation thresholds at known times,
+ * alternating high and low, while background advertisements from other
+ * devices load the decoder and the monitor. The latency of each crossing
+ * is measured from the delivery of the samples that end the crossing
+ * advertisement to the arrival of the first sample of the switch burst.
+ * The decoder reports a packet as soon as its last sample arrives.
+ **********************************************************************/
+
+typedef std::chrono::steady_clock Clock;
+
+static const double BTLE_RATE = 2e6;
+static const std::string SENSOR_UUID = "EA06";
+static const char *SENSOR_LOW = "20.00";
+static const char *SENSOR_HIGH = "80.00";
+static const char *BACKGROUND_VALUE = "55.55";
+
+/***********************************************************************
+ * Advertisement synthesis, the inverse of the BTLE decoder
+ **********************************************************************/
+static std::vector<uint8_t> makeAdvertisement(const uint8_t mac[6], const uint16_t uuid, const std::string &value)
+{
+    std::vector<uint8_t> pdu;
+    pdu.push_back(0x42); //ADV_NONCONN_IND, random address
+    pdu.push_back(0); //length
+    for (int i = 5; i >= 0; i--) pdu.push_back(mac[i]);
+    const uint8_t flags[] = {2, 0x01, 0x06};
+    pdu.insert(pdu.end(), flags, flags+3);
+    pdu.push_back(uint8_t(3+value.size()));
+    pdu.push_back(0x16); //service data
+    pdu.push_back(uint8_t(uuid >> 0));
+    pdu.push_back(uint8_t(uuid >> 8));
+    pdu.insert(pdu.end(), value.begin(), value.end());
+    pdu[1] = uint8_t(pdu.size()-2);
+    return pdu;
+}
+
+//frequency demodulated samples of an advertisement, 2 samples per bit
+static void modulateAdvertisement(std::vector<int16_t> &out, const std::vector<uint8_t> &pdu, const int channel)
+{
+    //the decoder works on air order bytes, first bit in the msb
+    BTLEUtilsDecoder codec;
+    std::vector<uint8_t> air;
+    for (const auto b : pdu) air.push_back(codec.SwapBits(b));
+    uint8_t crc[3] = {0x55, 0x55, 0x55};
+    const uint32_t crc24 = codec.BTLECrc(air.data(), air.size(), crc);
+    for (int i = 2; i >= 0; i--) air.push_back(uint8_t(crc24 >> (8*i)));
+    codec.BTLEWhiten(air.data(), air.size(), uint8_t(channel));
+
+    //preamble and access address in front
+    std::vector<uint8_t> bytes(1, 0x55);
+    for (int i = 0; i < 4; i++) bytes.push_back(codec.SwapBits(uint8_t(0x8E89BED6 >> (8*i))));
+    bytes.insert(bytes.end(), air.begin(), air.end());
+    for (const auto b : bytes)
+    {
+        for (int i = 7; i >= 0; i--)
+        {
+            const int16_t level = ((b >> i) & 1)?8000:-8000;
+            out.push_back(level);
+            out.push_back(level);
+        }
+    }
+}
+
+/***********************************************************************
+ * Real time source of sensor and background advertisements
+ **********************************************************************/
+struct BenchConfig
+{
+    double load; //background advertisements per second
+    size_t numCrossings;
+    double crossingInterval;
+    double sensorInterval;
+    size_t chunkSize;
+    size_t repeat;
+};
+
+class BenchSource : public Pothos::Block
+{
+public:
+    BenchSource(const BenchConfig &config):
+        _config(config),
+        _random(1234),
+        _index(0),
+        _nextSensor(0),
+        _nextBackground(0),
+        _sensorHigh(false)
+    {
+        static const uint8_t sensorMac[6] = {0xc0, 0xff, 0xee, 0x00, 0x00, 0x01};
+        modulateAdvertisement(_sensorLowSamps, makeAdvertisement(sensorMac, 0xEA06, SENSOR_LOW), 38);
+        modulateAdvertisement(_sensorHighSamps, makeAdvertisement(sensorMac, 0xEA06, SENSOR_HIGH), 38);
+        _nextBackground = this->backgroundGap();
+        this->setupOutput(0, typeid(int16_t));
+    }
+
+    void activate(void)
+    {
+        _startTime = Clock::now();
+    }
+
+    void work(void)
+    {
+        auto outPort = this->output(0);
+        const size_t n = std::min(outPort->elements(), _config.chunkSize);
+        if (n == 0) return;
+
+        //deliver the chunk when its last sample would arrive from a receiver
+        std::this_thread::sleep_until(_startTime + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>((_index+n)/BTLE_RATE)));
+
+        auto out = outPort->buffer().as<int16_t *>();
+        for (size_t i = 0; i < n; i++) out[i] = this->next();
+
+        //crossings that ended in this chunk are delivered now
+        const auto now = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            while (not _crossingEnds.empty() and _crossingEnds.front() <= _index)
+            {
+                _crossingTimes.push_back(now);
+                _crossingEnds.pop_front();
+            }
+        }
+        outPort->produce(n);
+    }
+
+    std::vector<Clock::time_point> crossingTimes(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _crossingTimes;
+    }
+
+private:
+    uint64_t backgroundGap(void)
+    {
+        if (_config.load <= 0.0) return ~uint64_t(0);
+        std::exponential_distribution<double> gap(_config.load/BTLE_RATE);
+        return uint64_t(gap(_random)) + 1;
+    }
+
+    //the next sample of the stream, packets are queued back to back
+    int16_t next(void)
+    {
+        if (_packet.empty())
+        {
+            if (_index >= _nextSensor) this->startSensor();
+            else if (_index >= _nextBackground) this->startBackground();
+        }
+        _index++;
+        if (_packet.empty()) return 0;
+        const auto sample = _packet.front();
+        _packet.pop_front();
+        return sample;
+    }
+
+    void startSensor(void)
+    {
+        const uint64_t crossingSamps = uint64_t(_config.crossingInterval*BTLE_RATE);
+        const uint64_t phase = std::min<uint64_t>(_index/crossingSamps, _config.numCrossings);
+        const bool high = (phase % 2) == 1;
+        const auto &samps = high?_sensorHighSamps:_sensorLowSamps;
+        _packet.assign(samps.begin(), samps.end());
+        if (high != _sensorHigh)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _crossingEnds.push_back(_index + samps.size());
+            _sensorHigh = high;
+        }
+        _nextSensor += uint64_t(_config.sensorInterval*BTLE_RATE);
+    }
+
+    void startBackground(void)
+    {
+        uint8_t mac[6];
+        for (auto &b : mac) b = uint8_t(_random());
+        std::vector<int16_t> samps;
+        modulateAdvertisement(samps, makeAdvertisement(mac, 0x1234, BACKGROUND_VALUE), 38);
+        _packet.assign(samps.begin(), samps.end());
+        _nextBackground = _index + this->backgroundGap();
+    }
+
+    const BenchConfig _config;
+    std::mt19937 _random;
+    std::vector<int16_t> _sensorLowSamps, _sensorHighSamps;
+    std::deque<int16_t> _packet;
+    uint64_t _index;
+    uint64_t _nextSensor;
+    uint64_t _nextBackground;
+    bool _sensorHigh;
+    Clock::time_point _startTime;
+
+    std::mutex _mutex;
+    std::deque<uint64_t> _crossingEnds;
+    std::vector<Clock::time_point> _crossingTimes;
+};
+
+/***********************************************************************
+ * Sink that time stamps the first sample of each switch burst
+ **********************************************************************/
+class BenchSink : public Pothos::Block
+{
+public:
+    BenchSink(void)
+    {
+        this->setupInput(0, typeid(std::complex<float>));
+    }
+
+    void work(void)
+    {
+        auto inPort = this->input(0);
+        const auto now = Clock::now();
+        for (const auto &label : inPort->labels())
+        {
+            if (label.index >= inPort->elements()) break;
+            if (label.id != "txStart") continue;
+            std::lock_guard<std::mutex> lock(_mutex);
+            _burstTimes.push_back(now);
+        }
+        inPort->consume(inPort->elements());
+    }
+
+    std::vector<Clock::time_point> burstTimes(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _burstTimes;
+    }
+
+private:
+    std::mutex _mutex;
+    std::vector<Clock::time_point> _burstTimes;
+};
+
+/***********************************************************************
+ * Run the topology at one background load
+ **********************************************************************/
+struct BenchResult
+{
+    std::vector<double> latencies; //milliseconds
+    size_t missed;
+};
+
+static BenchResult runBench(const BenchConfig &config)
+{
+    auto source = std::make_shared<BenchSource>(config);
+    auto sink = std::make_shared<BenchSink>();
+
+    auto decoder = Pothos::BlockRegistry::make("/btle/btle_decoder");
+    decoder.call("setChannel", 38);
+
+    auto monitor = Pothos::BlockRegistry::make("/btle/btle_sensor_monitor");
+    monitor.call("setServiceUUID", SENSOR_UUID);
+    monitor.call("setActivationLevel", 50.0);
+    monitor.call("setDeactivationLevel", 40.0);
+    monitor.call("setAlarmTimeout", 1e6);
+
+    auto switcher = Pothos::BlockRegistry::make("/btle/brennenstuhl_3600");
+    switcher.call("setRate", 250e3);
+    switcher.call("setRepeat", config.repeat);
+    switcher.call("setStartLabel", std::string("txStart"));
+
+    {
+        Pothos::Topology topology;
+        topology.connect(std::shared_ptr<Pothos::Block>(source), "0", decoder, "0");
+        topology.connect(decoder, "0", monitor, "0");
+        topology.connect(monitor, "active", switcher, "setMode");
+        topology.connect(switcher, "0", std::shared_ptr<Pothos::Block>(sink), "0");
+        topology.commit();
+        std::this_thread::sleep_for(std::chrono::duration<double>(
+            (config.numCrossings+1)*config.crossingInterval + 0.5));
+        topology.disconnectAll();
+        topology.commit();
+    }
+
+    //pair each crossing with the first burst before the next crossing
+    const auto crossings = source->crossingTimes();
+    const auto bursts = sink->burstTimes();
+    BenchResult result;
+    result.missed = 0;
+    for (size_t i = 0; i < crossings.size(); i++)
+    {
+        const auto it = std::upper_bound(bursts.begin(), bursts.end(), crossings[i]);
+        if (it == bursts.end() or (i+1 < crossings.size() and *it > crossings[i+1])) result.missed++;
+        else result.latencies.push_back(std::chrono::duration<double, std::milli>(*it - crossings[i]).count());
+    }
+    result.missed += config.numCrossings - std::min(config.numCrossings, crossings.size());
+    return result;
+}
+
+static double percentile(const std::vector<double> &sorted, const double p)
+{
+    if (sorted.empty()) return 0.0;
+    return sorted[std::min(sorted.size()-1, size_t(p*sorted.size()))];
+}
+
+static void printUsage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [options]" << std::endl
+        << "  --loads=LIST        background advertisements per second (default 0,200,500,1000,2000)" << std::endl
+        << "  --crossings=N       threshold crossings per load (default 40)" << std::endl
+        << "  --interval=SEC      time between crossings (default 0.25)" << std::endl
+        << "  --sensor-interval=SEC  time between sensor advertisements (default 0.02)" << std::endl
+        << "  --chunk=N           samples per source buffer (default 4096)" << std::endl
+        << "  --repeat=N          packets per switch burst (default 1)" << std::endl;
+}
+
+static bool parseOption(const std::string &arg, const std::string &name, std::string &value)
+{
+    const std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig config;
+    config.load = 0.0;
+    config.numCrossings = 40;
+    config.crossingInterval = 0.25;
+    config.sensorInterval = 0.02;
+    config.chunkSize = 4096;
+    config.repeat = 1;
+    std::vector<double> loads = {0, 200, 500, 1000, 2000};
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+        std::string value;
+        if (parseOption(arg, "loads", value))
+        {
+            loads.clear();
+            std::istringstream iss(value);
+            std::string token;
+            while (std::getline(iss, token, ',')) loads.push_back(std::stod(token));
+        }
+        else if (parseOption(arg, "crossings", value)) config.numCrossings = std::stoul(value);
+        else if (parseOption(arg, "interval", value)) config.crossingInterval = std::stod(value);
+        else if (parseOption(arg, "sensor-interval", value)) config.sensorInterval = std::stod(value);
+        else if (parseOption(arg, "chunk", value)) config.chunkSize = std::stoul(value);
+        else if (parseOption(arg, "repeat", value)) config.repeat = std::stoul(value);
+        else if (arg == "--help" or arg == "-h") {printUsage(argv[0]); return EXIT_SUCCESS;}
+        else {printUsage(argv[0]); return EXIT_FAILURE;}
+    }
+    if (loads.empty() or config.numCrossings == 0 or config.chunkSize == 0 or
+        config.sensorInterval <= 0.0 or config.crossingInterval < 2*config.sensorInterval)
+    {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Pothos::ScopedInit init;
+
+    std::cout << "    load/s  crossings  missed     min     p50     p90     p99     max  (ms)" << std::endl;
+    for (const auto load : loads)
+    {
+        config.load = load;
+        auto result = runBench(config);
+        auto &l = result.latencies;
+        std::sort(l.begin(), l.end());
+        std::cout << std::fixed << std::setprecision(2)
+            << std::setw(10) << load
+            << std::setw(11) << config.numCrossings
+            << std::setw(8) << result.missed
+            << std::setw(8) << (l.empty()?0.0:l.front())
+            << std::setw(8) << percentile(l, 0.50)
+            << std::setw(8) << percentile(l, 0.90)
+            << std::setw(8) << percentile(l, 0.99)
+            << std::setw(8) << (l.empty()?0.0:l.back())
+            << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <Pothos/Framework.hpp>
+#include "BTLEUtils.hpp"
+#include "BTLEDemod.hpp"
+#include "BTLEDedupCache.hpp"
+#include "BTLEPacketRecord.hpp"
+#include "BTLEPduFilter.hpp"
+#include <string>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+
+/*!
+ * The handling of a packet after the CRC check, shared by the decoder blocks:
+ * the address and UUID filter, the link estimate limits, duplicate suppression,
+ * and the output as a dictionary message or as a record in a batch.
+ * Each step runs on the raw PDU, cheapest first, and only packets
+ * that pass every step are formatted.
+ */
+class BTLEPacketHandler
+{
+public:
+    BTLEPacketHandler(void):
+        _dedupEnabled(false),
+        _minRSSI(-200.0),
+        _minSNR(-200.0),
+        _cfoAvg(0.0),
+        _batchOutput(false)
+    {
+        return;
+    }
+
+    //! "OFF", "WINDOW", or "CHANGE", \throws std::invalid_argument for other modes
+    void setDedupMode(const std::string &mode)
+    {
+        if (mode == "OFF") _dedupEnabled = false;
+        else if (mode == "WINDOW") _dedupEnabled = true;
+        else if (mode == "CHANGE") _dedupEnabled = true;
+        else throw std::invalid_argument("unknown mode");
+        _dedup.setForwardOnChange(mode == "CHANGE");
+        _dedup.clear();
+    }
+
+    void setDedupWindow(const double window)
+    {
+        _dedup.setWindow(std::chrono::milliseconds(long(window*1000)));
+    }
+
+    //! "OFF", "ALLOW", or "DENY", \throws std::invalid_argument for other modes
+    void setFilterMode(const std::string &mode)
+    {
+        if (mode == "OFF") _filter.setMode(BTLEPduFilter::MODE_OFF);
+        else if (mode == "ALLOW") _filter.setMode(BTLEPduFilter::MODE_ALLOW);
+        else if (mode == "DENY") _filter.setMode(BTLEPduFilter::MODE_DENY);
+        else throw std::invalid_argument("unknown mode");
+    }
+
+    //! \throws std::invalid_argument for an entry that is neither an address nor a UUID
+    void setFilterList(const std::string &list)
+    {
+        _filter.setList(list);
+    }
+
+    void setMinRSSI(const double minRSSI)
+    {
+        _minRSSI = minRSSI;
+    }
+
+    void setMinSNR(const double minSNR)
+    {
+        _minSNR = minSNR;
+    }
+
+    void setBatchOutput(const bool batch)
+    {
+        _batchOutput = batch;
+    }
+
+    void reset(void)
+    {
+        _cfoAvg = 0.0;
+        _batch.clear();
+    }
+
+    //! The smoothed frequency offset of the forwarded packets
+    double cfo(void) const
+    {
+        return _cfoAvg;
+    }
+
+    /*!
+     * Handle the packet that the decoder just found in complex input.
+     * \param decoder the decoder after feedOne() returned true
+     * \param estimate a function returning the BTLELinkEstimate of the packet,
+     *        called only for packets that pass the filter
+     * \param output the port for dictionary messages
+     * \return true when the packet was forwarded or added to the batch
+     */
+    template <typename EstimateFcn>
+    bool handle(BTLEUtilsDecoder &decoder, EstimateFcn &&estimate, Pothos::OutputPort *output)
+    {
+        return this->process(decoder, true, estimate, output);
+    }
+
+    //! Handle the packet that the decoder just found in demodulated input
+    bool handle(BTLEUtilsDecoder &decoder, Pothos::OutputPort *output)
+    {
+        return this->process(decoder, false, []{return BTLELinkEstimate();}, output);
+    }
+
+    //! Post the batch of the packets handled since the last flush, if any
+    void flush(Pothos::OutputPort *output)
+    {
+        if (_batch.empty()) return;
+        output->postMessage(std::move(_batch));
+        _batch.clear();
+    }
+
+private:
+    template <typename EstimateFcn>
+    bool process(BTLEUtilsDecoder &decoder, const bool complexInput, EstimateFcn &&estimate, Pothos::OutputPort *output)
+    {
+        const uint8_t *pdu = decoder.pduBytes;
+        const size_t len = decoder.pduLength;
+
+        //select by address and uuid on the raw pdu, before any other work
+        if (_filter.reject(pdu, len)) return false;
+
+        //drop weak packets first, so they do not refresh the duplicate cache
+        const BTLELinkEstimate est = estimate();
+        if (complexInput and (est.rssi < _minRSSI or est.snr < _minSNR)) return false;
+
+        //drop duplicates using the raw pdu, before any formatting
+        if (_dedupEnabled)
+        {
+            uint64_t key = uint64_t(pdu[0] & 0xf) << 56; //pdu type
+            for (size_t i = 2; i < 8 and i < len; i++) key |= uint64_t(pdu[i]) << (8*(i-2)); //advertiser address
+            const auto hash = btleHashBytes(pdu+1, len-1); //length and payload
+            if (not _dedup.check(key, hash, BTLEDedupCache::Clock::now())) return false;
+        }
+
+        if (_batchOutput) this->appendBatch(decoder, complexInput, est);
+        else this->postPacket(decoder, complexInput, est, output);
+        if (complexInput) _cfoAvg += (est.cfo - _cfoAvg)*0.1;
+        return true;
+    }
+
+    void postPacket(BTLEUtilsDecoder &decoder, const bool complexInput, const BTLELinkEstimate &est, Pothos::OutputPort *output)
+    {
+        decoder.FormatBTLEPacket();
+        if (complexInput)
+        {
+            decoder.packetData["RSSI"] = Pothos::Object(est.rssi);
+            decoder.packetData["Noise"] = Pothos::Object(est.noise);
+            decoder.packetData["SNR"] = Pothos::Object(est.snr);
+            decoder.packetData["CFO"] = Pothos::Object(est.cfo);
+        }
+        output->postMessage(decoder.packetData);
+    }
+
+    void appendBatch(const BTLEUtilsDecoder &decoder, const bool complexInput, const BTLELinkEstimate &est)
+    {
+        BTLEPacketRecord record;
+        std::memset(&record, 0, sizeof(record));
+        record.sampleIndex = uint64_t(decoder.pduSample);
+        record.accessAddress = decoder.pduAddress;
+        record.crc = decoder.pduCRC;
+        record.threshold = decoder.pduThreshold;
+        record.pduLength = uint16_t(decoder.pduLength);
+        record.channel = uint8_t(decoder.channel);
+
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        BTLEPacketLink link;
+        link.rssi = complexInput?float(est.rssi):nan;
+        link.noise = complexInput?float(est.noise):nan;
+        link.snr = complexInput?float(est.snr):nan;
+        link.cfo = complexInput?float(est.cfo):nan;
+        _batch.append(record, link, decoder.pduBytes);
+    }
+
+    bool _dedupEnabled;
+    BTLEDedupCache _dedup;
+    BTLEPduFilter _filter;
+    double _minRSSI;
+    double _minSNR;
+    double _cfoAvg;
+    bool _batchOutput;
+    BTLEPacketBatch _batch;
+};
@@ -0,0 +1,103 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/*!
+ * Fixed layout header for a decoded packet in binary form.
+ * Each record is followed by pduLength bytes of dewhitened PDU
+ * (the 2-byte PDU header and the payload, without the CRC).
+ * All fields are in host byte order (little endian on supported hosts).
+ */
+struct BTLEPacketRecord
+{
+    uint64_t sampleIndex; //!< absolute input sample index of the packet start
+    uint32_t accessAddress; //!< the packet access address
+    uint32_t crc; //!< the 24-bit packet CRC
+    int32_t threshold; //!< quantization threshold (preamble mean)
+    uint16_t pduLength; //!< number of PDU bytes that follow
+    uint8_t channel; //!< advertising channel index used for dewhitening
+    uint8_t reserved;
+};
+
+static_assert(sizeof(BTLEPacketRecord) == 24, "BTLEPacketRecord layout");
+
+/*!
+ * Link estimates of a decoded packet in a batch.
+ * The fields are NaN when the decoder input was not complex.
+ */
+struct BTLEPacketLink
+{
+    float rssi; //!< mean packet power, dBFS
+    float noise; //!< noise floor, dBFS
+    float snr; //!< signal to noise ratio, dB
+    float cfo; //!< carrier frequency offset, Hz
+};
+
+static_assert(sizeof(BTLEPacketLink) == 16, "BTLEPacketLink layout");
+
+/*!
+ * A batch of decoded packets in one contiguous arena,
+ * posted as a single message in place of one dictionary per packet.
+ * Each entry is a BTLEPacketRecord, a BTLEPacketLink, and the PDU bytes,
+ * padded to a multiple of 8 bytes.
+ */
+class BTLEPacketBatch
+{
+public:
+    BTLEPacketBatch(void):
+        _count(0)
+    {
+        return;
+    }
+
+    size_t size(void) const
+    {
+        return _count;
+    }
+
+    bool empty(void) const
+    {
+        return _count == 0;
+    }
+
+    void clear(void)
+    {
+        _arena.clear();
+        _count = 0;
+    }
+
+    void append(const BTLEPacketRecord &record, const BTLEPacketLink &link, const uint8_t *pdu)
+    {
+        const size_t offset = _arena.size();
+        const size_t length = sizeof(record) + sizeof(link) + record.pduLength;
+        _arena.resize(offset + ((length+7) & ~size_t(7)), 0);
+        std::memcpy(_arena.data()+offset, &record, sizeof(record));
+        std::memcpy(_arena.data()+offset+sizeof(record), &link, sizeof(link));
+        std::memcpy(_arena.data()+offset+sizeof(record)+sizeof(link), pdu, record.pduLength);
+        _count++;
+    }
+
+    //! Call fcn(record, link, pdu) for each packet in order
+    template <typename Fcn>
+    void forEach(Fcn &&fcn) const
+    {
+        BTLEPacketRecord record;
+        BTLEPacketLink link;
+        for (size_t offset = 0; offset < _arena.size();)
+        {
+            std::memcpy(&record, _arena.data()+offset, sizeof(record));
+            std::memcpy(&link, _arena.data()+offset+sizeof(record), sizeof(link));
+            fcn(record, link, _arena.data()+offset+sizeof(record)+sizeof(link));
+            offset += (sizeof(record) + sizeof(link) + record.pduLength + 7) & ~size_t(7);
+        }
+    }
+
+private:
+    std::vector<uint8_t> _arena;
+    size_t _count;
+};
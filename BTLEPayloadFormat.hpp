@@ -0,0 +1,266 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <charconv>
+#include <stdexcept>
+
+/*!
+ * Decoder for sensor values carried in service data.
+ *
+ * The layout is described by a schema string that is compiled once
+ * into a list of typed fields, so decoding a payload is a direct
+ * load per field with no string parsing or allocation.
+ *
+ * Schema syntax:
+ *  - "ascii": the payload is text holding one floating point number
+ *  - "bthome": BTHome v2 objects (service UUID FCD2), one channel per measurement
+ *  - comma separated fields, one channel each, in payload order:
+ *    TYPE[*SCALE][+OFFSET] where TYPE is one of
+ *    u8, s8, u16le, s16le, u16be, s16be, u24le, s24le, u32le, s32le, f32le, f32be.
+ *    xN skips N bytes. Example: "s16le*0.01,u8" for a temperature in
+ *    hundredths of a degree followed by a battery percentage.
+ */
+class BTLEPayloadFormat
+{
+public:
+    //! The maximum number of channels in a payload
+    static const size_t MAX_CHANNELS = 8;
+
+    BTLEPayloadFormat(void):
+        _kind(ASCII)
+    {
+        return;
+    }
+
+    //! Compile a schema string, throws std::invalid_argument on error
+    void setSchema(const std::string &schema)
+    {
+        std::vector<Field> fields;
+        Kind kind = FIELDS;
+        if (schema.empty() or schema == "ascii") kind = ASCII;
+        else if (schema == "bthome") kind = BTHOME;
+        else
+        {
+            size_t offset = 0;
+            size_t pos = 0;
+            while (pos <= schema.size())
+            {
+                auto comma = schema.find(',', pos);
+                if (comma == std::string::npos) comma = schema.size();
+                const auto token = schema.substr(pos, comma-pos);
+                pos = comma+1;
+
+                //skip bytes
+                if (not token.empty() and token[0] == 'x')
+                {
+                    offset += parseNumber<size_t>(token.substr(1), schema);
+                    continue;
+                }
+
+                Field field;
+                field.offset = offset;
+                field.scale = 1.0;
+                field.bias = 0.0;
+                const auto typeEnd = token.find_first_of("*+");
+                field.type = parseType(token.substr(0, typeEnd), schema);
+                for (auto p = typeEnd; p != std::string::npos;)
+                {
+                    const auto next = token.find_first_of("*+", p+1);
+                    const auto value = parseNumber<double>(token.substr(p+1, next-p-1), schema);
+                    if (token[p] == '*') field.scale = value;
+                    else field.bias = value;
+                    p = next;
+                }
+                offset += typeSize(field.type);
+                fields.push_back(field);
+            }
+            if (fields.empty() or fields.size() > MAX_CHANNELS) throw std::invalid_argument(
+                "payload schema needs 1 to 8 fields: " + schema);
+        }
+        _kind = kind;
+        _fields = fields;
+    }
+
+    /*!
+     * Decode the service data payload into channel values.
+     * \return the number of channels decoded, 0 when the payload does not match
+     */
+    size_t decode(const uint8_t *data, const size_t length, double *values) const
+    {
+        switch (_kind)
+        {
+        case ASCII:
+        {
+            const auto begin = reinterpret_cast<const char *>(data);
+            if (std::from_chars(begin, begin+length, values[0]).ec != std::errc()) return 0;
+            return 1;
+        }
+        case BTHOME: return decodeBTHome(data, length, values);
+        case FIELDS: break;
+        }
+
+        for (const auto &field : _fields)
+        {
+            if (field.offset+typeSize(field.type) > length) return 0;
+        }
+        for (size_t i = 0; i < _fields.size(); i++)
+        {
+            const auto &field = _fields[i];
+            values[i] = load(field.type, data+field.offset)*field.scale + field.bias;
+        }
+        return _fields.size();
+    }
+
+private:
+    enum Kind {ASCII, BTHOME, FIELDS};
+
+    enum Type {U8, S8, U16LE, S16LE, U16BE, S16BE, U24LE, S24LE, U32LE, S32LE, F32LE, F32BE};
+
+    struct Field
+    {
+        Type type;
+        size_t offset;
+        double scale;
+        double bias;
+    };
+
+    static Type parseType(const std::string &name, const std::string &schema)
+    {
+        if (name == "u8") return U8;
+        if (name == "s8") return S8;
+        if (name == "u16le") return U16LE;
+        if (name == "s16le") return S16LE;
+        if (name == "u16be") return U16BE;
+        if (name == "s16be") return S16BE;
+        if (name == "u24le") return U24LE;
+        if (name == "s24le") return S24LE;
+        if (name == "u32le") return U32LE;
+        if (name == "s32le") return S32LE;
+        if (name == "f32le") return F32LE;
+        if (name == "f32be") return F32BE;
+        throw std::invalid_argument("unknown type '" + name + "' in payload schema: " + schema);
+    }
+
+    template <typename T>
+    static T parseNumber(const std::string &str, const std::string &schema)
+    {
+        T value;
+        const auto result = std::from_chars(str.data(), str.data()+str.size(), value);
+        if (str.empty() or result.ec != std::errc() or result.ptr != str.data()+str.size())
+            throw std::invalid_argument("bad number '" + str + "' in payload schema: " + schema);
+        return value;
+    }
+
+    static size_t typeSize(const Type type)
+    {
+        switch (type)
+        {
+        case U8: case S8: return 1;
+        case U16LE: case S16LE: case U16BE: case S16BE: return 2;
+        case U24LE: case S24LE: return 3;
+        default: return 4;
+        }
+    }
+
+    static uint32_t loadLE(const uint8_t *p, const size_t n)
+    {
+        uint32_t v = 0;
+        for (size_t i = 0; i < n; i++) v |= uint32_t(p[i]) << (8*i);
+        return v;
+    }
+
+    static uint32_t loadBE(const uint8_t *p, const size_t n)
+    {
+        uint32_t v = 0;
+        for (size_t i = 0; i < n; i++) v = (v << 8) | p[i];
+        return v;
+    }
+
+    static int32_t signExtend(const uint32_t v, const size_t bits)
+    {
+        const uint32_t m = uint32_t(1) << (bits-1);
+        return int32_t((v ^ m) - m);
+    }
+
+    static float loadFloat(const uint32_t bits)
+    {
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    static double load(const Type type, const uint8_t *p)
+    {
+        switch (type)
+        {
+        case U8: return p[0];
+        case S8: return int8_t(p[0]);
+        case U16LE: return loadLE(p, 2);
+        case S16LE: return signExtend(loadLE(p, 2), 16);
+        case U16BE: return loadBE(p, 2);
+        case S16BE: return signExtend(loadBE(p, 2), 16);
+        case U24LE: return loadLE(p, 3);
+        case S24LE: return signExtend(loadLE(p, 3), 24);
+        case U32LE: return loadLE(p, 4);
+        case S32LE: return int32_t(loadLE(p, 4));
+        case F32LE: return loadFloat(loadLE(p, 4));
+        case F32BE: return loadFloat(loadBE(p, 4));
+        }
+        return 0.0;
+    }
+
+    /*!
+     * BTHome v2: a device information octet, then objects
+     * of an object id followed by a fixed size value.
+     * Parsing stops at the first unknown object id.
+     */
+    static size_t decodeBTHome(const uint8_t *data, const size_t length, double *values)
+    {
+        if (length < 1) return 0;
+        if ((data[0] & 0x01) != 0) return 0; //encrypted
+        if ((data[0] >> 5) != 2) return 0; //version 2
+
+        size_t num = 0;
+        for (size_t pos = 1; pos < length and num < MAX_CHANNELS;)
+        {
+            Type type;
+            double scale;
+            switch (data[pos])
+            {
+            case 0x00: type = U8; scale = 0.0; break; //packet id, not a channel
+            case 0x01: type = U8; scale = 1.0; break; //battery %
+            case 0x02: type = S16LE; scale = 0.01; break; //temperature C
+            case 0x03: type = U16LE; scale = 0.01; break; //humidity %
+            case 0x04: type = U24LE; scale = 0.01; break; //pressure hPa
+            case 0x05: type = U24LE; scale = 0.01; break; //illuminance lux
+            case 0x08: type = S16LE; scale = 0.01; break; //dew point C
+            case 0x0A: type = U24LE; scale = 0.001; break; //energy kWh
+            case 0x0B: type = U24LE; scale = 0.01; break; //power W
+            case 0x0C: type = U16LE; scale = 0.001; break; //voltage V
+            case 0x0D: type = U16LE; scale = 1.0; break; //pm2.5
+            case 0x0E: type = U16LE; scale = 1.0; break; //pm10
+            case 0x12: type = U16LE; scale = 1.0; break; //co2 ppm
+            case 0x14: type = U16LE; scale = 0.01; break; //moisture %
+            case 0x2E: type = U8; scale = 1.0; break; //humidity %
+            case 0x2F: type = U8; scale = 1.0; break; //moisture %
+            case 0x3F: type = S16LE; scale = 0.1; break; //rotation deg
+            case 0x45: type = S16LE; scale = 0.1; break; //temperature C
+            default: return num;
+            }
+            pos++;
+            if (pos+typeSize(type) > length) break;
+            if (scale != 0.0) values[num++] = load(type, data+pos)*scale;
+            pos += typeSize(type);
+        }
+        return num;
+    }
+
+    Kind _kind;
+    std::vector<Field> _fields;
+};
@@ -0,0 +1,503 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <Poco/Logger.h>
+#include "BTLEPacketRecord.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <cerrno>
+#include <algorithm>
+
+//pcap link type for BLE link layer packets with the radio pseudo-header
+static const uint32_t LINKTYPE_BLUETOOTH_LE_LL_WITH_PHDR = 256;
+
+//pseudo-header flags
+static const uint16_t PHDR_DEWHITENED = 0x0001;
+static const uint16_t PHDR_SIGNAL_VALID = 0x0002;
+static const uint16_t PHDR_NOISE_VALID = 0x0004;
+static const uint16_t PHDR_REF_AA_VALID = 0x0010;
+static const uint16_t PHDR_CRC_CHECKED = 0x0400;
+static const uint16_t PHDR_CRC_VALID = 0x0800;
+
+static const uint32_t ADVERTISING_ACCESS_ADDRESS = 0x8E89BED6;
+
+//serialized records are handed to the writer thread in buffers of this size
+static const size_t FLUSH_BYTES = 1 << 20;
+
+//maximum number of filled buffers waiting on the writer thread
+static const size_t MAX_PENDING_BUFFERS = 16;
+
+//message from the writer thread to hand off a partial buffer
+struct BTLEPcapFlushTick {};
+
+/***********************************************************************
+ * |PothosDoc BTLE PCAP Writer
+ *
+ * Archive decoded BTLE packets to a pcap file that can be opened in Wireshark.
+ * Each packet is written with the LINKTYPE_BLUETOOTH_LE_LL_WITH_PHDR link type,
+ * and the pseudo-header carries the RF channel, the signal and noise power
+ * (when provided by the decoder), and the CRC status.
+ * The record timestamp is the decoder's "Timestamp" for the packet.
+ *
+ * Records are serialized into large buffers on the block's thread,
+ * and the filled buffers are written to disk by a background thread.
+ * A partial buffer is written after at most about two seconds,
+ * even when no more packets arrive.
+ * Slow storage never blocks the decoder: when the writer falls behind
+ * by more than 16 buffers, new buffers are dropped and counted
+ * (see the droppedPackets probe). Packets that could not be written
+ * because a file failed to open or to write are counted the same way.
+ *
+ * <h2>Input messages</h2>
+ *
+ * The writer expects dictionary-style messages from the BTLE decoder block.
+ * Messages without a "PDU" key are ignored.
+ * The batch messages of the decoder's batch output mode are accepted as well.
+ * Batches carry no timestamp, so their packets get the time of arrival at the writer,
+ * which trails the decode by at most one call to the decoder's work().
+ *
+ * <h2>File rotation</h2>
+ *
+ * When a rotation size or interval is set, the open time and a sequence number
+ * are inserted before the file extension, ex: capture_20160301_120000_0.pcap.
+ * Otherwise the file path is used as-is and overwritten on activation.
+ *
+ * |category /Sinks
+ * |keywords bluetooth low energy pcap wireshark file
+ *
+ * |param path[File Path] The path of the output pcap file.
+ * |default ""
+ * |widget FileEntry(mode=save)
+ *
+ * |param rotateSize[Rotate Size] Start a new file after this many megabytes.
+ * Use 0 to disable size based rotation.
+ * |units MiB
+ * |default 0
+ * |preview valid
+ *
+ * |param rotateInterval[Rotate Interval] Start a new file after this many seconds.
+ * Use 0 to disable time based rotation.
+ * |units seconds
+ * |default 0
+ * |preview valid
+ *
+ * |param powerOffset[Power Offset] Calibration offset added to the decoder's
+ * relative power estimates to get the dBm values of the pseudo-header.
+ * |units dB
+ * |default 0.0
+ * |preview valid
+ *
+ * |factory /btle/pcap_writer()
+ * |setter setFilePath(path)
+ * |setter setRotateSize(rotateSize)
+ * |setter setRotateInterval(rotateInterval)
+ * |setter setPowerOffset(powerOffset)
+ **********************************************************************/
+class BTLEPcapWriter : public Pothos::Block
+{
+public:
+    BTLEPcapWriter(void):
+        _rotateSize(0),
+        _rotateInterval(0),
+        _powerOffset(0.0),
+        _running(false),
+        _bufferPackets(0),
+        _droppedPackets(0),
+        _bufferPartial(false),
+        _flushPending(false),
+        _file(nullptr),
+        _fileBytes(0),
+        _fileSequence(0)
+    {
+        this->setupInput(0); //input messages from decoder
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEPcapWriter, setFilePath));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEPcapWriter, setRotateSize));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEPcapWriter, setRotateInterval));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEPcapWriter, setPowerOffset));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEPcapWriter, droppedPackets));
+        this->registerProbe("droppedPackets");
+    }
+
+    static Block *make(void)
+    {
+        return new BTLEPcapWriter();
+    }
+
+    void setFilePath(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _path = path;
+    }
+
+    void setRotateSize(const double megabytes)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _rotateSize = size_t(megabytes*(1 << 20));
+    }
+
+    void setRotateInterval(const double seconds)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _rotateInterval = std::chrono::milliseconds(long(seconds*1000));
+    }
+
+    void setPowerOffset(const double offset)
+    {
+        _powerOffset = offset;
+    }
+
+    unsigned long long droppedPackets(void) const
+    {
+        return _droppedPackets;
+    }
+
+    void activate(void)
+    {
+        //open the first file here so that errors are reported to the user
+        if (_path.empty()) throw Pothos::FileException("BTLEPcapWriter::activate()", "file path not specified");
+        _fileSequence = 0;
+        if (not this->openFile()) throw Pothos::FileException("BTLEPcapWriter::activate()", "cannot open "+_path);
+
+        _buffer.reserve(FLUSH_BYTES+1024);
+        _lastFlush = std::chrono::steady_clock::now();
+        _bufferPartial = false;
+        _flushPending = false;
+        _running = true;
+        _thread = std::thread(&BTLEPcapWriter::writerLoop, this);
+    }
+
+    void deactivate(void)
+    {
+        this->flush();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+        _cond.notify_one();
+        _thread.join();
+        this->closeFile();
+    }
+
+    void work(void)
+    {
+        auto inPort = this->input(0);
+        bool tick = false;
+        while (inPort->hasMessage())
+        {
+            const auto msg = inPort->popMessage();
+            if (msg.type() == typeid(Pothos::ObjectKwargs)) this->appendRecord(msg.extract<Pothos::ObjectKwargs>());
+            else if (msg.type() == typeid(BTLEPacketBatch)) this->appendBatch(msg.extract<BTLEPacketBatch>());
+            else if (msg.type() == typeid(BTLEPcapFlushTick)) tick = true;
+        }
+        if (tick) _flushPending = false;
+
+        //hand off full buffers, and partial buffers once a second or when the writer thread asks
+        if (tick or _buffer.size() >= FLUSH_BYTES or
+            std::chrono::steady_clock::now() > _lastFlush + std::chrono::seconds(1)) this->flush();
+        _bufferPartial = not _buffer.empty();
+    }
+
+private:
+
+    /*******************************************************************
+     * Record serialization (block thread)
+     ******************************************************************/
+    template <typename T>
+    void append(const T &value)
+    {
+        const auto p = reinterpret_cast<const char *>(&value);
+        _buffer.insert(_buffer.end(), p, p+sizeof(T));
+    }
+
+    static uint8_t swapBits(const uint8_t a)
+    {
+        return (uint8_t) (((a * 0x0802LU & 0x22110LU) | (a * 0x8020LU & 0x88440LU)) * 0x10101LU >> 16);
+    }
+
+    static uint8_t rfChannel(const int channel)
+    {
+        //advertising channels 37, 38, 39 sit at RF channels 0, 12, 39
+        if (channel == 37) return 0;
+        if (channel == 38) return 12;
+        if (channel == 39) return 39;
+        return uint8_t((channel < 11)?(channel+1):(channel+2));
+    }
+
+    static int8_t clipPower(const double dBm)
+    {
+        return int8_t(std::max(-128.0, std::min(127.0, std::round(dBm))));
+    }
+
+    void appendRecord(const Pothos::ObjectKwargs &data)
+    {
+        const auto pduIt = data.find("PDU");
+        if (pduIt == data.end() or pduIt->second.type() != typeid(std::vector<uint8_t>)) return;
+        const auto &pdu = pduIt->second.extract<std::vector<uint8_t>>();
+
+        uint32_t address = ADVERTISING_ACCESS_ADDRESS;
+        uint32_t crc = 0;
+        int channel = 38;
+        long long timeNs = 0;
+        uint16_t flags = PHDR_DEWHITENED | PHDR_REF_AA_VALID | PHDR_CRC_CHECKED | PHDR_CRC_VALID;
+        int8_t signal = 0, noise = 0;
+        for (const auto &pair : data)
+        {
+            if (pair.first == "Address") address = std::stoul(pair.second.convert<std::string>(), nullptr, 16);
+            else if (pair.first == "CRC") crc = std::stoul(pair.second.convert<std::string>(), nullptr, 16);
+            else if (pair.first == "Channel") channel = pair.second.convert<int>();
+            else if (pair.first == "Timestamp") timeNs = pair.second.convert<long long>();
+            else if (pair.first == "RSSI")
+            {
+                signal = clipPower(pair.second.convert<double>() + _powerOffset);
+                flags |= PHDR_SIGNAL_VALID;
+            }
+            else if (pair.first == "Noise")
+            {
+                noise = clipPower(pair.second.convert<double>() + _powerOffset);
+                flags |= PHDR_NOISE_VALID;
+            }
+        }
+
+        this->appendPacket(timeNs, rfChannel(channel), signal, noise, flags, address, crc, pdu.data(), pdu.size());
+    }
+
+    void appendBatch(const BTLEPacketBatch &batch)
+    {
+        const long long timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        batch.forEach([this, timeNs](const BTLEPacketRecord &record, const BTLEPacketLink &link, const uint8_t *pdu)
+        {
+            uint16_t flags = PHDR_DEWHITENED | PHDR_REF_AA_VALID | PHDR_CRC_CHECKED | PHDR_CRC_VALID;
+            int8_t signal = 0, noise = 0;
+            if (not std::isnan(link.rssi))
+            {
+                signal = clipPower(link.rssi + _powerOffset);
+                flags |= PHDR_SIGNAL_VALID;
+            }
+            if (not std::isnan(link.noise))
+            {
+                noise = clipPower(link.noise + _powerOffset);
+                flags |= PHDR_NOISE_VALID;
+            }
+            this->appendPacket(timeNs, rfChannel(record.channel), signal, noise, flags,
+                record.accessAddress, record.crc, pdu, record.pduLength);
+        });
+    }
+
+    void appendPacket(const long long timeNs, const uint8_t rfChan, const int8_t signal, const int8_t noise,
+        const uint16_t flags, const uint32_t address, const uint32_t crc, const uint8_t *pdu, const size_t pduLength)
+    {
+        //pcap record header
+        const uint32_t length = 10 + 4 + pduLength + 3;
+        this->append(uint32_t(timeNs/1000000000));
+        this->append(uint32_t((timeNs/1000)%1000000));
+        this->append(length);
+        this->append(length);
+
+        //pseudo-header
+        this->append(rfChan);
+        this->append(signal);
+        this->append(noise);
+        this->append(uint8_t(0)); //access address offenses
+        this->append(ADVERTISING_ACCESS_ADDRESS); //reference access address
+        this->append(flags);
+
+        //packet: access address, pdu, crc in over the air byte order
+        this->append(address);
+        _buffer.insert(_buffer.end(), pdu, pdu+pduLength);
+        for (int i = 2; i >= 0; i--) this->append(swapBits(uint8_t(crc >> (8*i))));
+        _bufferPackets++;
+    }
+
+    void flush(void)
+    {
+        _lastFlush = std::chrono::steady_clock::now();
+        if (_buffer.empty()) return;
+
+        std::vector<char> next;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_pending.size() >= MAX_PENDING_BUFFERS)
+            {
+                _droppedPackets += _bufferPackets;
+                _buffer.clear();
+                _bufferPackets = 0;
+                return;
+            }
+            _pending.emplace_back(std::move(_buffer));
+            if (not _recycled.empty())
+            {
+                next.swap(_recycled.back());
+                _recycled.pop_back();
+            }
+        }
+        _cond.notify_one();
+
+        //continue with a recycled buffer to avoid reallocations
+        next.clear();
+        next.reserve(FLUSH_BYTES+1024);
+        _buffer.swap(next);
+        _bufferPackets = 0;
+    }
+
+    /*******************************************************************
+     * File output (writer thread)
+     ******************************************************************/
+    void writerLoop(void)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            //work() only runs for messages: on a quiet channel, ask it for the partial buffer
+            if (not _cond.wait_for(lock, std::chrono::seconds(1), [this](){return not _running or not _pending.empty();}))
+            {
+                if (_bufferPartial and not _flushPending.exchange(true))
+                {
+                    this->input(0)->pushMessage(Pothos::Object(BTLEPcapFlushTick()));
+                }
+                continue;
+            }
+            if (_pending.empty()) break; //not running and all written
+
+            auto buffer = std::move(_pending.front());
+            _pending.pop_front();
+            lock.unlock();
+
+            this->writeBuffer(buffer);
+
+            lock.lock();
+            _recycled.emplace_back(std::move(buffer));
+        }
+    }
+
+    void writeBuffer(const std::vector<char> &buffer)
+    {
+        bool rotate = false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_rotateSize != 0 and _fileBytes + buffer.size() > _rotateSize) rotate = true;
+            if (_rotateInterval.count() != 0 and std::chrono::steady_clock::now() > _fileOpenTime + _rotateInterval) rotate = true;
+        }
+        if (rotate or _file == nullptr)
+        {
+            this->closeFile();
+            if (not this->openFile())
+            {
+                _droppedPackets += countRecords(buffer);
+                return;
+            }
+        }
+
+        if (std::fwrite(buffer.data(), 1, buffer.size(), _file) != buffer.size() or std::fflush(_file) != 0)
+        {
+            poco_error(Poco::Logger::get("BTLEPcapWriter"), "write failed: " + std::string(std::strerror(errno)));
+            _droppedPackets += countRecords(buffer);
+        }
+        _fileBytes += buffer.size();
+    }
+
+    //the number of pcap records in a buffer, from the length in each record header
+    static size_t countRecords(const std::vector<char> &buffer)
+    {
+        size_t count = 0;
+        for (size_t offset = 0; offset + 16 <= buffer.size(); count++)
+        {
+            uint32_t length;
+            std::memcpy(&length, buffer.data()+offset+8, sizeof(length));
+            offset += 16 + length;
+        }
+        return count;
+    }
+
+    bool openFile(void)
+    {
+        std::string path;
+        bool rotating;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            path = _path;
+            rotating = _rotateSize != 0 or _rotateInterval.count() != 0;
+        }
+
+        //insert the open time and sequence before the extension
+        if (rotating)
+        {
+            char timeStr[32];
+            const std::time_t now = std::time(nullptr);
+            std::strftime(timeStr, sizeof(timeStr), "%Y%m%d_%H%M%S", std::localtime(&now));
+            const auto slash = path.find_last_of("/\\");
+            auto dot = path.find_last_of('.');
+            if (dot == std::string::npos or (slash != std::string::npos and dot < slash)) dot = path.size();
+            path = path.substr(0, dot) + "_" + timeStr + "_" + std::to_string(_fileSequence++) + path.substr(dot);
+        }
+
+        _file = std::fopen(path.c_str(), "wb");
+        if (_file == nullptr)
+        {
+            poco_error(Poco::Logger::get("BTLEPcapWriter"), "cannot open " + path + ": " + std::strerror(errno));
+            return false;
+        }
+
+        //pcap global header, microsecond timestamps
+        const uint32_t header[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 65535, LINKTYPE_BLUETOOTH_LE_LL_WITH_PHDR};
+        if (std::fwrite(header, sizeof(header), 1, _file) != 1)
+        {
+            poco_error(Poco::Logger::get("BTLEPcapWriter"), "write failed: " + std::string(std::strerror(errno)));
+            this->closeFile();
+            return false;
+        }
+        _fileBytes = sizeof(header);
+        _fileOpenTime = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void closeFile(void)
+    {
+        if (_file != nullptr) std::fclose(_file);
+        _file = nullptr;
+    }
+
+    //config
+    std::string _path;
+    size_t _rotateSize;
+    std::chrono::steady_clock::duration _rotateInterval;
+    double _powerOffset;
+
+    //buffer exchange with the writer thread
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<std::vector<char>> _pending;
+    std::vector<std::vector<char>> _recycled;
+    bool _running;
+    std::thread _thread;
+
+    //block thread state
+    std::vector<char> _buffer;
+    size_t _bufferPackets;
+    std::chrono::steady_clock::time_point _lastFlush;
+    std::atomic<unsigned long long> _droppedPackets;
+
+    //partial buffer hand off on a quiet channel, at most one tick in flight
+    std::atomic<bool> _bufferPartial;
+    std::atomic<bool> _flushPending;
+
+    //writer thread state
+    std::FILE *_file;
+    size_t _fileBytes;
+    size_t _fileSequence;
+    std::chrono::steady_clock::time_point _fileOpenTime;
+};
+
+static Pothos::BlockRegistry registerBTLEPcapWriter(
+    "/btle/pcap_writer", &BTLEPcapWriter::make);
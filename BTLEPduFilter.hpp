@@ -0,0 +1,219 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include "BTLEDedupCache.hpp" //btleMixKey, btleHashBytes
+#include "BTLEDeviceTable.hpp" //btleParseMAC
+#include "BTLEAdvData.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cctype>
+
+/*!
+ * Allow or deny list of advertiser addresses and service UUIDs,
+ * matched against the raw PDU bytes before any formatting.
+ *
+ * A packet matches when its advertiser address, or any UUID in its
+ * AD structures (service UUID lists and service data, 16, 32, and 128-bit),
+ * is in the list. Each address and UUID is reduced to a tagged 64-bit key.
+ * The keys are held in an open-addressing hash set, at most half full.
+ * Lists longer than BLOOM_MIN_KEYS also get a Bloom filter in front of the set,
+ * about 16 bits and 4 probes per key, so that the common case of a packet
+ * that is not in a large list costs a few bit tests in a small array.
+ */
+class BTLEPduFilter
+{
+public:
+    enum Mode
+    {
+        MODE_OFF,
+        MODE_ALLOW, //!< only packets that match pass
+        MODE_DENY, //!< packets that match are dropped
+    };
+
+    BTLEPduFilter(void):
+        _mode(MODE_OFF),
+        _mask(0),
+        _numKeys(0)
+    {
+        return;
+    }
+
+    void setMode(const Mode mode)
+    {
+        _mode = mode;
+    }
+
+    /*!
+     * Set the list of addresses ("aa:bb:cc:dd:ee:ff")
+     * and UUIDs ("ea06", "0000fe9f", or "6e400001-b5a3-f393-e0a9-e50e24dcca9e"),
+     * separated by commas or white space.
+     * \throws std::invalid_argument for an entry that is neither
+     */
+    void setList(const std::string &list)
+    {
+        std::vector<uint64_t> keys;
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            const auto end = list.find_first_of(", \t\n", pos);
+            const auto entry = list.substr(pos, (end == std::string::npos)?std::string::npos:end-pos);
+            pos = (end == std::string::npos)?list.size():end+1;
+            if (entry.empty()) continue;
+            uint64_t key;
+            if (not parseEntry(entry, key)) throw std::invalid_argument("expected an address or a UUID: "+entry);
+            keys.push_back(key);
+        }
+
+        size_t size = 16;
+        while (size < 2*keys.size()) size <<= 1;
+        _table.assign(size, uint64_t(EMPTY));
+        _mask = size-1;
+        _numKeys = 0;
+        _bloom.clear();
+        if (keys.size() >= BLOOM_MIN_KEYS)
+        {
+            size_t bits = 64;
+            while (bits < 16*keys.size()) bits <<= 1;
+            _bloom.assign(bits/64, 0);
+        }
+        for (const auto key : keys) this->insert(key);
+    }
+
+    size_t size(void) const
+    {
+        return _numKeys;
+    }
+
+    //! Should the packet be dropped? Always false when the filter is off.
+    bool reject(const uint8_t *pdu, const size_t length) const
+    {
+        if (_mode == MODE_OFF) return false;
+        return this->matches(pdu, length) == (_mode == MODE_DENY);
+    }
+
+    //! Does the address or any AD UUID of the packet match the list?
+    bool matches(const uint8_t *pdu, const size_t length) const
+    {
+        BTLEAdvLayout layout;
+        if (not btleAdvLayout(pdu, length, layout)) return false;
+        if (layout.addressOffset != 0 and this->contains(addressKey(btleReadAddress(pdu+layout.addressOffset)))) return true;
+
+        //the AD structures, empty for pdu types without them
+        const uint8_t *cursor = pdu + layout.dataOffset;
+        BTLEAdvField field;
+        while (btleNextAdvField(cursor, pdu+layout.dataEnd, field))
+        {
+            switch (field.type)
+            {
+            case 0x02: case 0x03: //16-bit uuid lists
+                for (size_t i = 0; i+2 <= field.length; i += 2) if (this->contains(uuidKey(field.data+i, 2))) return true;
+                break;
+            case 0x04: case 0x05: //32-bit uuid lists
+                for (size_t i = 0; i+4 <= field.length; i += 4) if (this->contains(uuidKey(field.data+i, 4))) return true;
+                break;
+            case 0x06: case 0x07: //128-bit uuid lists
+                for (size_t i = 0; i+16 <= field.length; i += 16) if (this->contains(uuidKey(field.data+i, 16))) return true;
+                break;
+            case 0x16: if (field.length >= 2 and this->contains(uuidKey(field.data, 2))) return true; break;
+            case 0x20: if (field.length >= 4 and this->contains(uuidKey(field.data, 4))) return true; break;
+            case 0x21: if (field.length >= 16 and this->contains(uuidKey(field.data, 16))) return true; break;
+            default: break;
+            }
+        }
+        return false;
+    }
+
+private:
+    static const uint64_t EMPTY = ~uint64_t(0); //keys are tagged 1 to 3 in the top byte
+    static const size_t BLOOM_MIN_KEYS = 64;
+    static const int BLOOM_PROBES = 4;
+
+    static uint64_t addressKey(const uint64_t mac)
+    {
+        return (uint64_t(1) << 56) | mac;
+    }
+
+    //uuid bytes in pdu order (little endian), 16 and 32-bit uuids share one key space
+    static uint64_t uuidKey(const uint8_t *data, const size_t length)
+    {
+        if (length == 16) return (uint64_t(3) << 56) | (btleHashBytes(data, 16) >> 8);
+        uint32_t uuid = 0;
+        for (size_t i = 0; i < length; i++) uuid |= uint32_t(data[i]) << (8*i);
+        return (uint64_t(2) << 56) | uuid;
+    }
+
+    static bool parseEntry(const std::string &entry, uint64_t &key)
+    {
+        uint64_t mac;
+        if (btleParseMAC(entry, mac))
+        {
+            key = addressKey(mac);
+            return true;
+        }
+
+        //uuid hex digits, most significant first, dashes ignored
+        std::vector<uint8_t> bytes;
+        std::string hex;
+        for (const auto ch : entry) if (ch != '-') hex.push_back(ch);
+        if (hex.size() != 4 and hex.size() != 8 and hex.size() != 32) return false;
+        for (const auto ch : hex) if (not std::isxdigit(static_cast<unsigned char>(ch))) return false;
+        for (size_t i = hex.size(); i >= 2; i -= 2)
+        {
+            bytes.push_back(uint8_t(std::stoul(hex.substr(i-2, 2), nullptr, 16)));
+        }
+        key = uuidKey(bytes.data(), bytes.size());
+        return true;
+    }
+
+    void insert(const uint64_t key)
+    {
+        const uint64_t h = btleMixKey(key);
+        if (not _bloom.empty())
+        {
+            const size_t bits = _bloom.size()*64;
+            for (int i = 0; i < BLOOM_PROBES; i++)
+            {
+                const size_t bit = (h >> (16*i)) & (bits-1);
+                _bloom[bit/64] |= uint64_t(1) << (bit%64);
+            }
+        }
+        for (size_t i = h & _mask;; i = (i+1) & _mask)
+        {
+            if (_table[i] == key) return;
+            if (_table[i] != EMPTY) continue;
+            _table[i] = key;
+            _numKeys++;
+            return;
+        }
+    }
+
+    bool contains(const uint64_t key) const
+    {
+        if (_numKeys == 0) return false;
+        const uint64_t h = btleMixKey(key);
+        if (not _bloom.empty())
+        {
+            const size_t bits = _bloom.size()*64;
+            for (int i = 0; i < BLOOM_PROBES; i++)
+            {
+                const size_t bit = (h >> (16*i)) & (bits-1);
+                if ((_bloom[bit/64] & (uint64_t(1) << (bit%64))) == 0) return false;
+            }
+        }
+        for (size_t i = h & _mask;; i = (i+1) & _mask)
+        {
+            if (_table[i] == key) return true;
+            if (_table[i] == EMPTY) return false;
+        }
+    }
+
+    Mode _mode;
+    std::vector<uint64_t> _table;
+    size_t _mask;
+    size_t _numKeys;
+    std::vector<uint64_t> _bloom;
+};
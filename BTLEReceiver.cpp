@@ -0,0 +1,313 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include "BTLEUtils.hpp"
+#include "BTLEDemod.hpp"
+#include "BTLEDecimator.hpp"
+#include "BTLESquelch.hpp"
+#include "BTLEPacketHandler.hpp"
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <string>
+
+/***********************************************************************
+ * |PothosDoc BTLE Receiver
+ *
+ * Receive and decode bluetooth low energy packets from complex baseband samples.
+ * The receiver replaces the chain of "DC Removal", "FIR Filter", "FIR Designer",
+ * "Freq Demod", and "BTLE Decoder" blocks with a single block,
+ * so the SDR can run at a higher sample rate for better filtering
+ * without writing every intermediate stream back to memory.
+ *
+ * The input is processed in cache sized tiles: each tile is low pass filtered
+ * and decimated to 2 Msps, then DC removal, the frequency discriminator,
+ * and the packet decoder run over the decimated tile while it is still in cache.
+ * The filter is a windowed sinc designed when the block is created,
+ * and only the decimated outputs are computed.
+ *
+ * <h2>Output format</h2>
+ *
+ * The packets go through the same handling as in the BTLE Decoder block with complex input:
+ * the address and UUID filter, the minimum RSSI and SNR, duplicate suppression,
+ * and the output as dictionary messages with the "RSSI", "Noise", "SNR", and "CFO"
+ * link estimates, or as one BTLEPacketBatch message per call to work() in batch mode.
+ * The "cfo" signal emits a smoothed frequency offset after each packet.
+ * The sample index of a packet counts the decimated samples at 2 Msps.
+ *
+ * The squelch gates the decimated tile before DC removal and demodulation,
+ * so an idle channel still costs the filter but not the decoder.
+ *
+ * |category /Decode
+ * |keywords bluetooth low energy filter decimate demod
+ *
+ * |param sampleRate[Sample Rate] The input sample rate, a whole multiple of 2 Msps.
+ * |units Sps
+ * |default 4e6
+ *
+ * |param cutoff[Cutoff] The low pass filter cutoff frequency.
+ * |units Hz
+ * |default 0.6e6
+ *
+ * |param numTaps[Num Taps] The low pass filter length, or 0 to size it from the decimation.
+ * |default 0
+ * |preview valid
+ *
+ * |param dcAverage[DC Average] The time constant of the DC removal at 2 Msps, or 0 to disable it.
+ * |units samples
+ * |default 512
+ * |preview valid
+ *
+ * |param channel[Channel] The advertising channel index used for dewhitening.
+ * The channel should match the tuned frequency: 37 (2402 MHz), 38 (2426 MHz), or 39 (2480 MHz).
+ * |default 38
+ * |option [37] 37
+ * |option [38] 38
+ * |option [39] 39
+ *
+ * |param dedupMode[Dedup Mode] The duplicate suppression mode.
+ * |default "OFF"
+ * |option [Off] "OFF"
+ * |option [Window] "WINDOW"
+ * |option [On Change] "CHANGE"
+ *
+ * |param dedupWindow[Dedup Window] Identical packets within this window are dropped.
+ * |units seconds
+ * |default 1.0
+ * |preview when(enum=dedupMode, "WINDOW")
+ *
+ * |param filterMode[Filter Mode] The address and UUID filter mode.
+ * |default "OFF"
+ * |option [Off] "OFF"
+ * |option [Allow] "ALLOW"
+ * |option [Deny] "DENY"
+ *
+ * |param filterList[Filter List] Addresses and UUIDs separated by commas.
+ * Ex: "aa:bb:cc:dd:ee:ff, fe9f, 6e400001-b5a3-f393-e0a9-e50e24dcca9e"
+ * |default ""
+ * |widget StringEntry()
+ * |preview when(enum=filterMode, "ALLOW", "DENY")
+ *
+ * |param minRSSI[Min RSSI] Drop packets with a lower mean power.
+ * |units dBFS
+ * |default -200.0
+ * |preview valid
+ *
+ * |param minSNR[Min SNR] Drop packets with a lower signal to noise ratio.
+ * |units dB
+ * |default -200.0
+ * |preview valid
+ *
+ * |param squelch[Squelch] Only decode bursts this far above the noise floor, or 0 to decode everything.
+ * |units dB
+ * |default 0.0
+ * |preview valid
+ *
+ * |param batchOutput[Batch Output] Post the packets of each work() call as one batch message.
+ * |default false
+ * |option [Off] false
+ * |option [On] true
+ * |preview valid
+ *
+ * |factory /btle/btle_receiver(sampleRate, cutoff, numTaps)
+ * |setter setDCAverage(dcAverage)
+ * |setter setChannel(channel)
+ * |setter setDedupMode(dedupMode)
+ * |setter setDedupWindow(dedupWindow)
+ * |setter setFilterMode(filterMode)
+ * |setter setFilterList(filterList)
+ * |setter setMinRSSI(minRSSI)
+ * |setter setMinSNR(minSNR)
+ * |setter setSquelch(squelch)
+ * |setter setBatchOutput(batchOutput)
+ **********************************************************************/
+class BTLEReceiver : public Pothos::Block
+{
+public:
+    BTLEReceiver(const double sampleRate, const double cutoff, const size_t numTaps):
+        _dcAverage(512),
+        _squelch(128, RB_SIZE+64), //a false header match can hold the decode for the longest packet
+        _squelchLevel(0.0)
+    {
+        const double outRate = _decoder.srate*1e6;
+        const double decim = std::round(sampleRate/outRate);
+        if (decim < 1.0 or std::abs(sampleRate - decim*outRate) > 1.0) throw Pothos::InvalidArgumentException(
+            "BTLEReceiver("+std::to_string(sampleRate)+")", "sample rate must be a multiple of 2 Msps");
+        if (cutoff <= 0.0 or cutoff >= sampleRate/2) throw Pothos::InvalidArgumentException(
+            "BTLEReceiver("+std::to_string(cutoff)+")", "cutoff out of range");
+        _decimator = BTLEDecimator(size_t(decim), cutoff/sampleRate, numTaps);
+
+        this->setupInput(0); //unspecified type, converted to complex float
+        this->setupOutput(0);
+        this->registerSignal("cfo");
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setDCAverage));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setChannel));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setDedupMode));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setDedupWindow));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setFilterMode));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setFilterList));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setMinRSSI));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setMinSNR));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setSquelch));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEReceiver, setBatchOutput));
+        _decoder.formatPacketData = false; //formatted after filtering
+    }
+
+    static Block *make(const double sampleRate, const double cutoff, const size_t numTaps)
+    {
+        return new BTLEReceiver(sampleRate, cutoff, numTaps);
+    }
+
+    void setDCAverage(const size_t averageSize)
+    {
+        _dcAverage = averageSize;
+        _dcBlocker = BTLEDCBlocker(averageSize);
+    }
+
+    void setChannel(const int channel)
+    {
+        if (channel < 0 or channel > 39) throw Pothos::InvalidArgumentException(
+            "BTLEReceiver::setChannel("+std::to_string(channel)+")", "channel index out of range");
+        _decoder.channel = channel;
+    }
+
+    void setDedupMode(const std::string &mode)
+    {
+        try
+        {
+            _handler.setDedupMode(mode);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLEReceiver::setDedupMode("+mode+")", ex.what());
+        }
+    }
+
+    void setDedupWindow(const double window)
+    {
+        _handler.setDedupWindow(window);
+    }
+
+    void setFilterMode(const std::string &mode)
+    {
+        try
+        {
+            _handler.setFilterMode(mode);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLEReceiver::setFilterMode("+mode+")", ex.what());
+        }
+    }
+
+    void setFilterList(const std::string &list)
+    {
+        try
+        {
+            _handler.setFilterList(list);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLEReceiver::setFilterList("+list+")", ex.what());
+        }
+    }
+
+    void setMinRSSI(const double minRSSI)
+    {
+        _handler.setMinRSSI(minRSSI);
+    }
+
+    void setMinSNR(const double minSNR)
+    {
+        _handler.setMinSNR(minSNR);
+    }
+
+    void setSquelch(const double level)
+    {
+        if (level < 0.0) throw Pothos::InvalidArgumentException(
+            "BTLEReceiver::setSquelch("+std::to_string(level)+")", "level must be positive");
+        _squelchLevel = level;
+        _squelch.setLevel(level);
+    }
+
+    void setBatchOutput(const bool batch)
+    {
+        _handler.setBatchOutput(batch);
+    }
+
+    void activate(void)
+    {
+        _decimator.reset();
+        _dcBlocker.reset();
+        _decoder.reset();
+        _demod.reset();
+        _squelch.reset();
+        _handler.reset();
+    }
+
+    void work(void)
+    {
+        auto inPort = this->input(0);
+        auto inBuff = inPort->buffer();
+        const size_t N = inBuff.elements();
+        if (N == 0) return;
+
+        auto cf32Buff = inBuff.convert(typeid(std::complex<float>));
+        auto in = cf32Buff.as<const std::complex<float> *>();
+        for (size_t i = 0; i < N; i += TILE_SIZE)
+        {
+            //filter and decimate one tile
+            _tile.clear();
+            _decimator.process(in+i, std::min(N-i, size_t(TILE_SIZE)),
+                [this](const std::complex<float> &y){_tile.push_back(y);});
+
+            //remove dc, demodulate, and decode the decimated tile
+            const auto decode = [this](const std::complex<float> *y, const size_t n)
+            {
+                for (size_t k = 0; k < n; k++)
+                {
+                    const auto x = (_dcAverage == 0)?y[k]:_dcBlocker.feed(y[k]);
+                    if (_decoder.feedOne(uint16_t(_demod.feed(x)))) this->handlePacket();
+                }
+            };
+
+            //skipped samples still count towards the packet sample index
+            if (_squelchLevel > 0.0) _squelch.process(_tile.data(), _tile.size(), decode,
+                [this](const size_t n){_decoder.samples += int64_t(n);});
+            else decode(_tile.data(), _tile.size());
+        }
+
+        inPort->consume(N);
+
+        //one message for all packets of this call
+        _handler.flush(this->output(0));
+    }
+
+private:
+    //input samples per tile, 32 KiB of complex floats
+    static const size_t TILE_SIZE = 4096;
+
+    void handlePacket(void)
+    {
+        const auto estimate = [this]
+        {
+            if (_squelchLevel > 0.0) _demod.setNoiseFloor(_squelch.noiseFloor());
+            return _demod.estimate(_decoder, _decoder.srate*1e6);
+        };
+        if (_handler.handle(_decoder, estimate, this->output(0))) this->callVoid("cfo", _handler.cfo());
+    }
+
+    BTLEUtilsDecoder _decoder;
+    BTLEDecimator _decimator;
+    BTLEDCBlocker _dcBlocker;
+    size_t _dcAverage;
+    std::vector<std::complex<float>> _tile;
+    BTLEComplexDemod _demod;
+    BTLESquelch _squelch;
+    double _squelchLevel;
+    BTLEPacketHandler _handler;
+};
+
+static Pothos::BlockRegistry registerBTLEReceiver(
+    "/btle/btle_receiver", &BTLEReceiver::make);
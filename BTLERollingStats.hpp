@@ -0,0 +1,219 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+/*!
+ * Rolling statistics of a sensor value over a time window.
+ *
+ * All state lives in fixed size arrays, whatever the sample rate:
+ * the window is split into Buckets time buckets, and each bucket keeps
+ * the count, mean and sum of squared deviations, minimum, and maximum
+ * of its samples, and up to SamplesPerBucket of the samples themselves.
+ * Whole buckets fall out of the window, so the window edge is resolved
+ * to 1/Buckets of the window length.
+ *  - EWMA with the window as its time constant, updated per sample
+ *  - count, mean, variance, min, and max are exact, merged over the buckets
+ *  - percentiles are exact while the buckets hold all of their samples
+ *    (up to Buckets*SamplesPerBucket in the window), and beyond that
+ *    are taken over a uniform sample of each bucket, weighted by its count
+ */
+template <size_t Buckets = 64, size_t SamplesPerBucket = 8>
+class BTLERollingStats
+{
+public:
+    BTLERollingStats(void):
+        _windowNs(0)
+    {
+        this->setWindow(60000000000ll);
+    }
+
+    //! The window length in nanoseconds, a new length clears the samples
+    void setWindow(const int64_t windowNs)
+    {
+        const auto window = std::max<int64_t>(windowNs, int64_t(Buckets));
+        if (window == _windowNs) return;
+        _windowNs = window;
+        _bucketNs = (window + int64_t(Buckets) - 1)/int64_t(Buckets);
+        this->reset();
+    }
+
+    void reset(void)
+    {
+        for (auto &bucket : _buckets) bucket.count = 0;
+        _ewma = 0.0;
+        _lastTimeNs = 0;
+        _started = false;
+        _random = 0x9e3779b97f4a7c15ull;
+    }
+
+    //! Add a sample taken at the given time (nanoseconds, non-decreasing)
+    void update(const double value, const int64_t timeNs)
+    {
+        this->expire(timeNs);
+
+        //time aware EWMA: the weight of a sample depends on the time since the last one
+        if (not _started) _ewma = value;
+        else
+        {
+            const double dt = double(timeNs - _lastTimeNs);
+            _ewma += (value - _ewma)*(1.0 - std::exp(-dt/double(_windowNs)));
+        }
+        _lastTimeNs = timeNs;
+        _started = true;
+
+        //start the bucket when it is not in use by this time
+        const int64_t index = this->bucketIndex(timeNs);
+        auto &bucket = _buckets[size_t(((index % int64_t(NUM_SLOTS)) + int64_t(NUM_SLOTS)) % int64_t(NUM_SLOTS))];
+        if (bucket.count == 0 or bucket.index != index)
+        {
+            bucket.index = index;
+            bucket.count = 0;
+            bucket.mean = bucket.m2 = 0.0;
+            bucket.min = bucket.max = value;
+        }
+
+        //welford add
+        bucket.count++;
+        const double delta = value - bucket.mean;
+        bucket.mean += delta/bucket.count;
+        bucket.m2 += delta*(value - bucket.mean);
+        bucket.min = std::min(bucket.min, value);
+        bucket.max = std::max(bucket.max, value);
+
+        //reservoir of the bucket samples
+        if (bucket.count <= SamplesPerBucket) bucket.samples[bucket.count-1] = value;
+        else
+        {
+            const uint64_t k = this->random() % bucket.count;
+            if (k < SamplesPerBucket) bucket.samples[k] = value;
+        }
+    }
+
+    //! Drop the buckets that ended before the window relative to the given time
+    void expire(const int64_t timeNs)
+    {
+        const int64_t oldest = this->bucketIndex(timeNs - _windowNs);
+        for (auto &bucket : _buckets)
+        {
+            if (bucket.count != 0 and bucket.index < oldest) bucket.count = 0;
+        }
+    }
+
+    size_t count(void) const
+    {
+        size_t n = 0;
+        for (const auto &bucket : _buckets) n += bucket.count;
+        return n;
+    }
+
+    double ewma(void) const {return _ewma;}
+    double mean(void) const {return this->merged().mean;}
+    double variance(void) const {const auto m = this->merged(); return (m.count < 2)?0.0:m.m2/(m.count-1);}
+    double stddev(void) const {return std::sqrt(this->variance());}
+    double min(void) const {return this->merged().min;}
+    double max(void) const {return this->merged().max;}
+
+    //! The p-th percentile (0.0 to 1.0) of the samples in the window
+    double percentile(const double p) const
+    {
+        //the kept samples, each standing for count/kept samples of its bucket
+        double values[NUM_SLOTS*SamplesPerBucket];
+        double weights[NUM_SLOTS*SamplesPerBucket];
+        size_t order[NUM_SLOTS*SamplesPerBucket];
+        size_t num = 0, total = 0;
+        for (const auto &bucket : _buckets)
+        {
+            if (bucket.count == 0) continue;
+            const size_t kept = std::min(bucket.count, SamplesPerBucket);
+            for (size_t i = 0; i < kept; i++)
+            {
+                values[num] = bucket.samples[i];
+                weights[num] = double(bucket.count)/kept;
+                order[num] = num;
+                num++;
+            }
+            total += bucket.count;
+        }
+        if (num == 0) return nan();
+
+        std::sort(order, order+num, [&values](const size_t a, const size_t b){return values[a] < values[b];});
+        const double rank = std::floor(p*(total-1) + 0.5);
+        double below = 0.0;
+        for (size_t i = 0; i < num; i++)
+        {
+            below += weights[order[i]];
+            if (below > rank) return values[order[i]];
+        }
+        return values[order[num-1]];
+    }
+
+private:
+    static const size_t NUM_SLOTS = Buckets+1; //the window touches at most Buckets+1 buckets
+
+    struct Bucket
+    {
+        int64_t index;
+        size_t count;
+        double mean, m2;
+        double min, max;
+        double samples[SamplesPerBucket];
+    };
+
+    static double nan(void)
+    {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    int64_t bucketIndex(const int64_t timeNs) const
+    {
+        //floor division, the time may be before the epoch near start up
+        return (timeNs >= 0)?(timeNs/_bucketNs):-((-timeNs+_bucketNs-1)/_bucketNs);
+    }
+
+    //the buckets merged by Chan's method
+    Bucket merged(void) const
+    {
+        Bucket m;
+        m.count = 0;
+        m.mean = m.m2 = 0.0;
+        m.min = m.max = nan();
+        for (const auto &bucket : _buckets)
+        {
+            if (bucket.count == 0) continue;
+            if (m.count == 0) {m = bucket; continue;}
+            const size_t n = m.count + bucket.count;
+            const double delta = bucket.mean - m.mean;
+            m.mean += delta*bucket.count/n;
+            m.m2 += bucket.m2 + delta*delta*(double(m.count)*bucket.count/n);
+            m.count = n;
+            m.min = std::min(m.min, bucket.min);
+            m.max = std::max(m.max, bucket.max);
+        }
+        if (m.count == 0) m.mean = nan();
+        return m;
+    }
+
+    uint64_t random(void)
+    {
+        //xorshift64
+        _random ^= _random << 13;
+        _random ^= _random >> 7;
+        _random ^= _random << 17;
+        return _random;
+    }
+
+    int64_t _windowNs;
+    int64_t _bucketNs;
+    Bucket _buckets[NUM_SLOTS];
+
+    double _ewma;
+    int64_t _lastTimeNs;
+    bool _started;
+    uint64_t _random;
+};
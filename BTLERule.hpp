@@ -0,0 +1,411 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include "BTLERollingStats.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <cctype>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+
+/*!
+ * A threshold rule compiled into flat stack machine code.
+ *
+ * Rules are compiled once when they are set, and evaluation is a
+ * single pass over the instructions with a fixed size stack,
+ * so there is no parsing or allocation per packet.
+ *
+ * Rule syntax:
+ *  - numbers, variables, ( ), + - * /, comparisons > >= < <= == !=,
+ *    and the logic operators and, or, not (also &&, ||, !)
+ *  - windowed aggregates FN(variable, DURATION) where FN is one of
+ *    avg, min, max, std, ewma, count, median, p90
+ *  - an optional trailing "for DURATION": the expression must hold
+ *    continuously for the duration before the rule is true
+ *  - durations are a number with the unit ms, s, m, or h (default seconds)
+ *
+ * Example: "avg(temp, 30s) > 45 and rssi > -80 for 5s"
+ *
+ * Comparisons with a missing value (NaN) are false.
+ */
+class BTLERule
+{
+public:
+    typedef BTLERollingStats<> Stats;
+
+    //! A windowed aggregate of a variable, one Stats instance per device
+    struct Aggregate
+    {
+        size_t var;
+        int64_t windowNs;
+    };
+
+    BTLERule(void):
+        _holdNs(0)
+    {
+        return;
+    }
+
+    /*!
+     * Compile a rule, throws std::invalid_argument on error.
+     * \param text the rule source
+     * \param vars map of variable names to indexes into the evaluate() values
+     */
+    void compile(const std::string &text, const std::map<std::string, size_t> &vars)
+    {
+        Compiler c(text, vars);
+        c.compile();
+        _text = text;
+        _code = c.code;
+        _aggregates = c.aggregates;
+        _holdNs = c.holdNs;
+    }
+
+    const std::string &text(void) const
+    {
+        return _text;
+    }
+
+    //! The aggregates used by the rule
+    const std::vector<Aggregate> &aggregates(void) const
+    {
+        return _aggregates;
+    }
+
+    //! How long the expression must hold before the rule is true
+    int64_t holdNs(void) const
+    {
+        return _holdNs;
+    }
+
+    //! Update the aggregates with the current variable values
+    void update(const double *vars, Stats *stats, const int64_t timeNs) const
+    {
+        for (size_t i = 0; i < _aggregates.size(); i++)
+        {
+            const double value = vars[_aggregates[i].var];
+            if (std::isnan(value)) stats[i].expire(timeNs);
+            else stats[i].update(value, timeNs);
+        }
+    }
+
+    //! Evaluate the expression over the current values and aggregates
+    bool evaluate(const double *vars, const Stats *stats) const
+    {
+        double stack[MAX_DEPTH];
+        size_t sp = 0;
+        for (const auto &in : _code)
+        {
+            switch (in.op)
+            {
+            case PUSH_CONST: stack[sp++] = in.value; break;
+            case PUSH_VAR: stack[sp++] = vars[in.arg]; break;
+            case PUSH_AVG: stack[sp++] = stats[in.arg].mean(); break;
+            case PUSH_MIN: stack[sp++] = stats[in.arg].min(); break;
+            case PUSH_MAX: stack[sp++] = stats[in.arg].max(); break;
+            case PUSH_STD: stack[sp++] = stats[in.arg].stddev(); break;
+            case PUSH_EWMA: stack[sp++] = stats[in.arg].ewma(); break;
+            case PUSH_COUNT: stack[sp++] = double(stats[in.arg].count()); break;
+            case PUSH_MEDIAN: stack[sp++] = stats[in.arg].percentile(0.5); break;
+            case PUSH_P90: stack[sp++] = stats[in.arg].percentile(0.9); break;
+            case NEG: stack[sp-1] = -stack[sp-1]; break;
+            case NOT: stack[sp-1] = (stack[sp-1] != 0.0)?0.0:1.0; break;
+            default:
+            {
+                const double b = stack[--sp];
+                double &a = stack[sp-1];
+                switch (in.op)
+                {
+                case ADD: a = a + b; break;
+                case SUB: a = a - b; break;
+                case MUL: a = a * b; break;
+                case DIV: a = a / b; break;
+                case GT: a = (a > b)?1.0:0.0; break;
+                case GE: a = (a >= b)?1.0:0.0; break;
+                case LT: a = (a < b)?1.0:0.0; break;
+                case LE: a = (a <= b)?1.0:0.0; break;
+                case EQ: a = (a == b)?1.0:0.0; break;
+                case NE: a = (a != b)?1.0:0.0; break;
+                case AND: a = (a != 0.0 and b != 0.0 and not std::isnan(a) and not std::isnan(b))?1.0:0.0; break;
+                case OR: a = ((a != 0.0 and not std::isnan(a)) or (b != 0.0 and not std::isnan(b)))?1.0:0.0; break;
+                default: break;
+                }
+            }
+            }
+        }
+        return sp == 1 and stack[0] != 0.0 and not std::isnan(stack[0]);
+    }
+
+private:
+    static const size_t MAX_DEPTH = 32;
+
+    enum Op
+    {
+        PUSH_CONST, PUSH_VAR,
+        PUSH_AVG, PUSH_MIN, PUSH_MAX, PUSH_STD, PUSH_EWMA, PUSH_COUNT, PUSH_MEDIAN, PUSH_P90,
+        NEG, NOT,
+        ADD, SUB, MUL, DIV,
+        GT, GE, LT, LE, EQ, NE,
+        AND, OR,
+    };
+
+    struct Instr
+    {
+        Op op;
+        size_t arg;
+        double value;
+    };
+
+    //recursive descent compiler, emits postfix code
+    struct Compiler
+    {
+        Compiler(const std::string &text, const std::map<std::string, size_t> &vars):
+            text(text), vars(vars), pos(0), holdNs(0), depth(0), maxDepth(0)
+        {
+            return;
+        }
+
+        void compile(void)
+        {
+            this->parseOr();
+            if (this->acceptWord("for")) holdNs = this->parseDuration();
+            this->skipSpace();
+            if (pos != text.size()) this->fail("unexpected '" + text.substr(pos) + "'");
+        }
+
+        void parseOr(void)
+        {
+            this->parseAnd();
+            while (this->acceptWord("or") or this->accept("||"))
+            {
+                this->parseAnd();
+                this->emit(OR);
+            }
+        }
+
+        void parseAnd(void)
+        {
+            this->parseNot();
+            while (this->acceptWord("and") or this->accept("&&"))
+            {
+                this->parseNot();
+                this->emit(AND);
+            }
+        }
+
+        void parseNot(void)
+        {
+            if (this->acceptWord("not") or (this->peek("!") and not this->peek("!=") and this->accept("!")))
+            {
+                this->parseNot();
+                this->emit(NOT);
+            }
+            else this->parseCompare();
+        }
+
+        void parseCompare(void)
+        {
+            this->parseSum();
+            static const std::pair<const char *, Op> ops[] = {
+                {">=", GE}, {"<=", LE}, {"==", EQ}, {"!=", NE}, {">", GT}, {"<", LT}};
+            for (const auto &op : ops)
+            {
+                if (not this->accept(op.first)) continue;
+                this->parseSum();
+                this->emit(op.second);
+                return;
+            }
+        }
+
+        void parseSum(void)
+        {
+            this->parseTerm();
+            while (true)
+            {
+                if (this->accept("+")) {this->parseTerm(); this->emit(ADD);}
+                else if (this->accept("-")) {this->parseTerm(); this->emit(SUB);}
+                else break;
+            }
+        }
+
+        void parseTerm(void)
+        {
+            this->parseUnary();
+            while (true)
+            {
+                if (this->accept("*")) {this->parseUnary(); this->emit(MUL);}
+                else if (this->accept("/")) {this->parseUnary(); this->emit(DIV);}
+                else break;
+            }
+        }
+
+        void parseUnary(void)
+        {
+            if (this->accept("-"))
+            {
+                this->parseUnary();
+                this->emit(NEG);
+            }
+            else this->parsePrimary();
+        }
+
+        void parsePrimary(void)
+        {
+            this->skipSpace();
+            if (this->accept("("))
+            {
+                this->parseOr();
+                this->expect(")");
+                return;
+            }
+            if (pos < text.size() and (std::isdigit(text[pos]) or text[pos] == '.'))
+            {
+                this->emit(PUSH_CONST, 0, this->parseNumber());
+                return;
+            }
+
+            const auto name = this->parseName();
+            if (this->accept("("))
+            {
+                const auto var = this->lookup(this->parseName());
+                this->expect(",");
+                const auto windowNs = this->parseDuration();
+                this->expect(")");
+                this->emit(this->aggregateOp(name), this->aggregate(var, windowNs));
+                return;
+            }
+            this->emit(PUSH_VAR, this->lookup(name));
+        }
+
+        Op aggregateOp(const std::string &name)
+        {
+            if (name == "avg") return PUSH_AVG;
+            if (name == "min") return PUSH_MIN;
+            if (name == "max") return PUSH_MAX;
+            if (name == "std") return PUSH_STD;
+            if (name == "ewma") return PUSH_EWMA;
+            if (name == "count") return PUSH_COUNT;
+            if (name == "median") return PUSH_MEDIAN;
+            if (name == "p90") return PUSH_P90;
+            this->fail("unknown function '" + name + "'");
+            return PUSH_AVG;
+        }
+
+        //share one aggregate between uses of the same variable and window
+        size_t aggregate(const size_t var, const int64_t windowNs)
+        {
+            for (size_t i = 0; i < aggregates.size(); i++)
+            {
+                if (aggregates[i].var == var and aggregates[i].windowNs == windowNs) return i;
+            }
+            aggregates.push_back(Aggregate{var, windowNs});
+            return aggregates.size()-1;
+        }
+
+        size_t lookup(const std::string &name)
+        {
+            const auto it = vars.find(name);
+            if (it == vars.end()) this->fail("unknown variable '" + name + "'");
+            return it->second;
+        }
+
+        int64_t parseDuration(void)
+        {
+            const double number = this->parseNumber();
+            double scale = 1e9;
+            if (text.compare(pos, 2, "ms") == 0) {scale = 1e6; pos += 2;}
+            else if (pos < text.size() and text[pos] == 's') {scale = 1e9; pos++;}
+            else if (pos < text.size() and text[pos] == 'm') {scale = 60e9; pos++;}
+            else if (pos < text.size() and text[pos] == 'h') {scale = 3600e9; pos++;}
+            if (pos < text.size() and std::isalnum(text[pos])) this->fail("bad duration unit");
+            return int64_t(number*scale);
+        }
+
+        double parseNumber(void)
+        {
+            this->skipSpace();
+            double value = 0.0;
+            const auto begin = text.data()+pos;
+            const auto result = std::from_chars(begin, text.data()+text.size(), value);
+            if (result.ec != std::errc()) this->fail("expected a number");
+            pos += result.ptr-begin;
+            return value;
+        }
+
+        std::string parseName(void)
+        {
+            this->skipSpace();
+            const auto begin = pos;
+            while (pos < text.size() and (std::isalnum(text[pos]) or text[pos] == '_')) pos++;
+            if (begin == pos) this->fail("expected a name");
+            return text.substr(begin, pos-begin);
+        }
+
+        void skipSpace(void)
+        {
+            while (pos < text.size() and std::isspace(text[pos])) pos++;
+        }
+
+        bool peek(const char *token)
+        {
+            this->skipSpace();
+            return text.compare(pos, std::char_traits<char>::length(token), token) == 0;
+        }
+
+        bool accept(const char *token)
+        {
+            if (not this->peek(token)) return false;
+            pos += std::char_traits<char>::length(token);
+            return true;
+        }
+
+        //a keyword must not be followed by more name characters
+        bool acceptWord(const char *word)
+        {
+            const auto len = std::char_traits<char>::length(word);
+            if (not this->peek(word)) return false;
+            if (pos+len < text.size() and (std::isalnum(text[pos+len]) or text[pos+len] == '_')) return false;
+            pos += len;
+            return true;
+        }
+
+        void expect(const char *token)
+        {
+            if (not this->accept(token)) this->fail(std::string("expected '") + token + "'");
+        }
+
+        void emit(const Op op, const size_t arg = 0, const double value = 0.0)
+        {
+            //track the stack depth: pushes add one, binary operators pop one
+            if (op < NEG) depth++;
+            else if (op > NOT) depth--;
+            maxDepth = std::max(maxDepth, depth);
+            if (maxDepth > MAX_DEPTH) this->fail("expression too deep");
+            code.push_back(Instr{op, arg, value});
+        }
+
+        void fail(const std::string &what)
+        {
+            throw std::invalid_argument(what + " at offset " + std::to_string(pos) + " in rule: " + text);
+        }
+
+        const std::string &text;
+        const std::map<std::string, size_t> &vars;
+        size_t pos;
+        std::vector<Instr> code;
+        std::vector<Aggregate> aggregates;
+        int64_t holdNs;
+        size_t depth, maxDepth;
+    };
+
+    std::string _text;
+    std::vector<Instr> _code;
+    std::vector<Aggregate> _aggregates;
+    int64_t _holdNs;
+};
@@ -2,9 +2,39 @@
 // SPDX-License-Identifier: BSL-1.0
 
 #include <Pothos/Framework.hpp>
+#include "BTLEDeviceTable.hpp"
+#include "BTLEAdvData.hpp"
+#include "BTLEPayloadFormat.hpp"
+#include "BTLERollingStats.hpp"
+#include "BTLETimerWheel.hpp"
+#include "BTLERule.hpp"
+#include "BTLEPacketRecord.hpp"
+#include "BTLEHistoryStore.hpp"
+#include <Poco/Logger.h>
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <limits>
+#include <cmath>
+#include <charconv>
+#include <algorithm>
+
+//keyword names from the BTLE decoder
+static const std::string SERVICE_DATA_KEY("Service Data");
+static const std::string SERVICE_UUID_KEY("Service Data UUID16");
+static const std::string MAC_KEY("MAC");
+static const std::string PDU_KEY("PDU");
+static const std::string RSSI_KEY("RSSI");
+static const std::string SNR_KEY("SNR");
+static const std::string CFO_KEY("CFO");
+
+//private message from the timer thread to advance the alarm timers
+struct BTLEAlarmTick {};
 
 /***********************************************************************
  * |PothosDoc BTLE Sensor Monitor
@@ -16,36 +46,172 @@
  * <h2>Input messages</h2>
  *
  * The sensor monitor expects dictionary-style messages from the BTLE decoder block.
- * The "Service Data UUID16" key will be checked for the specified 16-bit UUID.
- * Then the sensor value will be extracted from the "Service Data" key.
- * The service data is treated as a string that can be parsed as an IEEE float.
+ * The service data in the raw "PDU" bytes will be checked for the specified 16-bit UUID.
+ * Then the sensor values will be extracted from the service data payload
+ * according to the payload format (by default a string holding an IEEE float).
+ * Messages without the "PDU" key fall back to the "Service Data UUID16" and "Service Data" keys.
+ * Batch messages from the decoder in batch output mode are also accepted,
+ * and every packet of the batch is processed in one pass over its arena.
+ *
+ * <h2>Payload formats</h2>
+ *
+ * Binary payloads are described by a schema string that is compiled once,
+ * so each packet is decoded with direct typed loads rather than string parsing.
+ * A payload may carry up to 8 channels; the threshold channel selects the one
+ * compared against the thresholds and reported by the "value" signal.
+ *
+ *  - "ascii": text holding one floating point number (temp-monitor.sh)
+ *  - "bthome": BTHome v2 service data, one channel per measurement
+ *  - comma separated fields TYPE[*SCALE][+OFFSET], where TYPE is
+ *    u8, s8, u16le, s16le, u16be, s16be, u24le, s24le, u32le, s32le, f32le, or f32be,
+ *    and xN skips N bytes. Ex: "s16le*0.01,u8" for temperature and battery level.
+ *
+ * <h2>Multiple sensors</h2>
+ *
+ * The monitor tracks every sensor it sees in a hash table keyed by
+ * the device address and the service UUID, ex: "c0:ff:ee:00:00:01/ea06".
+ * Each device has its own state, thresholds, and alarm,
+ * and the cost of a packet does not depend on the number of devices.
+ * Per-device thresholds can be set with setDeviceThresholds(device, activation, deactivation);
+ * devices without an override use the activation and deactivation levels below.
+ *
+ * <h2>Rolling statistics</h2>
+ *
+ * For the threshold channel of each device the monitor keeps rolling statistics
+ * over the statistics window, in fixed memory at any packet rate:
+ * an exponentially weighted average with the window as time constant,
+ * the mean and standard deviation, the minimum and maximum, and percentiles.
+ * The window is kept in 64 time buckets, so its edge moves in steps of 1/64 of its length.
+ * Percentiles are exact while no bucket holds more than 8 samples,
+ * and beyond that are estimated from a uniform sample of 8 readings
+ * of each bucket, weighted by the number of readings in the bucket.
+ * The same applies to the windowed aggregates of rules.
+ * Any of them can be selected as the threshold input in place of the raw value.
+ *
+ * <h2>Rules</h2>
+ *
+ * In place of the activation and deactivation levels, a rule expression
+ * can decide the active state. Rules are compiled once when they are set,
+ * and evaluated per packet with a small stack machine and no allocation.
+ *
+ *  - variables: "value" (the threshold channel), "ch0" to "ch7", the channel names,
+ *    and "rssi", "snr", "cfo" (from the decoder link estimates when present)
+ *  - arithmetic + - * /, comparisons > >= < <= == !=, and, or, not
+ *  - windowed aggregates avg, min, max, std, ewma, count, median, p90,
+ *    ex: "avg(temp, 30s)"
+ *  - a trailing "for 5s" requires the expression to hold for 5 seconds
+ *
+ * Ex: "avg(temp, 30s) > 45 and rssi > -80 for 5s".
+ * The rule is checked when a packet arrives, and the device is active
+ * while the rule holds. Per-device rules can be set with setDeviceRule(device, rule).
+ *
+ * <h2>Link quality</h2>
+ *
+ * When the decoder runs on complex samples, each packet carries "RSSI", "SNR", and "CFO" estimates.
+ * The monitor keeps the latest and a smoothed value of each per device,
+ * which are reported in the "event" signal, ex: to find far or mistuned sensors.
  *
  * <h2>Output signals</h2>
  *
- * <string>state</strong>
+ * <strong>state</strong>
  * When the activation state changes (and at regular intervals),
  * the monitor block emits the "state" signal with a string value.
  * The value can be "ACTIVE", "INACTIVE", or "ALARM".
  * The alarm will be occur if a BTLE packet has not been seen for more
  * than the specified idle period.
+ * Each device has a deadline in an internal timing wheel which is
+ * rescheduled on every packet, so the alarm state is emitted within
+ * a few milliseconds of the timeout, independent of the report trigger.
  *
- * <string>value</strong>
+ * <strong>value</strong>
  * At regular intervals the monitor will emit the last seen sensor value
  * from the "value" signal. The value will be a floating point number
  *
- * <string>active</strong>
+ * <strong>active</strong>
  * Emit the activation state (true or false) over the "active" signal.
  * When the alarm has activated, the active state will always be false.
  *
+ * The state, value, and active signals follow the first device seen,
+ * which matches the behaviour of a single-sensor deployment.
+ *
+ * <strong>event</strong>
+ * Emitted for every device on a state change and on each report.
+ * The argument is a dictionary with the keys "Device", "State", "Value", "Values", and "Active".
+ * "Values" holds all channels of the last payload as a std::vector<double>.
+ * When link estimates are available the keys "RSSI", "SNR", and "CFO" hold the smoothed values.
+ *
+ * <strong>stats</strong>
+ * Emitted for every device on each report with a dictionary of the rolling statistics:
+ * "Device", "Count", "EWMA", "Mean", "StdDev", "Min", "Max", "P50", "P90", and "P99".
+ *
+ * <h2>History</h2>
+ *
+ * When a history directory is set, every sensor reading (time, device, threshold channel value)
+ * is appended to an on-disk history with one columnar segment file per UTC day,
+ * with compressed timestamps and values (see BTLEHistoryStore.hpp).
+ * Readings are batched in memory and handed to a background thread about once a second,
+ * so disk writes never stall the packet stream; when the disk falls far behind,
+ * batches are dropped and logged rather than block.
+ * The background thread collects the readings of each device into chunks,
+ * written after 1024 readings, 10 minutes, or a minute without readings.
+ * Chunks not yet written are included in queries, and lost on a crash.
+ * The queryHistory(device, start, end, bucket) call returns a list of aggregates
+ * (dictionaries with "Start", "Count", "Mean", "Min", "Max", and "Sum"),
+ * for the device (or all devices when empty) between the start and end times
+ * in seconds since the epoch, one per bucket of the given length in seconds,
+ * or a single aggregate when the bucket is 0.
+ *
  * |category /Control
  * |keywords bluetooth sensor monitor control
  *
  * |param serviceUUID[Service UUID] A 16-bit UUID that identifies the service we are interested in.
- * The UUID is a string containing 4 hex characters.
+ * The UUID is a string containing 4 hex characters, with an optional 0x prefix.
  * Use the same UUID that the BTLE advertisement application was programmed with.
+ * An empty string accepts sensors with any service UUID.
  * |default "EA06"
  * |widget StringEntry()
  *
+ * |param payloadFormat[Payload Format] The schema of the service data payload.
+ * |default "ascii"
+ * |option [ASCII] "ascii"
+ * |option [BTHome] "bthome"
+ * |option [Int16 LE / 100] "s16le*0.01"
+ * |option [Float32 LE] "f32le"
+ * |widget ComboBox(editable=true)
+ * |preview valid
+ *
+ * |param thresholdChannel[Threshold Channel] The payload channel compared against the thresholds.
+ * |default 0
+ * |preview valid
+ *
+ * |param statsWindow[Statistics Window] The time window of the rolling statistics.
+ * |units seconds
+ * |default 60.0
+ * |preview valid
+ *
+ * |param thresholdInput[Threshold Input] The quantity compared against the thresholds.
+ * |default "VALUE"
+ * |option [Value] "VALUE"
+ * |option [EWMA] "EWMA"
+ * |option [Mean] "MEAN"
+ * |option [Minimum] "MIN"
+ * |option [Maximum] "MAX"
+ * |option [Median] "P50"
+ * |option [90th Percentile] "P90"
+ * |preview valid
+ *
+ * |param channelNames[Channel Names] Comma separated names for the payload channels.
+ * The names can be used as variables in the rule.
+ * |default ""
+ * |widget StringEntry()
+ * |preview valid
+ *
+ * |param rule[Rule] An activation rule expression, which replaces the threshold levels.
+ * Leave empty to use the activation and deactivation levels.
+ * |default ""
+ * |widget StringEntry()
+ * |preview valid
+ *
  * |param activationLevel[Activation Level] The activation threshold.
  * The monitor enters the active state when the sensor value rises above this threshold.
  * |default 0
@@ -59,29 +225,65 @@
  * |default 10
  * |units seconds
  *
+ * |param historyPath[History Directory] The directory of the sensor history, or empty to disable it.
+ * The directory is created when missing, and the history is opened on activation.
+ * |default ""
+ * |widget FileEntry(mode=directory)
+ * |preview valid
+ *
  * |factory /btle/btle_sensor_monitor()
  * |setter setServiceUUID(serviceUUID)
+ * |setter setPayloadFormat(payloadFormat)
+ * |setter setThresholdChannel(thresholdChannel)
+ * |setter setStatsWindow(statsWindow)
+ * |setter setThresholdInput(thresholdInput)
+ * |setter setChannelNames(channelNames)
+ * |setter setRule(rule)
  * |setter setActivationLevel(activationLevel)
  * |setter setDeactivationLevel(deactivationLevel)
  * |setter setAlarmTimeout(alarmTimeout)
+ * |setter setHistoryPath(historyPath)
  **********************************************************************/
 class BTLESensorMonitor : public Pothos::Block
 {
 public:
     BTLESensorMonitor(void):
+        _anyUUID(true),
+        _uuid16(0),
+        _thresholdChannel(0),
+        _statsWindowNs(60000000000ll),
+        _thresholdInput(INPUT_VALUE),
         _activationLevel(0),
-        _deactivationLevel(0)
+        _deactivationLevel(0),
+        _alarmTimeout(std::chrono::seconds(10)),
+        _timerRunning(false),
+        _timerPending(false),
+        _timersArmed(false),
+        _historyDropped(0)
     {
         this->setupInput(0); //input messages from decoder
         this->registerSignal("state");
         this->registerSignal("value");
         this->registerSignal("active");
+        this->registerSignal("event");
+        this->registerSignal("stats");
         this->registerSlot("triggerReport");
         this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setServiceUUID));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setPayloadFormat));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setThresholdChannel));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setStatsWindow));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setThresholdInput));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setChannelNames));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setRule));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setDeviceRule));
         this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setActivationLevel));
         this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setDeactivationLevel));
         this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setAlarmTimeout));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setDeviceThresholds));
         this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, triggerReport));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, setHistoryPath));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLESensorMonitor, queryHistory));
+        this->setChannelNames("");
     }
 
     static Block *make(void)
@@ -91,88 +293,670 @@ public:
 
     void setServiceUUID(const std::string &uuid)
     {
-        _uuid = uuid;
+        _anyUUID = uuid.empty();
+        if (_anyUUID) return;
+
+        //from_chars does not take the 0x prefix
+        auto begin = uuid.data();
+        const auto end = uuid.data()+uuid.size();
+        if (uuid.size() > 2 and uuid[0] == '0' and (uuid[1] == 'x' or uuid[1] == 'X')) begin += 2;
+        const auto result = std::from_chars(begin, end, _uuid16, 16);
+        if (result.ec != std::errc() or result.ptr != end) throw Pothos::InvalidArgumentException(
+            "BTLESensorMonitor::setServiceUUID("+uuid+")", "expected a 16-bit hex UUID");
+    }
+
+    void setPayloadFormat(const std::string &schema)
+    {
+        try
+        {
+            _payloadFormat.setSchema(schema);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLESensorMonitor::setPayloadFormat("+schema+")", ex.what());
+        }
+    }
+
+    void setThresholdChannel(const size_t channel)
+    {
+        if (channel >= BTLEPayloadFormat::MAX_CHANNELS) throw Pothos::InvalidArgumentException(
+            "BTLESensorMonitor::setThresholdChannel("+std::to_string(channel)+")", "channel out of range");
+        _thresholdChannel = channel;
+    }
+
+    void setStatsWindow(const double window)
+    {
+        _statsWindowNs = int64_t(window*1e9);
+        for (size_t i = 0; i < _devices.size(); i++) _devices[i].stats.setWindow(_statsWindowNs);
+    }
+
+    void setThresholdInput(const std::string &input)
+    {
+        if (input == "VALUE") _thresholdInput = INPUT_VALUE;
+        else if (input == "EWMA") _thresholdInput = INPUT_EWMA;
+        else if (input == "MEAN") _thresholdInput = INPUT_MEAN;
+        else if (input == "MIN") _thresholdInput = INPUT_MIN;
+        else if (input == "MAX") _thresholdInput = INPUT_MAX;
+        else if (input == "P50") _thresholdInput = INPUT_P50;
+        else if (input == "P90") _thresholdInput = INPUT_P90;
+        else throw Pothos::InvalidArgumentException("BTLESensorMonitor::setThresholdInput("+input+")", "unknown input");
+    }
+
+    void setChannelNames(const std::string &names)
+    {
+        std::map<std::string, size_t> vars;
+        for (size_t i = 0; i < BTLEPayloadFormat::MAX_CHANNELS; i++) vars["ch"+std::to_string(i)] = i;
+        vars["value"] = VAR_VALUE;
+        vars["rssi"] = VAR_RSSI;
+        vars["snr"] = VAR_SNR;
+        vars["cfo"] = VAR_CFO;
+        size_t channel = 0;
+        for (size_t pos = 0; pos < names.size() and channel < BTLEPayloadFormat::MAX_CHANNELS; channel++)
+        {
+            auto comma = names.find(',', pos);
+            if (comma == std::string::npos) comma = names.size();
+            auto name = names.substr(pos, comma-pos);
+            name.erase(0, name.find_first_not_of(" "));
+            name.erase(name.find_last_not_of(" ")+1);
+            if (not name.empty()) vars[name] = channel;
+            pos = comma+1;
+        }
+        _ruleVars = vars;
+
+        //recompile the rules against the new names
+        if (_rule) _rule = this->compileRule("setChannelNames", _rule->text());
+        for (auto &pair : _deviceRules) pair.second = this->compileRule("setChannelNames", pair.second->text());
+        this->applyRules();
+    }
+
+    void setRule(const std::string &rule)
+    {
+        _rule = this->compileRule("setRule", rule);
+        this->applyRules();
+    }
+
+    void setDeviceRule(const std::string &device, const std::string &rule)
+    {
+        uint64_t key;
+        if (not btleParseDeviceKey(device, key)) throw Pothos::InvalidArgumentException(
+            "BTLESensorMonitor::setDeviceRule("+device+")", "expected aa:bb:cc:dd:ee:ff/uuid");
+        auto compiled = this->compileRule("setDeviceRule", rule);
+        if (compiled) _deviceRules[key] = compiled;
+        else _deviceRules.erase(key);
+        this->applyRules();
     }
 
     void setActivationLevel(const double level)
     {
         _activationLevel = level;
+        this->applyThresholds();
     }
 
     void setDeactivationLevel(const double level)
     {
         _deactivationLevel = level;
+        this->applyThresholds();
     }
 
     void setAlarmTimeout(const double timeout)
     {
         _alarmTimeout = std::chrono::milliseconds(long(timeout*1000));
+
+        //move the pending deadlines to the new timeout
+        for (size_t i = 0; i < _devices.size(); i++)
+        {
+            if (not _devices[i].isAlarm) this->scheduleAlarm(i);
+        }
+        this->checkAlarms();
+    }
+
+    void setDeviceThresholds(const std::string &device, const double activation, const double deactivation)
+    {
+        uint64_t key;
+        if (not btleParseDeviceKey(device, key)) throw Pothos::InvalidArgumentException(
+            "BTLESensorMonitor::setDeviceThresholds("+device+")", "expected aa:bb:cc:dd:ee:ff/uuid");
+        _deviceThresholds[key] = std::make_pair(activation, deactivation);
+        this->applyThresholds();
+    }
+
+    void setHistoryPath(const std::string &path)
+    {
+        _historyPath = path;
+        if (this->isActive()) this->startHistory();
+    }
+
+    Pothos::ObjectVector queryHistory(const std::string &device, const double start, const double end, const double bucket) const
+    {
+        uint64_t key = 0;
+        if (not device.empty() and not btleParseDeviceKey(device, key)) throw Pothos::InvalidArgumentException(
+            "BTLESensorMonitor::queryHistory("+device+")", "expected aa:bb:cc:dd:ee:ff/uuid");
+        if (_historyPath.empty()) throw Pothos::InvalidArgumentException(
+            "BTLESensorMonitor::queryHistory()", "history directory not set");
+
+        const auto startNs = int64_t(start*1e9);
+        std::vector<BTLEHistoryAggregate> aggregates;
+        try
+        {
+            aggregates = BTLEHistoryReader(_historyPath).query(key, startNs, int64_t(end*1e9), int64_t(bucket*1e9), &_history);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLESensorMonitor::queryHistory()", ex.what());
+        }
+
+        Pothos::ObjectVector result;
+        for (size_t i = 0; i < aggregates.size(); i++)
+        {
+            const auto &agg = aggregates[i];
+            Pothos::ObjectKwargs entry;
+            entry["Start"] = Pothos::Object((bucket > 0.0)?(start + i*bucket):start);
+            entry["Count"] = Pothos::Object((unsigned long long)(agg.count));
+            entry["Mean"] = Pothos::Object(agg.mean());
+            entry["Min"] = Pothos::Object(agg.min);
+            entry["Max"] = Pothos::Object(agg.max);
+            entry["Sum"] = Pothos::Object(agg.sum);
+            result.push_back(Pothos::Object(entry));
+        }
+        return result;
     }
 
     void triggerReport(void)
     {
-        const bool isAlarm = std::chrono::high_resolution_clock::now() > _lastSensorTime + _alarmTimeout;
-        if (isAlarm) _isActive = false; //disable when alarm has been set
-        this->callVoid("state", isAlarm?"ALARM":(_isActive?"ACTIVE":"INACTIVE"));
-        this->callVoid("value", _lastSensorValue);
-        this->callVoid("active", _isActive);
+        this->flushHistory(true);
+        this->checkAlarms();
+        const auto now = Clock::now();
+        for (size_t i = 0; i < _devices.size(); i++)
+        {
+            this->report(i);
+            this->reportStats(i, now);
+        }
+
+        //no sensor seen yet: the primary device is in alarm
+        if (_devices.size() == 0)
+        {
+            this->callVoid("state", "ALARM");
+            this->callVoid("value", 0.0);
+            this->callVoid("active", false);
+        }
     }
 
     void activate(void)
     {
-        _isActive = false;
-        _lastSensorValue = 0;
+        _devices.clear();
+        _wheel.clear();
+        _timersArmed = false;
+        _timerPending = false;
+        _timerRunning = true;
+        _timerThread = std::thread(&BTLESensorMonitor::timerLoop, this);
+        this->startHistory();
+    }
+
+    void deactivate(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_timerMutex);
+            _timerRunning = false;
+        }
+        _timerCond.notify_one();
+        _timerThread.join();
+        _history.stop();
     }
 
     void work(void)
     {
+        //drain all available messages in one call
         auto inPort = this->input(0);
-        if (inPort->hasMessage())
+        while (inPort->hasMessage())
         {
             const auto msg = inPort->popMessage();
-            this->processSensorData(msg);
+            if (msg.type() == typeid(BTLEAlarmTick)) _timerPending = false;
+            else if (msg.type() == typeid(BTLEPacketBatch)) this->processBatch(msg.extract<BTLEPacketBatch>());
+            else this->processSensorData(msg);
         }
+        this->checkAlarms();
+        this->flushHistory(false);
     }
 
 private:
+    enum ThresholdInput
+    {
+        INPUT_VALUE,
+        INPUT_EWMA,
+        INPUT_MEAN,
+        INPUT_MIN,
+        INPUT_MAX,
+        INPUT_P50,
+        INPUT_P90,
+    };
+
+    //rule variables after the payload channels
+    static const size_t VAR_VALUE = BTLEPayloadFormat::MAX_CHANNELS;
+    static const size_t VAR_RSSI = VAR_VALUE+1;
+    static const size_t VAR_SNR = VAR_VALUE+2;
+    static const size_t VAR_CFO = VAR_VALUE+3;
+    static const size_t NUM_VARS = VAR_VALUE+4;
+
+    //link estimates from the decoder, NaN when not available
+    struct LinkInfo
+    {
+        LinkInfo(void):
+            rssi(std::numeric_limits<double>::quiet_NaN()),
+            snr(std::numeric_limits<double>::quiet_NaN()),
+            cfo(std::numeric_limits<double>::quiet_NaN())
+        {
+            return;
+        }
+
+        //smooth over packets, the first valid packet initializes
+        void smooth(const LinkInfo &in, const double alpha)
+        {
+            rssi = std::isnan(rssi)?in.rssi:(std::isnan(in.rssi)?rssi:rssi + (in.rssi - rssi)*alpha);
+            snr = std::isnan(snr)?in.snr:(std::isnan(in.snr)?snr:snr + (in.snr - snr)*alpha);
+            cfo = std::isnan(cfo)?in.cfo:(std::isnan(in.cfo)?cfo:cfo + (in.cfo - cfo)*alpha);
+        }
+
+        double rssi;
+        double snr;
+        double cfo;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    static int64_t toNanoseconds(const Clock::time_point &t)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    struct DeviceState
+    {
+        DeviceState(void):
+            isActive(false),
+            isAlarm(false),
+            numValues(0),
+            lastSensorValue(0),
+            activationLevel(0),
+            deactivationLevel(0),
+            ruleHoldStartNs(-1)
+        {
+            return;
+        }
+
+        bool isActive;
+        bool isAlarm;
+        size_t numValues;
+        double values[BTLEPayloadFormat::MAX_CHANNELS];
+        double lastSensorValue;
+        LinkInfo link; //last packet
+        LinkInfo linkAvg; //smoothed over packets
+        Clock::time_point lastSensorTime;
+        double activationLevel;
+        double deactivationLevel;
+        BTLERollingStats<> stats;
+
+        //rule state, the aggregates are sized when the rule is applied
+        std::shared_ptr<const BTLERule> rule;
+        std::vector<BTLERule::Stats> ruleStats;
+        int64_t ruleHoldStartNs;
+    };
+
+    //lookup a string valued keyword without copying it
+    static const std::string *findString(const Pothos::ObjectKwargs &data, const std::string &key)
+    {
+        const auto it = data.find(key);
+        if (it == data.end() or it->second.type() != typeid(std::string)) return nullptr;
+        return &it->second.extract<std::string>();
+    }
+
+    //lookup an optional numeric keyword
+    static double findNumber(const Pothos::ObjectKwargs &data, const std::string &key)
+    {
+        const auto it = data.find(key);
+        if (it == data.end()) return std::numeric_limits<double>::quiet_NaN();
+        if (it->second.type() == typeid(double)) return it->second.extract<double>();
+        if (it->second.type() == typeid(float)) return it->second.extract<float>();
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
     void processSensorData(const Pothos::Object &msg)
     {
-        if (not msg.canConvert(typeid(Pothos::ObjectKwargs))) return;
-        auto data = msg.convert<Pothos::ObjectKwargs>();
-        if (data.count("Service Data UUID16") == 0) return;
-        if (data.count("Service Data") == 0) return;
+        if (msg.type() != typeid(Pothos::ObjectKwargs)) return;
+        const auto &data = msg.extract<Pothos::ObjectKwargs>();
+        LinkInfo link;
+        link.rssi = findNumber(data, RSSI_KEY);
+        link.snr = findNumber(data, SNR_KEY);
+        link.cfo = findNumber(data, CFO_KEY);
+
+        //raw pdu bytes: locate the service data in place
+        const auto pduIt = data.find(PDU_KEY);
+        if (pduIt != data.end() and pduIt->second.type() == typeid(std::vector<uint8_t>))
+        {
+            const auto &pdu = pduIt->second.extract<std::vector<uint8_t>>();
+            this->processPDU(pdu.data(), pdu.size(), link);
+            return;
+        }
 
-        //get keyword values as strings
-        const auto sensorDataStr = data.at("Service Data").convert<std::string>();
-        const auto remoteUUIDstr = data.at("Service Data UUID16").convert<std::string>();
+        //otherwise use the formatted keywords
+        const auto sensorDataStr = findString(data, SERVICE_DATA_KEY);
+        const auto remoteUUIDstr = findString(data, SERVICE_UUID_KEY);
+        const auto macStr = findString(data, MAC_KEY);
+        if (sensorDataStr == nullptr or remoteUUIDstr == nullptr or macStr == nullptr) return;
 
         //compare uuid
-        const auto myUUID = std::stoul(_uuid, nullptr, 16);
-        const auto remoteUUID = std::stoul(remoteUUIDstr, nullptr, 16);
-        if (myUUID != remoteUUID) return;
+        uint16_t remoteUUID;
+        const auto uuidEnd = remoteUUIDstr->data()+remoteUUIDstr->size();
+        if (std::from_chars(remoteUUIDstr->data(), uuidEnd, remoteUUID, 16).ec != std::errc()) return;
+        if (not _anyUUID and remoteUUID != _uuid16) return;
+
+        uint64_t mac;
+        if (not btleParseMAC(*macStr, mac)) return;
+        const auto payload = reinterpret_cast<const uint8_t *>(sensorDataStr->data());
+        this->processPayload(btleDeviceKey(mac, remoteUUID), payload, sensorDataStr->size(), link);
+    }
+
+    void processBatch(const BTLEPacketBatch &batch)
+    {
+        batch.forEach([this](const BTLEPacketRecord &record, const BTLEPacketLink &in, const uint8_t *pdu)
+        {
+            LinkInfo link;
+            link.rssi = in.rssi;
+            link.snr = in.snr;
+            link.cfo = in.cfo;
+            this->processPDU(pdu, record.pduLength, link);
+        });
+    }
+
+    //find the sensor service data of one pdu without copying
+    void processPDU(const uint8_t *pdu, const size_t length, const LinkInfo &link)
+    {
+        uint16_t remoteUUID;
+        const uint8_t *payload;
+        size_t payloadLength;
+        if (not btleFindServiceData(pdu, length, remoteUUID, payload, payloadLength)) return;
+        if (not _anyUUID and remoteUUID != _uuid16) return;
+        const auto mac = btleAdvAddress(pdu, length);
+        this->processPayload(btleDeviceKey(mac, remoteUUID), payload, payloadLength, link);
+    }
+
+    void processPayload(const uint64_t key, const uint8_t *payload, const size_t length, const LinkInfo &link)
+    {
+        //extract sensor values
+        double values[BTLEPayloadFormat::MAX_CHANNELS];
+        const size_t numValues = _payloadFormat.decode(payload, length, values);
+        if (numValues <= _thresholdChannel) return;
+
+        //lookup the device
+        bool inserted;
+        const auto index = _devices.findOrInsert(key, inserted);
+        auto &device = _devices[index];
+        if (inserted)
+        {
+            this->applyThresholds(index);
+            this->applyRules(index);
+            device.stats.setWindow(_statsWindowNs);
+        }
+
+        std::copy(values, values+numValues, device.values);
+        device.numValues = numValues;
+        device.lastSensorValue = values[_thresholdChannel];
+        device.link = link;
+        device.linkAvg.smooth(link, 0.1);
+        device.lastSensorTime = Clock::now();
+        const auto nowNs = toNanoseconds(device.lastSensorTime);
+        device.stats.update(device.lastSensorValue, nowNs);
+        if (not _historyPath.empty()) _history.append(key, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count(), device.lastSensorValue);
+        this->scheduleAlarm(index);
+
+        bool changed = device.isAlarm; //report recovery from the alarm
+        device.isAlarm = false;
+        const bool active = device.rule?this->evaluateRule(device, nowNs):this->evaluateThresholds(device);
+        if (active != device.isActive)
+        {
+            device.isActive = active;
+            changed = true;
+        }
+        if (changed) this->report(index);
+    }
+
+    bool evaluateThresholds(const DeviceState &device) const
+    {
+        const double input = this->thresholdInput(device);
+        if (not device.isActive and input > device.activationLevel) return true;
+        if (device.isActive and input < device.deactivationLevel) return false;
+        return device.isActive;
+    }
+
+    bool evaluateRule(DeviceState &device, const int64_t nowNs) const
+    {
+        double vars[NUM_VARS];
+        for (size_t i = 0; i < BTLEPayloadFormat::MAX_CHANNELS; i++)
+        {
+            vars[i] = (i < device.numValues)?device.values[i]:std::numeric_limits<double>::quiet_NaN();
+        }
+        vars[VAR_VALUE] = device.lastSensorValue;
+        vars[VAR_RSSI] = device.link.rssi;
+        vars[VAR_SNR] = device.link.snr;
+        vars[VAR_CFO] = device.link.cfo;
+
+        const auto &rule = *device.rule;
+        rule.update(vars, device.ruleStats.data(), nowNs);
+        if (not rule.evaluate(vars, device.ruleStats.data()))
+        {
+            device.ruleHoldStartNs = -1;
+            return false;
+        }
+        if (device.ruleHoldStartNs < 0) device.ruleHoldStartNs = nowNs;
+        return nowNs - device.ruleHoldStartNs >= rule.holdNs();
+    }
+
+    std::shared_ptr<const BTLERule> compileRule(const std::string &what, const std::string &text) const
+    {
+        if (text.empty()) return nullptr;
+        auto rule = std::make_shared<BTLERule>();
+        try
+        {
+            rule->compile(text, _ruleVars);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            throw Pothos::InvalidArgumentException("BTLESensorMonitor::"+what+"("+text+")", ex.what());
+        }
+        return rule;
+    }
 
-        //extract sensor value
-        _lastSensorValue = std::stod(sensorDataStr);
-        if (
-            (not _isActive and _lastSensorValue > _activationLevel) or
-            (_isActive and _lastSensorValue < _deactivationLevel))
+    //select the rule of a device and reset its rule state
+    void applyRules(const size_t index)
+    {
+        auto &device = _devices[index];
+        const auto it = _deviceRules.find(_devices.keyAt(index));
+        device.rule = (it == _deviceRules.end())?_rule:it->second;
+        device.ruleHoldStartNs = -1;
+        device.ruleStats.clear();
+        if (not device.rule) return;
+        device.ruleStats.resize(device.rule->aggregates().size());
+        for (size_t i = 0; i < device.ruleStats.size(); i++)
+        {
+            device.ruleStats[i].setWindow(device.rule->aggregates()[i].windowNs);
+        }
+    }
+
+    void applyRules(void)
+    {
+        for (size_t i = 0; i < _devices.size(); i++) this->applyRules(i);
+    }
+
+    double thresholdInput(const DeviceState &device) const
+    {
+        switch (_thresholdInput)
+        {
+        case INPUT_VALUE: return device.lastSensorValue;
+        case INPUT_EWMA: return device.stats.ewma();
+        case INPUT_MEAN: return device.stats.mean();
+        case INPUT_MIN: return device.stats.min();
+        case INPUT_MAX: return device.stats.max();
+        case INPUT_P50: return device.stats.percentile(0.5);
+        case INPUT_P90: return device.stats.percentile(0.9);
+        }
+        return device.lastSensorValue;
+    }
+
+    void scheduleAlarm(const size_t index)
+    {
+        _wheel.schedule(index, toNanoseconds(_devices[index].lastSensorTime + _alarmTimeout), toNanoseconds(Clock::now()));
+        _timersArmed = true;
+    }
+
+    //fire the alarm of every device whose deadline has passed
+    void checkAlarms(void)
+    {
+        _wheel.advance(toNanoseconds(Clock::now()), [this](const size_t index)
+        {
+            auto &device = _devices[index];
+            device.isAlarm = true;
+            device.isActive = false; //disable when alarm has been set
+            this->report(index);
+        });
+        _timersArmed = not _wheel.empty();
+    }
+
+    /*!
+     * Wake the block once per wheel tick while timers are pending.
+     * At most one tick message is in flight, so a busy block
+     * never accumulates a backlog of ticks.
+     */
+    void timerLoop(void)
+    {
+        const auto tick = std::chrono::nanoseconds(_wheel.tickNs());
+        std::unique_lock<std::mutex> lock(_timerMutex);
+        while (_timerRunning)
+        {
+            _timerCond.wait_for(lock, tick);
+            if (not _timerRunning) break;
+            if (not _timersArmed or _timerPending.exchange(true)) continue;
+            this->input(0)->pushMessage(Pothos::Object(BTLEAlarmTick()));
+        }
+    }
+
+    void applyThresholds(const size_t index)
+    {
+        auto &device = _devices[index];
+        const auto it = _deviceThresholds.find(_devices.keyAt(index));
+        device.activationLevel = (it == _deviceThresholds.end())?_activationLevel:it->second.first;
+        device.deactivationLevel = (it == _deviceThresholds.end())?_deactivationLevel:it->second.second;
+    }
+
+    void applyThresholds(void)
+    {
+        for (size_t i = 0; i < _devices.size(); i++) this->applyThresholds(i);
+    }
+
+    void startHistory(void)
+    {
+        _history.stop();
+        if (_historyPath.empty()) return;
+        try
+        {
+            _history.start(_historyPath);
+        }
+        catch (const std::runtime_error &ex)
+        {
+            throw Pothos::RuntimeException("BTLESensorMonitor::setHistoryPath("+_historyPath+")", ex.what());
+        }
+        _lastHistoryFlush = Clock::now();
+    }
+
+    //hand off full batches, and partial batches at least once a second
+    void flushHistory(const bool force)
+    {
+        if (_history.pending() == 0) return;
+        const auto now = Clock::now();
+        if (not force and _history.pending() < HISTORY_BATCH and now < _lastHistoryFlush + std::chrono::seconds(1)) return;
+        _history.flush();
+        _lastHistoryFlush = now;
+
+        if (_history.dropped() != _historyDropped)
         {
-            _isActive = not _isActive;
-            this->triggerReport();
+            _historyDropped = _history.dropped();
+            poco_error(Poco::Logger::get("BTLESensorMonitor"), "history writer behind, "+std::to_string(_historyDropped)+" readings dropped");
         }
-        _lastSensorTime = std::chrono::high_resolution_clock::now();
+    }
+
+    void report(const size_t index)
+    {
+        const auto &device = _devices[index];
+        const char *state = device.isAlarm?"ALARM":(device.isActive?"ACTIVE":"INACTIVE");
+
+        //the legacy signals follow the primary device
+        if (index == 0)
+        {
+            this->callVoid("state", state);
+            this->callVoid("value", device.lastSensorValue);
+            this->callVoid("active", device.isActive);
+        }
+
+        Pothos::ObjectKwargs event;
+        event["Device"] = Pothos::Object(btleDeviceKeyToString(_devices.keyAt(index)));
+        event["State"] = Pothos::Object(std::string(state));
+        event["Value"] = Pothos::Object(device.lastSensorValue);
+        event["Values"] = Pothos::Object(std::vector<double>(device.values, device.values+device.numValues));
+        event["Active"] = Pothos::Object(device.isActive);
+        if (not std::isnan(device.linkAvg.rssi)) event["RSSI"] = Pothos::Object(device.linkAvg.rssi);
+        if (not std::isnan(device.linkAvg.snr)) event["SNR"] = Pothos::Object(device.linkAvg.snr);
+        if (not std::isnan(device.linkAvg.cfo)) event["CFO"] = Pothos::Object(device.linkAvg.cfo);
+        this->callVoid("event", event);
+    }
+
+    void reportStats(const size_t index, const Clock::time_point &now)
+    {
+        auto &stats = _devices[index].stats;
+        stats.expire(toNanoseconds(now));
+        Pothos::ObjectKwargs report;
+        report["Device"] = Pothos::Object(btleDeviceKeyToString(_devices.keyAt(index)));
+        report["Count"] = Pothos::Object(stats.count());
+        report["EWMA"] = Pothos::Object(stats.ewma());
+        report["Mean"] = Pothos::Object(stats.mean());
+        report["StdDev"] = Pothos::Object(stats.stddev());
+        report["Min"] = Pothos::Object(stats.min());
+        report["Max"] = Pothos::Object(stats.max());
+        report["P50"] = Pothos::Object(stats.percentile(0.5));
+        report["P90"] = Pothos::Object(stats.percentile(0.9));
+        report["P99"] = Pothos::Object(stats.percentile(0.99));
+        this->callVoid("stats", report);
     }
 
     //state
-    bool _isActive;
-    double _lastSensorValue;
-    std::chrono::high_resolution_clock::time_point _lastSensorTime;
+    BTLEDeviceTable<DeviceState> _devices;
+    BTLETimerWheel _wheel;
 
     //config
-    std::string _uuid;
+    bool _anyUUID;
+    uint16_t _uuid16;
+    BTLEPayloadFormat _payloadFormat;
+    size_t _thresholdChannel;
+    int64_t _statsWindowNs;
+    ThresholdInput _thresholdInput;
     double _activationLevel;
     double _deactivationLevel;
-    std::chrono::high_resolution_clock::duration _alarmTimeout;
+    Clock::duration _alarmTimeout;
+    std::map<uint64_t, std::pair<double, double>> _deviceThresholds;
+    std::map<std::string, size_t> _ruleVars;
+    std::shared_ptr<const BTLERule> _rule;
+    std::map<uint64_t, std::shared_ptr<const BTLERule>> _deviceRules;
+
+    //alarm timer thread
+    std::thread _timerThread;
+    std::mutex _timerMutex;
+    std::condition_variable _timerCond;
+    bool _timerRunning;
+    std::atomic<bool> _timerPending;
+    std::atomic<bool> _timersArmed;
+
+    //sensor history
+    static const size_t HISTORY_BATCH = 4096;
+    std::string _historyPath;
+    BTLEHistoryWriter _history;
+    Clock::time_point _lastHistoryFlush;
+    unsigned long long _historyDropped;
 };
 
 static Pothos::BlockRegistry registerBTLESensorMonitor(
@@ -0,0 +1,95 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include "BTLEShmRing.hpp"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+/***********************************************************************
+ * btle_shm_dump - print the packets of a shared memory packet ring
+ *
+ * A minimal consumer of the /btle/shm_packet_sink block and an example
+ * of the BTLEShmReader class. Each packet is printed as a JSON line,
+ * with the number of packets lost to overruns since the previous line.
+ **********************************************************************/
+
+static void printUsage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [options]" << std::endl
+        << "  --name=NAME    shared memory object name (default /btle_packets)" << std::endl
+        << "  --poll=US      poll interval when the ring is empty (default 1000 us)" << std::endl
+        << "  --once         print the packets in the ring and exit" << std::endl;
+}
+
+static bool parseOption(const std::string &arg, const std::string &name, std::string &value)
+{
+    const std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+static void printNumber(const char *key, const float value)
+{
+    if (not std::isnan(value)) std::printf(",\"%s\":%.1f", key, value);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string name("/btle_packets");
+    long pollUs = 1000;
+    bool once = false;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+        std::string value;
+        if (parseOption(arg, "name", value)) name = value;
+        else if (parseOption(arg, "poll", value)) pollUs = std::stol(value);
+        else if (arg == "--once") once = true;
+        else if (arg == "--help" or arg == "-h") {printUsage(argv[0]); return EXIT_SUCCESS;}
+        else {printUsage(argv[0]); return EXIT_FAILURE;}
+    }
+
+    try
+    {
+        BTLEShmReader reader(name);
+        BTLEShmPacket packet;
+        uint64_t lost = 0;
+        while (true)
+        {
+            if (not reader.read(packet))
+            {
+                if (once) break;
+                std::fflush(stdout);
+                std::this_thread::sleep_for(std::chrono::microseconds(pollUs));
+                continue;
+            }
+
+            std::printf("{\"seq\":%llu,\"time\":%lld,\"index\":%llu",
+                (unsigned long long)packet.seq, (long long)packet.timeNs,
+                (unsigned long long)packet.record.sampleIndex);
+            std::printf(",\"address\":\"0x%08x\",\"crc\":\"0x%06x\"",
+                unsigned(packet.record.accessAddress), unsigned(packet.record.crc));
+            if (packet.channel != 0xff) std::printf(",\"channel\":%u", unsigned(packet.channel));
+            printNumber("rssi", packet.link.rssi);
+            printNumber("snr", packet.link.snr);
+            printNumber("cfo", packet.link.cfo);
+            if (reader.lost() != lost) std::printf(",\"lost\":%llu", (unsigned long long)(reader.lost() - lost));
+            lost = reader.lost();
+            std::printf(",\"pdu\":\"");
+            for (size_t i = 0; i < packet.record.pduLength; i++) std::printf("%02x", unsigned(packet.pdu[i]));
+            std::printf("\"}\n");
+        }
+    }
+    catch (const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
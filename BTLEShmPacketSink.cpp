@@ -0,0 +1,185 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include "BTLEShmRing.hpp"
+#include <chrono>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+
+/***********************************************************************
+ * |PothosDoc BTLE Shared Memory Sink
+ *
+ * Export decoded BTLE packets to other processes through a shared memory ring.
+ * Each packet is written as a fixed layout record into a POSIX shared memory object,
+ * which readers map and poll with the BTLEShmReader class in BTLEShmRing.hpp
+ * (installed with the headers), without system calls or serialization.
+ *
+ * The sink never waits for the readers: a slow reader that falls behind
+ * by more than the ring size loses the oldest packets, and knows how many
+ * from the packet sequence numbers. The btle_shm_dump utility prints
+ * the packets of a ring as JSON lines.
+ *
+ * <h2>Input messages</h2>
+ *
+ * The sink accepts the dictionary messages of the BTLE decoder block,
+ * and the batch messages of its batch output mode, which are copied
+ * into the ring without parsing any keywords.
+ * Messages without a "PDU" key are ignored.
+ *
+ * |category /Sinks
+ * |keywords bluetooth low energy shared memory ipc
+ *
+ * |param name[Name] The name of the shared memory object.
+ * |default "/btle_packets"
+ * |widget StringEntry()
+ *
+ * |param numSlots[Num Slots] The ring size in packets, rounded up to a power of two.
+ * A new size takes effect on the next activation, which replaces the ring
+ * with a new shared memory object; readers map the new ring by name.
+ * |default 4096
+ *
+ * |factory /btle/shm_packet_sink()
+ * |setter setName(name)
+ * |setter setNumSlots(numSlots)
+ **********************************************************************/
+class BTLEShmPacketSink : public Pothos::Block
+{
+public:
+    BTLEShmPacketSink(void):
+        _name("/btle_packets"),
+        _numSlots(4096),
+        _numPackets(0)
+    {
+        this->setupInput(0); //input messages from decoder
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEShmPacketSink, setName));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEShmPacketSink, setNumSlots));
+        this->registerCall(this, POTHOS_FCN_TUPLE(BTLEShmPacketSink, numPackets));
+        this->registerProbe("numPackets");
+    }
+
+    ~BTLEShmPacketSink(void)
+    {
+        //readers keep their mappings, new readers cannot attach
+        _ring.close();
+        if (not _openName.empty()) shm_unlink(_openName.c_str());
+    }
+
+    static Block *make(void)
+    {
+        return new BTLEShmPacketSink();
+    }
+
+    void setName(const std::string &name)
+    {
+        if (name.size() < 2 or name[0] != '/' or name.find('/', 1) != std::string::npos)
+        {
+            throw Pothos::InvalidArgumentException("BTLEShmPacketSink::setName("+name+")", "expected a name like /btle_packets");
+        }
+        _name = name;
+    }
+
+    void setNumSlots(const size_t numSlots)
+    {
+        if (numSlots == 0 or numSlots > (1 << 24)) throw Pothos::InvalidArgumentException(
+            "BTLEShmPacketSink::setNumSlots("+std::to_string(numSlots)+")", "expected 1 to 16M slots");
+        _numSlots = numSlots;
+    }
+
+    unsigned long long numPackets(void) const
+    {
+        return _numPackets;
+    }
+
+    void activate(void)
+    {
+        //a ring of the same size is reset in place, another size replaces the object,
+        //either way the readers follow the restart
+        if (not _openName.empty() and _openName != _name) shm_unlink(_openName.c_str());
+        _openName = _name;
+        try
+        {
+            _ring.open(_name, _numSlots);
+        }
+        catch (const std::runtime_error &ex)
+        {
+            throw Pothos::RuntimeException("BTLEShmPacketSink::activate()", ex.what());
+        }
+        _numPackets = 0;
+    }
+
+    void deactivate(void)
+    {
+        _ring.close();
+    }
+
+    void work(void)
+    {
+        auto inPort = this->input(0);
+        while (inPort->hasMessage())
+        {
+            const auto msg = inPort->popMessage();
+            if (msg.type() == typeid(BTLEPacketBatch)) this->writeBatch(msg.extract<BTLEPacketBatch>());
+            else if (msg.type() == typeid(Pothos::ObjectKwargs)) this->writePacket(msg.extract<Pothos::ObjectKwargs>());
+        }
+    }
+
+private:
+    static int64_t nowNs(void)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void writeBatch(const BTLEPacketBatch &batch)
+    {
+        //batches carry no time, all packets of a batch get the time of arrival
+        const auto timeNs = nowNs();
+        batch.forEach([this, timeNs](const BTLEPacketRecord &record, const BTLEPacketLink &link, const uint8_t *pdu)
+        {
+            _ring.write(timeNs, record, link, record.channel, pdu);
+            _numPackets++;
+        });
+    }
+
+    void writePacket(const Pothos::ObjectKwargs &data)
+    {
+        const auto pduIt = data.find("PDU");
+        if (pduIt == data.end() or pduIt->second.type() != typeid(std::vector<uint8_t>)) return;
+        const auto &pdu = pduIt->second.extract<std::vector<uint8_t>>();
+
+        BTLEPacketRecord record;
+        std::memset(&record, 0, sizeof(record));
+        record.pduLength = uint16_t(pdu.size());
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        BTLEPacketLink link = {nan, nan, nan, nan};
+        uint8_t channel = 0xff;
+        int64_t timeNs = 0;
+        for (const auto &pair : data)
+        {
+            if (pair.first == "Address") record.accessAddress = std::stoul(pair.second.convert<std::string>(), nullptr, 16);
+            else if (pair.first == "CRC") record.crc = std::stoul(pair.second.convert<std::string>(), nullptr, 16);
+            else if (pair.first == "SampleIndex") record.sampleIndex = pair.second.convert<unsigned long long>();
+            else if (pair.first == "Threshold") record.threshold = pair.second.convert<int>();
+            else if (pair.first == "Channel") channel = uint8_t(pair.second.convert<int>());
+            else if (pair.first == "Timestamp") timeNs = pair.second.convert<long long>();
+            else if (pair.first == "RSSI") link.rssi = pair.second.convert<float>();
+            else if (pair.first == "Noise") link.noise = pair.second.convert<float>();
+            else if (pair.first == "SNR") link.snr = pair.second.convert<float>();
+            else if (pair.first == "CFO") link.cfo = pair.second.convert<float>();
+        }
+        if (timeNs == 0) timeNs = nowNs();
+        _ring.write(timeNs, record, link, channel, pdu.data());
+        _numPackets++;
+    }
+
+    std::string _name;
+    std::string _openName;
+    size_t _numSlots;
+    BTLEShmWriter _ring;
+    unsigned long long _numPackets;
+};
+
+static Pothos::BlockRegistry registerBTLEShmPacketSink(
+    "/btle/shm_packet_sink", &BTLEShmPacketSink::make);
@@ -0,0 +1,356 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include "BTLEPacketRecord.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!
+ * Shared memory ring of decoded packets for consumers in other processes.
+ *
+ * The ring lives in a POSIX shared memory object (shm_open) holding a header
+ * and a power of two number of fixed size slots. There is one writer,
+ * the /btle/shm_packet_sink block, and any number of independent readers,
+ * which only map the ring read-only and never signal the writer.
+ * The writer never waits: when a reader falls behind by more than the ring size,
+ * the oldest packets are overwritten and the reader counts them as lost.
+ *
+ * Packet n goes to slot n % numSlots. Each slot is a seqlock:
+ * the writer stores 2n+1 into the slot sequence, writes the packet,
+ * then stores 2n+2 and publishes writeSeq = n+1.
+ * A reader copies the slot out and accepts it only when the sequence
+ * was 2n+2 both before and after the copy.
+ * Reading involves no system calls, only loads from the mapping.
+ *
+ * The geometry of a ring never changes while it is mapped.
+ * The writer resets a ring of the same size in place: it clears the magic,
+ * resets writeSeq to 0, and stores the magic again.
+ * For another number of slots, it clears the magic of the old ring,
+ * unlinks it, and creates a new object under the same name.
+ * A reader that sees the magic cleared or writeSeq go backwards
+ * maps the ring again by name and starts over at packet 0.
+ *
+ * The layout is fixed and in host byte order, so readers may also be
+ * written in other languages by following the structures below.
+ */
+
+static const uint32_t BTLE_SHM_MAGIC = 0x42544c45; //"BTLE"
+static const uint32_t BTLE_SHM_VERSION = 1;
+
+//! Largest PDU carried in a slot: the 2 byte header and up to 255 payload bytes
+static const size_t BTLE_SHM_MAX_PDU = 258;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock free 64-bit atomics");
+
+//! One decoded packet as copied out of the ring
+struct BTLEShmPacket
+{
+    uint64_t seq; //!< the packet number, counting from 0 since the writer started
+    int64_t timeNs; //!< the decoder timestamp, nanoseconds since the epoch
+    BTLEPacketRecord record; //!< sample index, address, crc, and pdu length
+    BTLEPacketLink link; //!< link estimates, NaN when not available
+    uint8_t channel; //!< the advertising channel, 0xff when not known
+    uint8_t reserved[7];
+    uint8_t pdu[BTLE_SHM_MAX_PDU]; //!< record.pduLength bytes of dewhitened PDU
+};
+
+//! A ring slot in shared memory, the slot sequence followed by the packet fields
+struct BTLEShmSlot
+{
+    std::atomic<uint64_t> seq;
+    int64_t timeNs;
+    BTLEPacketRecord record;
+    BTLEPacketLink link;
+    uint8_t channel;
+    uint8_t reserved[7];
+    uint8_t pdu[BTLE_SHM_MAX_PDU];
+};
+
+//! The ring header at the start of the shared memory object
+struct BTLEShmHeader
+{
+    uint32_t magic; //!< BTLE_SHM_MAGIC, stored last when the ring is ready
+    uint32_t version; //!< BTLE_SHM_VERSION
+    uint32_t numSlots; //!< a power of two
+    uint32_t slotSize; //!< sizeof(BTLEShmSlot)
+    alignas(64) std::atomic<uint64_t> writeSeq; //!< the number of packets written
+    alignas(64) BTLEShmSlot slots[1]; //!< numSlots slots
+};
+
+//! The size of the shared memory object for a number of slots
+inline size_t btleShmSize(const size_t numSlots)
+{
+    return offsetof(BTLEShmHeader, slots) + numSlots*sizeof(BTLEShmSlot);
+}
+
+/*!
+ * The writer side of the ring, used by the shm packet sink block.
+ */
+class BTLEShmWriter
+{
+public:
+    BTLEShmWriter(void):
+        _header(nullptr),
+        _size(0),
+        _mask(0),
+        _writeSeq(0)
+    {
+        return;
+    }
+
+    ~BTLEShmWriter(void)
+    {
+        this->close();
+    }
+
+    /*!
+     * Reuse the named shared memory object when it has the same size,
+     * or create a new one, and reset the ring.
+     * \param name the object name, ex: "/btle_packets"
+     * \param numSlots the ring size, rounded up to a power of two
+     * \throws std::runtime_error when the object cannot be created or mapped
+     */
+    void open(const std::string &name, const size_t numSlots)
+    {
+        this->close();
+        size_t slots = 1;
+        while (slots < numSlots) slots <<= 1;
+        const size_t size = btleShmSize(slots);
+
+        //an object of another size is replaced, never resized under its readers
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        struct stat st;
+        if (fd >= 0 and (fstat(fd, &st) != 0 or size_t(st.st_size) != size))
+        {
+            retire(fd);
+            ::close(fd);
+            shm_unlink(name.c_str());
+            fd = -1;
+        }
+        if (fd < 0)
+        {
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd < 0) throw std::runtime_error("shm_open("+name+"): "+std::strerror(errno));
+            if (ftruncate(fd, off_t(size)) != 0)
+            {
+                const std::string err(std::strerror(errno));
+                ::close(fd);
+                shm_unlink(name.c_str());
+                throw std::runtime_error("ftruncate("+name+"): "+err);
+            }
+        }
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) throw std::runtime_error("mmap("+name+"): "+std::strerror(errno));
+
+        //readers ignore the ring until the magic is stored
+        _header = static_cast<BTLEShmHeader *>(mem);
+        _size = size;
+        _mask = slots-1;
+        _writeSeq = 0;
+        __atomic_store_n(&_header->magic, 0, __ATOMIC_RELEASE);
+        _header->version = BTLE_SHM_VERSION;
+        _header->numSlots = uint32_t(slots);
+        _header->slotSize = uint32_t(sizeof(BTLEShmSlot));
+        _header->writeSeq.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < slots; i++) _header->slots[i].seq.store(0, std::memory_order_relaxed);
+        __atomic_store_n(&_header->magic, BTLE_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    void close(void)
+    {
+        if (_header != nullptr) munmap(_header, _size);
+        _header = nullptr;
+    }
+
+    //! Write one packet, overwriting the oldest slot when the ring is full
+    void write(const int64_t timeNs, const BTLEPacketRecord &record, const BTLEPacketLink &link, const uint8_t channel, const uint8_t *pdu)
+    {
+        const uint64_t n = _writeSeq++;
+        auto &slot = _header->slots[n & _mask];
+        slot.seq.store(2*n+1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.timeNs = timeNs;
+        slot.record = record;
+        slot.record.pduLength = uint16_t(std::min<size_t>(record.pduLength, BTLE_SHM_MAX_PDU));
+        slot.link = link;
+        slot.channel = channel;
+        std::memcpy(slot.pdu, pdu, slot.record.pduLength);
+
+        slot.seq.store(2*n+2, std::memory_order_release);
+        _header->writeSeq.store(n+1, std::memory_order_release);
+    }
+
+private:
+    //clear the magic of a ring that is about to be unlinked, so its readers map the new one
+    static void retire(const int fd)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 or size_t(st.st_size) < btleShmSize(1)) return;
+        void *mem = mmap(nullptr, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) return;
+        const auto magic = static_cast<uint32_t *>(mem);
+        if (__atomic_load_n(magic, __ATOMIC_ACQUIRE) == BTLE_SHM_MAGIC) __atomic_store_n(magic, 0, __ATOMIC_RELEASE);
+        munmap(mem, sizeof(uint32_t));
+    }
+
+    BTLEShmHeader *_header;
+    size_t _size;
+    uint64_t _mask;
+    uint64_t _writeSeq;
+};
+
+/*!
+ * The reader side of the ring, for consumers in other processes.
+ * Each reader keeps its own position, so readers never affect each other or the writer.
+ *
+ * Ex: BTLEShmReader reader("/btle_packets");
+ *     BTLEShmPacket packet;
+ *     while (reader.read(packet)) process(packet);
+ */
+class BTLEShmReader
+{
+public:
+    /*!
+     * Map the named ring read-only and start at the oldest packet still in the ring.
+     * \throws std::runtime_error when the ring does not exist or has another layout
+     */
+    BTLEShmReader(const std::string &name):
+        _name(name),
+        _header(nullptr),
+        _size(0),
+        _mask(0),
+        _next(0),
+        _lost(0)
+    {
+        const auto error = this->attach();
+        if (not error.empty()) throw std::runtime_error(error);
+        const uint64_t written = _header->writeSeq.load(std::memory_order_acquire);
+        _next = (written > _mask)?(written-_mask):0;
+    }
+
+    ~BTLEShmReader(void)
+    {
+        this->detach();
+    }
+
+    BTLEShmReader(const BTLEShmReader &) = delete;
+    BTLEShmReader &operator=(const BTLEShmReader &) = delete;
+
+    /*!
+     * Copy out the next packet.
+     * \return false when there is no new packet
+     */
+    bool read(BTLEShmPacket &packet)
+    {
+        //the ring was reset or replaced: map it again once it is ready
+        if (_header == nullptr or __atomic_load_n(&_header->magic, __ATOMIC_ACQUIRE) != BTLE_SHM_MAGIC)
+        {
+            if (not this->attach().empty()) return false;
+            _next = 0;
+        }
+
+        while (true)
+        {
+            const uint64_t written = _header->writeSeq.load(std::memory_order_acquire);
+            if (written < _next) //the writer restarted, check the geometry again
+            {
+                if (not this->attach().empty()) return false;
+                _next = 0;
+                continue;
+            }
+            if (_next == written) return false;
+
+            //overwritten before we got to it, skip ahead
+            if (written - _next > _mask+1)
+            {
+                _lost += written - _next - (_mask+1);
+                _next = written - (_mask+1);
+            }
+
+            const auto &slot = _header->slots[_next & _mask];
+            const uint64_t expect = 2*_next+2;
+            if (slot.seq.load(std::memory_order_acquire) == expect)
+            {
+                packet.timeNs = slot.timeNs;
+                packet.record = slot.record;
+                packet.link = slot.link;
+                packet.channel = slot.channel;
+                std::memcpy(packet.pdu, slot.pdu, std::min<size_t>(packet.record.pduLength, BTLE_SHM_MAX_PDU));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq.load(std::memory_order_relaxed) == expect)
+                {
+                    packet.seq = _next++;
+                    return true;
+                }
+            }
+
+            //the writer lapped us during the copy
+            _lost++;
+            _next++;
+        }
+    }
+
+    //! The number of packets overwritten before they were read
+    uint64_t lost(void) const
+    {
+        return _lost;
+    }
+
+private:
+    //map the ring by name, or return the error
+    std::string attach(void)
+    {
+        this->detach();
+        const int fd = shm_open(_name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return "shm_open("+_name+"): "+std::strerror(errno);
+        struct stat st;
+        if (fstat(fd, &st) != 0 or size_t(st.st_size) < btleShmSize(1))
+        {
+            ::close(fd);
+            return "BTLEShmReader("+_name+"): not a packet ring";
+        }
+        const size_t size = size_t(st.st_size);
+        void *mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) return "mmap("+_name+"): "+std::strerror(errno);
+        _header = static_cast<const BTLEShmHeader *>(mem);
+        _size = size;
+
+        if (__atomic_load_n(&_header->magic, __ATOMIC_ACQUIRE) != BTLE_SHM_MAGIC or
+            _header->version != BTLE_SHM_VERSION or
+            _header->slotSize != sizeof(BTLEShmSlot) or
+            btleShmSize(_header->numSlots) > _size)
+        {
+            this->detach();
+            return "BTLEShmReader("+_name+"): not a packet ring";
+        }
+        _mask = _header->numSlots-1;
+        return "";
+    }
+
+    void detach(void)
+    {
+        if (_header != nullptr) munmap(const_cast<BTLEShmHeader *>(_header), _size);
+        _header = nullptr;
+    }
+
+    std::string _name;
+    const BTLEShmHeader *_header;
+    size_t _size;
+    uint64_t _mask;
+    uint64_t _next;
+    uint64_t _lost;
+};
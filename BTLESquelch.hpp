@@ -0,0 +1,150 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <algorithm>
+
+/*!
+ * Energy detect squelch for complex baseband input.
+ *
+ * The mean power of each block of samples is compared with an adaptive
+ * noise floor, which follows the quietest blocks immediately and rises
+ * by a small fraction per block, so a burst hardly moves it.
+ * The gate opens when a block is above the floor by the open level, and closes
+ * after the power stays below the close level for the post margin.
+ * Only the samples of open periods, plus the pre margin before the opening,
+ * are passed on; everything else is skipped without demodulation.
+ */
+class BTLESquelch
+{
+public:
+    /*!
+     * \param preMargin samples passed before the block that opened the gate
+     * \param postMargin samples passed after the power falls below the close level
+     * \param blockSize the samples per power measurement
+     */
+    BTLESquelch(const size_t preMargin = 128, const size_t postMargin = 1024, const size_t blockSize = 64):
+        _preMargin(preMargin),
+        _postMargin(postMargin),
+        _blockSize(blockSize),
+        _openRatio(4.0),
+        _closeRatio(2.0)
+    {
+        this->reset();
+    }
+
+    void reset(void)
+    {
+        _noiseFloor = 0.0;
+        _open = false;
+        _postCount = 0;
+        _skipped = 0;
+        _history.clear();
+    }
+
+    //! The open level in dB above the noise floor, the gate closes 3 dB lower
+    void setLevel(const double levelDB)
+    {
+        _openRatio = std::pow(10.0, levelDB/10);
+        _closeRatio = std::pow(10.0, (levelDB-3.0)/10);
+    }
+
+    //! The noise floor power in the units of std::norm() of the input
+    double noiseFloor(void) const
+    {
+        return _noiseFloor;
+    }
+
+    /*!
+     * Gate a buffer of samples.
+     * The callbacks are called in stream order as pass(const std::complex<float> *, size_t)
+     * for each span of samples to decode and skip(size_t) with the number
+     * of samples dropped before the next span.
+     */
+    template <typename Pass, typename Skip>
+    void process(const std::complex<float> *in, const size_t N, Pass &&pass, Skip &&skip)
+    {
+        size_t passStart = 0; //start of the current open span in this buffer
+        for (size_t i = 0; i < N; i += _blockSize)
+        {
+            const size_t n = std::min(_blockSize, N-i);
+            const double power = meanSquare(in+i, n);
+
+            //noise floor: fall to quiet blocks immediately, rise slowly (in dB) through bursts
+            if (power < _noiseFloor or _noiseFloor == 0.0) _noiseFloor = power;
+            else _noiseFloor = std::min(power, _noiseFloor*(1.0+NOISE_RISE));
+
+            if (not _open)
+            {
+                if (power <= _noiseFloor*_openRatio)
+                {
+                    _skipped += n;
+                    continue;
+                }
+
+                //open: pass the pre margin from the history and this buffer
+                const size_t pre = std::min(_preMargin, _skipped);
+                const size_t preInBuff = std::min(pre, i);
+                const size_t preInHistory = std::min(pre-preInBuff, _history.size());
+                skip(_skipped - preInBuff - preInHistory);
+                if (preInHistory != 0) pass(_history.data()+_history.size()-preInHistory, preInHistory);
+                passStart = i-preInBuff;
+                _skipped = 0;
+                _open = true;
+                _postCount = 0;
+            }
+
+            //close after the post margin below the close level
+            if (power > _noiseFloor*_closeRatio) _postCount = 0;
+            else if ((_postCount += n) >= _postMargin)
+            {
+                pass(in+passStart, i+n-passStart);
+                _open = false;
+            }
+        }
+        if (_open and passStart < N) pass(in+passStart, N-passStart);
+
+        //keep the tail for the pre margin of an opening in the next buffer
+        if (N >= _preMargin) _history.assign(in+N-_preMargin, in+N);
+        else
+        {
+            _history.insert(_history.end(), in, in+N);
+            if (_history.size() > _preMargin) _history.erase(_history.begin(), _history.end()-_preMargin);
+        }
+    }
+
+private:
+    static constexpr double NOISE_RISE = 1e-3;
+
+    //mean of |x|^2 over interleaved floats, with independent partial sums
+    //so that the loop vectorizes without reassociating floating point math
+    static double meanSquare(const std::complex<float> *in, const size_t n)
+    {
+        const float *f = reinterpret_cast<const float *>(in);
+        const size_t numFloats = 2*n;
+        float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        size_t i = 0;
+        for (; i+8 <= numFloats; i += 8)
+        {
+            for (size_t k = 0; k < 8; k++) acc[k] += f[i+k]*f[i+k];
+        }
+        for (; i < numFloats; i++) acc[0] += f[i]*f[i];
+        return (double(acc[0]+acc[1]+acc[2]+acc[3]) + double(acc[4]+acc[5]+acc[6]+acc[7]))/n;
+    }
+
+    size_t _preMargin;
+    size_t _postMargin;
+    size_t _blockSize;
+    double _openRatio;
+    double _closeRatio;
+    double _noiseFloor;
+    bool _open;
+    size_t _postCount;
+    uint64_t _skipped;
+    std::vector<std::complex<float>> _history;
+};
@@ -0,0 +1,185 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*!
+ * Hierarchical timing wheel for per-device deadlines.
+ *
+ * Timers are identified by a dense index (the device table index).
+ * There are 4 levels of 64 slots; level 0 slots are one tick wide,
+ * and each higher level is 64 times coarser. Timers on a higher level
+ * cascade down when the lower level wraps around, as in the classic
+ * kernel timer wheel. Each slot is an intrusive doubly linked list,
+ * so scheduling, rescheduling, and cancelling are O(1),
+ * and advancing costs O(1) per elapsed tick plus O(1) per expiry.
+ */
+class BTLETimerWheel
+{
+public:
+    BTLETimerWheel(const int64_t tickNs = 5000000):
+        _tickNs(tickNs),
+        _nowTick(0),
+        _started(false),
+        _numScheduled(0),
+        _heads(LEVELS*SLOTS, int32_t(NONE))
+    {
+        return;
+    }
+
+    int64_t tickNs(void) const
+    {
+        return _tickNs;
+    }
+
+    bool empty(void) const
+    {
+        return _numScheduled == 0;
+    }
+
+    //! Remove all timers
+    void clear(void)
+    {
+        _heads.assign(LEVELS*SLOTS, int32_t(NONE));
+        _nodes.clear();
+        _numScheduled = 0;
+        _started = false;
+    }
+
+    /*!
+     * Schedule (or reschedule) a timer to expire at the given time.
+     * The timer fires from advance() once the time has passed,
+     * at most one tick late. A deadline that has already passed
+     * fires on the next tick.
+     * \param nowNs the current time, which starts the clock of an idle wheel
+     */
+    void schedule(const size_t id, const int64_t deadlineNs, const int64_t nowNs)
+    {
+        if (id >= _nodes.size()) _nodes.resize(id+1);
+        this->cancel(id);
+        if (not _started or _numScheduled == 0) this->start(nowNs/_tickNs);
+        auto &node = _nodes[id];
+        node.expires = (deadlineNs + _tickNs - 1)/_tickNs;
+        this->insert(int32_t(id));
+        _numScheduled++;
+    }
+
+    //! Cancel a timer if it is scheduled
+    void cancel(const size_t id)
+    {
+        if (id >= _nodes.size() or _nodes[id].slot == NONE) return;
+        this->unlink(int32_t(id));
+        _numScheduled--;
+    }
+
+    /*!
+     * Advance the wheel to the given time and call onExpire(id)
+     * for every timer whose deadline has passed.
+     */
+    template <typename Fcn>
+    void advance(const int64_t nowNs, Fcn &&onExpire)
+    {
+        const int64_t target = nowNs/_tickNs;
+        if (not _started) return;
+        while (_nowTick <= target)
+        {
+            //idle wheel: jump straight to the target
+            if (_numScheduled == 0)
+            {
+                _nowTick = target+1;
+                break;
+            }
+
+            const size_t index = size_t(_nowTick & MASK);
+            if (index == 0 and this->cascade(1) == 0 and this->cascade(2) == 0) this->cascade(3);
+
+            //fire everything in the current level 0 slot
+            int32_t id;
+            while ((id = _heads[index]) != NONE)
+            {
+                this->unlink(id);
+                _numScheduled--;
+                onExpire(size_t(id));
+            }
+            _nowTick++;
+        }
+    }
+
+private:
+    static const size_t LEVELS = 4;
+    static const size_t BITS = 6;
+    static const size_t SLOTS = 1 << BITS;
+    static const int64_t MASK = SLOTS-1;
+    static const int32_t NONE = -1;
+
+    struct Node
+    {
+        Node(void): next(NONE), prev(NONE), slot(NONE), expires(0) {}
+        int32_t next, prev;
+        int32_t slot; //index into heads, NONE when not scheduled
+        int64_t expires; //in ticks
+    };
+
+    void start(const int64_t tick)
+    {
+        _nowTick = tick;
+        _started = true;
+    }
+
+    void insert(const int32_t id)
+    {
+        auto &node = _nodes[id];
+        if (node.expires < _nowTick) node.expires = _nowTick; //already passed
+        int64_t delta = node.expires - _nowTick;
+        size_t level = 0;
+        while (level < LEVELS-1 and delta >= (int64_t(1) << (BITS*(level+1)))) level++;
+        if (delta >= (int64_t(1) << (BITS*LEVELS)))
+        {
+            node.expires = _nowTick + (int64_t(1) << (BITS*LEVELS)) - 1;
+        }
+        const auto slot = int32_t(level*SLOTS + size_t((node.expires >> (BITS*level)) & MASK));
+
+        //push front
+        node.slot = slot;
+        node.prev = NONE;
+        node.next = _heads[slot];
+        if (node.next != NONE) _nodes[node.next].prev = id;
+        _heads[slot] = id;
+    }
+
+    void unlink(const int32_t id)
+    {
+        auto &node = _nodes[id];
+        if (node.prev != NONE) _nodes[node.prev].next = node.next;
+        else _heads[node.slot] = node.next;
+        if (node.next != NONE) _nodes[node.next].prev = node.prev;
+        node.next = node.prev = node.slot = NONE;
+    }
+
+    //move the current slot of a level down to lower levels, return the slot index
+    size_t cascade(const size_t level)
+    {
+        const size_t index = size_t((_nowTick >> (BITS*level)) & MASK);
+        const size_t slot = level*SLOTS + index;
+        int32_t id = _heads[slot];
+        _heads[slot] = NONE;
+        while (id != NONE)
+        {
+            const int32_t next = _nodes[id].next;
+            _nodes[id].slot = NONE;
+            this->insert(id);
+            id = next;
+        }
+        return index;
+    }
+
+    const int64_t _tickNs;
+    int64_t _nowTick; //the next tick to process
+    bool _started;
+    size_t _numScheduled;
+    std::vector<int32_t> _heads;
+    std::vector<Node> _nodes;
+};
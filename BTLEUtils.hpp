@@ -4,6 +4,7 @@
 #pragma once
 #include <Pothos/Object/Containers.hpp>
 #include <Poco/Format.h>
+#include "BTLEAdvData.hpp"
 #include <chrono>
 
 /*
@@ -53,6 +54,10 @@ Steve Markgraf, RTL-SDR Library - https://github.com/steve-m/librtlsdr
 
 #include <cstdint>
 #include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 
 struct BTLEUtilsDecoder
 {
@@ -62,8 +67,13 @@ int32_t g_threshold; // Quantization threshold
 int g_srate; // sample rate downconvert ratio
 
 /* Ring Buffer */
-#define RB_SIZE 1000
+/* holds the longest packet: preamble, address, 257 byte pdu, and crc (2120 bits) at 2 samples per bit */
+/* a packet is decoded as soon as its last sample arrives, the ring only holds it until then */
+#define RB_SIZE 4256
 int rb_head=-1;
+int rb_start=0; /* ring index of the packet start being checked */
+int rb_fill=0; /* samples from rb_start to rb_head */
+int rb_need=0; /* samples the packet at rb_start needs, 0 until its header is checked */
 int16_t *rb_buf;
 /* Init Ring Buffer */
 void RB_init(void){
@@ -74,8 +84,8 @@ void RB_inc(void){
 	rb_head++;
 	rb_head=(rb_head)%RB_SIZE;
 }
-/* Access Ring Buffer location l */
-#define RB(l) rb_buf[(rb_head+(l))%RB_SIZE]
+/* Access Ring Buffer location l from the packet start */
+#define RB(l) rb_buf[(rb_start+(l))%RB_SIZE]
 /* end Ring Buffer */
 
 /* helper functions */
@@ -117,7 +127,7 @@ uint32_t NRFCrc(const uint8_t* data, size_t data_len)
 }
 
 /* Calcualte custom CRC24 for BTLE */
-uint32_t BTLECrc(const uint8_t* data, uint8_t len, uint8_t* dst){
+uint32_t BTLECrc(const uint8_t* data, size_t len, uint8_t* dst){
 
 	uint8_t v, t, d;
 	uint32_t crc=0;
@@ -147,7 +157,7 @@ uint32_t BTLECrc(const uint8_t* data, uint8_t len, uint8_t* dst){
 }
 
 /* whiten (descramble) BTLE packet using channel value */
-void BTLEWhiten(uint8_t* data, uint8_t len, uint8_t chan){
+void BTLEWhiten(uint8_t* data, size_t len, uint8_t chan){
 
 	uint8_t  i;
 	uint8_t lfsr = SwapBits(chan) | 2;
@@ -224,10 +234,10 @@ void PackPacket(uint64_t packet_addr_l, uint16_t pcf, uint8_t* packet_data, int
 	}
 }
 
-bool DecodeBTLEPacket(int32_t sample, int srate){
+bool DecodeBTLEPacket(int64_t sample, int srate){
 	int c;
 	//struct timeval tv;
-	uint8_t packet_data[500];
+	uint8_t packet_data[BTLE_MAX_PDU_LENGTH+3]; // pdu and crc
 	int packet_length;
 	uint32_t packet_crc;
 	uint32_t calced_crc;
@@ -241,28 +251,26 @@ bool DecodeBTLEPacket(int32_t sample, int srate){
 	packet_addr_l=0;
 	for (c=0;c<4;c++) packet_addr_l|=((uint64_t)SwapBits(ExtractByte((c+1)*8)))<<(8*c);
 
+	/* data packets need the crc init and hopping of their connection, which are not followed */
+	if (packet_addr_l!=0x8E89BED6) return false;
+
 	/* extract pdu header */
 	ExtractBytes(5*8, packet_header_arr, 2);
 
 	/* whiten header only so we can extract pdu length */
-	BTLEWhiten(packet_header_arr, 2, 38);
+	BTLEWhiten(packet_header_arr, 2, channel);
 
-	if (packet_addr_l==0x8E89BED6){  // Advertisement packet
-		packet_length=SwapBits(packet_header_arr[1])&0x3F;
-	} else {
-		packet_length=0;			// TODO: data packets unsupported
+	/* all 8 bits are the length since extended advertising (255 byte payloads) */
+	packet_length=SwapBits(packet_header_arr[1]);
 
-	}
+	/* the last crc bit must still be in the ring buffer */
+	if ((5+2+packet_length+3)*8*srate > RB_SIZE) return false;
 
-	/* extract and whiten pdu+crc */
+	/* extract and whiten pdu+crc, only as many bytes as the packet holds */
 	ExtractBytes(5*8, packet_data, packet_length+2+3);
-	BTLEWhiten(packet_data, packet_length+2+3, 38);
+	BTLEWhiten(packet_data, packet_length+2+3, channel);
 
-	if (packet_addr_l==0x8E89BED6){  // Advertisement packet
-		crc[0]=crc[1]=crc[2]=0x55;
-	} else {
-		crc[0]=crc[1]=crc[2]=0;		// TODO: data packets unsupported
-	}
+	crc[0]=crc[1]=crc[2]=0x55; // advertising crc init
 
 	/* calculate packet crc */
 	calced_crc=BTLECrc(packet_data, packet_length+2, crc);
@@ -278,76 +286,126 @@ bool DecodeBTLEPacket(int32_t sample, int srate){
 		//for (c=0;c<packet_length+2;c++) printf("%02X ",SwapBits(packet_data[c]));
 		//printf("\n");
 
-        //packet metadata
-        packetData.clear();
-        packetData["Timestamp"] = Pothos::Object(std::chrono::high_resolution_clock::now().time_since_epoch().count());
-        packetData["Address"] = Pothos::Object(Poco::format("0x%08x", unsigned(packet_addr_l)));
-        packetData["CRC"] = Pothos::Object(Poco::format("0x%06x", unsigned(packet_crc)));
-        packetData["SampleIndex"] = Pothos::Object(sample);
-        packetData["Threshold"] = Pothos::Object(g_threshold);
-
-        //extract 6-byte MAC
-        std::string mac;
-        for (int i = 7; i >= 2; i--)
+        //raw packet fields for consumers that do not need the kwargs
+        pduAddress = uint32_t(packet_addr_l);
+        pduCRC = packet_crc;
+        pduLength = packet_length+2;
+        for (c=0;c<packet_length+2;c++) pduBytes[c] = SwapBits(packet_data[c]);
+        pduSample = sample;
+        pduThreshold = g_threshold;
+        if (formatPacketData) FormatBTLEPacket();
+		return true;
+	} else return false;
+}
+
+/* Format a 6-byte device address (least significant octet first) as aa:bb:cc:dd:ee:ff */
+std::string FormatMAC(const uint8_t *addr){
+    std::string mac;
+    for (int i = 5; i >= 0; i--)
+    {
+        mac += Poco::format("%02x:", unsigned(addr[i]));
+    }
+    return mac.substr(0, mac.size()-1);
+}
+
+/* Format the kwargs for the last decoded packet from the raw pdu fields */
+void FormatBTLEPacket(void){
+    //packet metadata
+    packetData.clear();
+    packetData["Timestamp"] = Pothos::Object(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    packetData["Address"] = Pothos::Object(Poco::format("0x%08x", unsigned(pduAddress)));
+    packetData["CRC"] = Pothos::Object(Poco::format("0x%06x", unsigned(pduCRC)));
+    packetData["SampleIndex"] = Pothos::Object(pduSample);
+    packetData["Threshold"] = Pothos::Object(pduThreshold);
+    packetData["Channel"] = Pothos::Object(channel);
+    packetData["PDU"] = Pothos::Object(std::vector<uint8_t>(pduBytes, pduBytes+pduLength));
+
+    //pdu header fields
+    BTLEAdvLayout layout;
+    const bool valid = btleAdvLayout(pduBytes, pduLength, layout);
+    const char *typeName = btlePduTypeName(layout.type, channel);
+    packetData["PDU Type"] = Pothos::Object(typeName?std::string(typeName):Poco::format("0x%x", unsigned(layout.type)));
+    packetData["TxAdd"] = Pothos::Object(std::string(layout.txAdd?"random":"public"));
+    if (not valid) return;
+
+    //extract 6-byte addresses
+    if (layout.addressOffset != 0) packetData["MAC"] = Pothos::Object(FormatMAC(pduBytes+layout.addressOffset));
+    if (layout.peerOffset != 0)
+    {
+        packetData["Peer MAC"] = Pothos::Object(FormatMAC(pduBytes+layout.peerOffset));
+        packetData["RxAdd"] = Pothos::Object(std::string(layout.rxAdd?"random":"public"));
+    }
+
+    //extended header fields
+    if (layout.type == BTLE_PDU_ADV_EXT_IND or layout.type == BTLE_PDU_AUX_CONNECT_RSP)
+    {
+        packetData["AdvMode"] = Pothos::Object(int(layout.advMode));
+    }
+    if (layout.hasADI)
+    {
+        packetData["ADI DID"] = Pothos::Object(int(layout.adiDID));
+        packetData["ADI SID"] = Pothos::Object(int(layout.adiSID));
+    }
+    if (layout.hasAuxPtr)
+    {
+        static const char *phyNames[] = {"1M", "2M", "Coded"};
+        packetData["Aux Channel"] = Pothos::Object(int(layout.auxChannel));
+        packetData["Aux Offset"] = Pothos::Object(int(layout.auxOffset));
+        packetData["Aux PHY"] = Pothos::Object((layout.auxPHY < 3)?std::string(phyNames[layout.auxPHY]):Poco::format("0x%x", unsigned(layout.auxPHY)));
+    }
+    if (layout.hasTxPower) packetData["TxPower"] = Pothos::Object(int(layout.txPower));
+
+    //extract packet fields
+    //very oversimplified for a select number of fields
+    const uint8_t *data = pduBytes + layout.dataOffset;
+    int bytesLeft = int(layout.dataEnd) - int(layout.dataOffset);
+    while (bytesLeft >= 3)
+    {
+        size_t len = data[0];
+        if (int(len) >= bytesLeft) break;
+        unsigned type = data[1];
+        std::string name;
+        bool hasUUID16 = false;
+        switch (type)
         {
-            mac += Poco::format("%02x:", unsigned(SwapBits(packet_data[i])));
+        case 0x01: name = "Flags"; break;
+        case 0x08: name = "Shortened Name"; break;
+        case 0x09: name = "Complete Name"; break;
+        case 0x16: name = "Service Data"; hasUUID16 = true; break;
+        case 0x24: name = "URI"; break;
+        case 0xFF: name = "Manufacturer Data"; hasUUID16 = true; break;
+        default: name = Poco::format("0x%02x", type); break;
         }
-        packetData["MAC"] = Pothos::Object(mac.substr(0, mac.size()-1));
 
-        //extract packet fields
-        //very oversimplified for a select number of fields
-        uint8_t *data = packet_data + 8;
-        int bytesLeft = packet_length+2 - 8;
-        while (bytesLeft >= 3)
+        if (type == 0x01 and len == 2)
         {
-            size_t len = SwapBits(data[0]);
-            if (len >= bytesLeft) break;
-            unsigned type = SwapBits(data[1]);
-            std::string name;
-            bool hasUUID16 = false;
-            switch (type)
-            {
-            case 0x01: name = "Flags"; break;
-            case 0x08: name = "Shortened Name"; break;
-            case 0x09: name = "Complete Name"; break;
-            case 0x16: name = "Service Data"; hasUUID16 = true; break;
-            case 0x24: name = "URI"; break;
-            case 0xFF: name = "Manufacturer Data"; hasUUID16 = true; break;
-            default: name = Poco::format("0x%02x", type); break;
-            }
-
-            if (type == 0x01 and len == 2)
+            packetData[name] = Pothos::Object(unsigned(data[2]));
+        }
+        else
+        {
+            size_t i = 2;
+            unsigned uuid16 = 0;
+            if (hasUUID16)
             {
-                packetData[name] = Pothos::Object(unsigned(SwapBits(data[2])));
+                uuid16 |= unsigned(data[i++]) << 0;
+                uuid16 |= unsigned(data[i++]) << 8;
+                packetData[name + " UUID16"] = Pothos::Object(Poco::format("%02x", unsigned(uuid16)));
             }
-            else
+            std::string value;
+            for (; i < len+1; i++)
             {
-                size_t i = 2;
-                unsigned uuid16 = 0;
-                if (hasUUID16)
-                {
-                    uuid16 |= unsigned(SwapBits(data[i++])) << 0;
-                    uuid16 |= unsigned(SwapBits(data[i++])) << 8;
-                    packetData[name + " UUID16"] = Pothos::Object(Poco::format("%02x", unsigned(uuid16)));
-                }
-                std::string value;
-                for (; i < len+1; i++)
-                {
-                    char ch = SwapBits(data[i]);
-                    if (std::isprint(ch)) value.push_back(ch);
-                    else value += Poco::format("\\x%02x", unsigned(ch));
-                }
-                packetData[name] = Pothos::Object(value);
+                char ch = data[i];
+                if (std::isprint(ch)) value.push_back(ch);
+                else value += Poco::format("\\x%02x", unsigned(ch));
             }
-            bytesLeft -= len + 1;
-            data += len + 1;
+            packetData[name] = Pothos::Object(value);
         }
-
-		return true;
-	} else return false;
+        bytesLeft -= len + 1;
+        data += len + 1;
+    }
 }
 
-bool DecodeNRFPacket(int32_t sample, int srate, int packet_length){
+bool DecodeNRFPacket(int64_t sample, int srate, int packet_length){
 	int c,t;
 	//struct timeval tv;
 	uint8_t tmp_buf[10];
@@ -401,7 +459,31 @@ bool DecodeNRFPacket(int32_t sample, int srate, int packet_length){
 }
 
 
-bool DecodePacket(int decode_type, int32_t sample, int srate, int packet_length){
+/* Samples from the start that the packet there needs to be decoded, 0 when there is no packet */
+/* btle: checks the preamble, the advertising access address, and the length in the pdu header */
+int PacketSamples(int decode_type, int srate){
+	uint64_t packet_addr_l;
+	uint8_t packet_header_arr[2];
+	int c;
+
+	/* nrf24: the longest packet, the length is checked by the decode */
+	if (decode_type!=2) return ((6+32+2)*8+9)*srate;
+
+	g_srate=srate;
+	g_threshold = ExtractThreshold();
+	if (!DetectPreamble()) return 0;
+
+	packet_addr_l=0;
+	for (c=0;c<4;c++) packet_addr_l|=((uint64_t)SwapBits(ExtractByte((c+1)*8)))<<(8*c);
+	if (packet_addr_l!=0x8E89BED6) return 0;
+
+	ExtractBytes(5*8, packet_header_arr, 2);
+	BTLEWhiten(packet_header_arr, 2, channel);
+	c=(5+2+SwapBits(packet_header_arr[1])+3)*8*srate;
+	return (c > RB_SIZE)?0:c;
+}
+
+bool DecodePacket(int decode_type, int64_t sample, int srate, int packet_length){
 	bool packet_detected=false;
 	g_srate=srate;
 	g_threshold = ExtractThreshold();
@@ -419,38 +501,101 @@ bool DecodePacket(int decode_type, int32_t sample, int srate, int packet_length)
 	return packet_detected;
 }
 
-    int32_t samples;
-    int skipSamples;
+    int64_t samples; //samples fed since the start, 64 bits so the index does not wrap
     int srate;
     int packet_len;
     int decode_type;
+    int channel; //advertising channel index used for whitening
+
+    //when false only the raw pdu fields are filled in
+    bool formatPacketData;
 
     BTLEUtilsDecoder(const int srate_ = 2, const int decode_type_ = 2):
         g_threshold(0),
         samples(0),
-        skipSamples(1000),
         srate(srate_),
         packet_len(0),
-        decode_type(decode_type_)
+        decode_type(decode_type_),
+        channel(38),
+        formatPacketData(true),
+        pduSample(0),
+        pduStart(0),
+        pduThreshold(0),
+        pduAddress(0),
+        pduCRC(0),
+        pduLength(0)
     {
         RB_init();
     }
 
+    ~BTLEUtilsDecoder(void)
+    {
+        free(rb_buf);
+    }
+
+    //! Empty the ring buffer, together with any ring kept in step with it (BTLEComplexDemod)
+    void reset(void)
+    {
+        rb_head = -1;
+        rb_start = 0;
+        rb_fill = 0;
+        rb_need = 0;
+        std::memset(rb_buf, 0, RB_SIZE*sizeof(int16_t));
+    }
+
+    //the ring buffer is owned by this instance
+    BTLEUtilsDecoder(const BTLEUtilsDecoder &) = delete;
+    BTLEUtilsDecoder &operator=(const BTLEUtilsDecoder &) = delete;
+
+    /*!
+     * Feed one frequency demodulated sample.
+     * Each packet start is checked once its header has arrived,
+     * and the packet is decoded once its last sample has arrived.
+     * \return true when a packet was decoded, see the pdu fields
+     */
     bool feedOne(const uint16_t sample)
     {
         RB_inc();
-        RB(0)=(int)sample;
+        rb_buf[rb_head]=(int)sample;
+        samples++;
+        rb_fill++;
 
-        if (--skipSamples<1)
+        const int headerSamples = (1+4+2)*8*srate;
+        while (rb_fill >= std::max(rb_need, headerSamples))
         {
-            if (DecodePacket(decode_type, ++samples, srate, packet_len))
+            if (rb_need == 0)
+            {
+                rb_need = PacketSamples(decode_type, srate);
+                if (rb_need != 0) continue;
+            }
+            else if (DecodePacket(decode_type, samples-rb_fill, srate, packet_len))
             {
-                skipSamples=20;
+                //continue after the packet
+                pduStart = rb_start;
+                this->advance(rb_need);
                 return true;
             }
+            this->advance(1);
         }
         return false;
     }
 
+    void advance(const int n)
+    {
+        rb_start = (rb_start+n)%RB_SIZE;
+        rb_fill -= n;
+        rb_need = 0;
+    }
+
     Pothos::ObjectKwargs packetData;
+
+    //raw fields of the last decoded packet
+    //pduBytes holds the dewhitened PDU header and payload
+    int64_t pduSample; //index of the first sample, counted by samples
+    int pduStart; //ring index of the first sample, until the next feedOne()
+    int32_t pduThreshold;
+    uint32_t pduAddress;
+    uint32_t pduCRC;
+    size_t pduLength;
+    uint8_t pduBytes[BTLE_MAX_PDU_LENGTH];
 };
@@ -5,9 +5,14 @@
 #include <iostream>
 #include <complex>
 #include <cmath>
-#include <queue>
 #include <map>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
 #include "Brennenstuhl3600Codes.hpp"
+#include "OOKBurst.hpp"
+#include "OOKCommandQueue.hpp"
 
 /***********************************************************************
  * |PothosDoc Brennenstuhl 3600
@@ -15,6 +20,46 @@
  * Generate wireless remote control packets for the Brennenstuhl 3600.
  * This block outputs multiple wireless control packets in a burst
  * when a change to the on/off mode is made (or on activation).
+ * The "send" slot transmits the burst for the current mode and group again,
+ * and the "sendCommand(mode, group)" slot transmits a burst for any group,
+ * so that one block can drive several outlets.
+ *
+ * Commands are queued and transmitted in order, and a burst is never cut off
+ * by a newer command. Queued commands for the same group are coalesced into
+ * the latest one, and a command that changes the group of the burst on the air
+ * ends that burst early at the next packet boundary, after at least one packet.
+ * A command that repeats the burst on the air is dropped while that burst
+ * is still being sent, ex: a button that is pressed several times.
+ *
+ * <h2>Timed transmission</h2>
+ *
+ * A command can carry a target transmit time in nanoseconds, either explicitly
+ * with the "sendCommandAt(mode, group, timeNs)" slot, or as the time of the command
+ * plus the TX delay for the setters and the other slots.
+ * The first sample of a timed burst has a "txTime" label with the target time,
+ * which tells a timed SDR sink to transmit the burst at that hardware time.
+ *
+ * The txTime label must be in the time base of the SDR hardware, not of the host.
+ * The block tells the time with the system clock (ex: PC time) plus an offset,
+ * which the "setHardwareTime(timeNs)" slot sets from the current hardware time of the sink,
+ * ex: the time read back from the sink, or the time of an "rxTime" label of the same device.
+ * The times given to sendCommandAt() are always taken as hardware times.
+ * Until the hardware time is set, the bursts of delayed commands are not labeled,
+ * because a host time would be meaningless to the sink,
+ * but they are still delayed in the continuous stream.
+ *
+ * For sinks that stream continuously, enable the continuous stream:
+ * the block then outputs zeros between bursts, keeps a sample clock that starts
+ * at the time of activation, and starts each timed burst at the sample of its target time.
+ * Packets that are already late are skipped, so the remaining packets of the burst
+ * are still on time, and a burst that is entirely late is dropped.
+ * The sink's buffering adds a constant delay that the TX delay should cover.
+ * Clear the end label when the sink should not end its burst between commands.
+ *
+ * Each burst is rendered once per configuration and cached,
+ * so repeated commands are sent with a bulk copy of the cached samples.
+ * The chip timing is exact at any sample rate, so the block can run
+ * at the native rate of the transmitter without a resampler.
  *
  * |category /Control
  * |keywords brennenstuhl power control
@@ -36,6 +81,11 @@
  * |units Sps
  * |default 250e3
  *
+ * |param edgeShaping[Edge Shaping] Raised cosine on/off edges as a fraction of the chip period.
+ * Zero produces square edges, larger values reduce the occupied bandwidth.
+ * |default 0.0
+ * |preview valid
+ *
  * |param gain The level of the output samples.
  * |default 0.7
  *
@@ -52,34 +102,64 @@
  * |default "txEnd"
  * |preview valid
  *
+ * |param txDelay[TX Delay] Transmit each command this long after it was made, or 0 for as soon as possible.
+ * |units seconds
+ * |default 0.0
+ * |preview valid
+ *
+ * |param continuous[Continuous Stream] Output zeros between bursts and start timed bursts on time.
+ * |default false
+ * |option [On] true
+ * |option [Off] false
+ * |preview valid
+ *
  * |factory /btle/brennenstuhl_3600()
  * |setter setMode(mode)
  * |setter setGroup(group)
  * |setter setRate(rate)
+ * |setter setEdgeShaping(edgeShaping)
  * |setter setGain(gain)
  * |setter setRepeat(repeat)
  * |setter setStartLabel(startLabel)
  * |setter setEndLabel(endLabel)
+ * |setter setTxDelay(txDelay)
+ * |setter setContinuous(continuous)
  **********************************************************************/
 class Brennenstuhl3600 : public Pothos::Block
 {
 public:
     Brennenstuhl3600(void):
+        _burstOffset(0),
+        _burstEnd(0),
+        _burstStarted(false),
+        _streamIndex(0),
+        _streamStartNs(0),
+        _hardwareOffsetNs(0),
+        _hardwareTimeSet(false),
         _mode(false),
         _group("A"),
         _rate(1.0),
+        _edgeShaping(0.0),
         _gain(1.0),
-        _repeat(1)
+        _repeat(1),
+        _txDelayNs(0),
+        _continuous(false)
     {
         this->setupOutput(0, typeid(std::complex<float>));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setMode));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setGroup));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setRate));
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setEdgeShaping));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setGain));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setRepeat));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setStartLabel));
         this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setEndLabel));
-        loadCodes(_codeMap);
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, send));
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, sendCommand));
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, sendCommandAt));
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setTxDelay));
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setContinuous));
+        this->registerCall(this, POTHOS_FCN_TUPLE(Brennenstuhl3600, setHardwareTime));
     }
 
     static Block *make(void)
@@ -90,7 +170,7 @@ public:
     void setMode(const bool mode)
     {
         _mode = mode;
-        this->trigger();
+        this->enqueue(_mode, _group);
     }
 
     void setGroup(const std::string &group)
@@ -100,17 +180,66 @@ public:
 
     void setRate(const double rate)
     {
+        if (rate < CODE_RATE) throw Pothos::InvalidArgumentException(
+            "Brennenstuhl3600::setRate("+std::to_string(rate)+")", "rate below the chip rate");
         _rate = rate;
+        this->updateRenderer();
+    }
+
+    void setEdgeShaping(const double edgeShaping)
+    {
+        if (edgeShaping < 0.0 or edgeShaping > 1.0) throw Pothos::InvalidArgumentException(
+            "Brennenstuhl3600::setEdgeShaping("+std::to_string(edgeShaping)+")", "expected 0.0 to 1.0");
+        _edgeShaping = edgeShaping;
+        this->updateRenderer();
     }
 
     void setGain(const float gain)
     {
         _gain = gain;
+        _burstCache.clear();
     }
 
     void setRepeat(const size_t repeat)
     {
         _repeat = repeat;
+        _burstCache.clear();
+    }
+
+    void send(void)
+    {
+        this->enqueue(_mode, _group);
+    }
+
+    void sendCommand(const bool mode, const std::string &group)
+    {
+        this->enqueue(mode, group);
+    }
+
+    void sendCommandAt(const bool mode, const std::string &group, const long long timeNs)
+    {
+        this->enqueue(mode, group, timeNs, true);
+    }
+
+    void setTxDelay(const double delay)
+    {
+        if (delay < 0.0) throw Pothos::InvalidArgumentException(
+            "Brennenstuhl3600::setTxDelay("+std::to_string(delay)+")", "delay must be positive");
+        _txDelayNs = (long long)(std::llround(delay*1e9));
+    }
+
+    void setContinuous(const bool continuous)
+    {
+        _continuous = continuous;
+    }
+
+    //! The current time of the SDR hardware in nanoseconds, for the txTime labels
+    void setHardwareTime(const long long timeNs)
+    {
+        const long long offsetNs = timeNs - nowNs();
+        _streamStartNs += offsetNs - _hardwareOffsetNs;
+        _hardwareOffsetNs = offsetNs;
+        _hardwareTimeSet = true;
     }
 
     void setStartLabel(const std::string &label)
@@ -125,84 +254,266 @@ public:
 
     void activate(void)
     {
-        this->trigger();
+        _streamIndex = 0;
+        _streamStartNs = this->hardwareNs();
+        this->enqueue(_mode, _group);
     }
 
     void work(void)
     {
+        this->drainQueue();
+
         auto outPort = this->output(0);
-        size_t N = outPort->elements();
+        const size_t N = outPort->elements();
         if (N == 0) return;
-        if (_toTransmit.empty()) return;
-
-        if (_doStartBurst and not _startLabel.empty())
-        {
-            const size_t elemsInBurst = _toTransmit.size()*_sampsPerSym;
-            outPort->postLabel(Pothos::Label(_startLabel, elemsInBurst, 0));
-            _doStartBurst = false;
-        }
 
+        //bulk copy from the cached bursts, back to back
         auto out = outPort->buffer().as<std::complex<float> *>();
-        for (size_t i = 0; i < N; i++)
+        size_t produced = 0;
+        while (produced < N)
         {
-            //std::cout << "_sampsPerSym " << _sampsPerSym << std::endl;
-            //std::cout << "_samplesCount " << _samplesCount << std::endl;
-            //std::cout << "_toTransmit.size() " << _toTransmit.size() << std::endl;
-            //std::cout << "_toTransmit.front() " << _toTransmit.front() << std::endl;
-            out[i] = _toTransmit.front();
-            _samplesCount++;
-            if (_samplesCount == _sampsPerSym)
+            if (not _burst and not this->nextBurst())
             {
-                _toTransmit.pop();
-                _samplesCount = 0;
+                if (not _continuous) break;
+                std::fill_n(out+produced, N-produced, std::complex<float>(0.0f));
+                produced = N;
+                break;
             }
-            if (_toTransmit.empty())
+
+            //a timed burst in a continuous stream waits for its sample, or skips late packets
+            if (not _burstStarted and _continuous and _burstCommand.timeNs != 0)
             {
-                if (not _endLabel.empty())
-                    outPort->postLabel(Pothos::Label(_endLabel, Pothos::Object(), i));
-                N = i+1;
-                break;
+                const long long index = (long long)(_streamIndex + produced);
+                const long long target = this->timeToIndex(_burstCommand.timeNs) + (long long)(_burstOffset);
+                if (target > index)
+                {
+                    const size_t n = size_t(std::min<long long>(N-produced, target-index));
+                    std::fill_n(out+produced, n, std::complex<float>(0.0f));
+                    produced += n;
+                    continue;
+                }
+                if (target < index)
+                {
+                    this->skipPackets(_burstOffset + size_t(index-target));
+                    continue;
+                }
+            }
+
+            if (not _burstStarted)
+            {
+                _burstStarted = true;
+                if (_burstCommand.timeNs != 0 and _burstCommand.txTime)
+                {
+                    const long long offsetNs = std::llround(_burstOffset*1e9/_rate);
+                    outPort->postLabel(Pothos::Label("txTime", _burstCommand.timeNs + offsetNs, produced));
+                }
+                if (not _startLabel.empty())
+                {
+                    outPort->postLabel(Pothos::Label(_startLabel, _burstEnd-_burstOffset, produced));
+                }
+            }
+
+            const size_t n = std::min(N-produced, _burstEnd-_burstOffset);
+            std::copy_n(_burst->data()+_burstOffset, n, out+produced);
+            _burstOffset += n;
+            produced += n;
+
+            if (_burstOffset == _burstEnd)
+            {
+                if (not _endLabel.empty() and produced != 0)
+                    outPort->postLabel(Pothos::Label(_endLabel, Pothos::Object(), produced-1));
+                _burst.reset();
             }
         }
 
-        outPort->produce(N);
+        _streamIndex += produced;
+        if (produced != 0) outPort->produce(produced);
     }
 
 private:
 
-    void trigger(void)
+    struct Command
+    {
+        bool mode;
+        std::string group;
+        long long timeNs; //target transmit time or 0 for as soon as possible
+        bool txTime; //the time is a hardware time for the txTime label
+    };
+
+    static long long nowNs(void)
     {
-        _toTransmit = std::queue<float>(); //clear
-        _sampsPerSym = size_t(_rate/CODE_RATE);
-        _samplesCount = 0;
-        _doStartBurst = true;
-        const auto &code = _codeMap[_mode][_group];
-        for (size_t i = 0; i < _repeat; i++)
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    //the system clock in the time base of the hardware, once it is set
+    long long hardwareNs(void) const
+    {
+        return nowNs() + _hardwareOffsetNs;
+    }
+
+    //the stream sample index for a time in the continuous stream
+    long long timeToIndex(const long long timeNs) const
+    {
+        return std::llround((timeNs-_streamStartNs)*1e-9*_rate);
+    }
+
+    //queue a command made now, to be sent after the TX delay
+    void enqueue(const bool mode, const std::string &group)
+    {
+        const long long timeNs = (_txDelayNs == 0)?0:this->hardwareNs()+_txDelayNs;
+        this->enqueue(mode, group, timeNs, _hardwareTimeSet);
+    }
+
+    void enqueue(const bool mode, const std::string &group, const long long timeNs, const bool txTime)
+    {
+        if (not _queue.push(Command{mode, group, timeNs, txTime})) throw Pothos::RuntimeException(
+            "Brennenstuhl3600::sendCommand("+group+")", "command queue full");
+    }
+
+    //move queued commands to the pending list, coalesced by group
+    void drainQueue(void)
+    {
+        Command command;
+        while (_queue.pop(command))
         {
-            for (const auto &ch : code)
+            //a burst still waiting for its time is replaced and the new command keeps its place
+            if (_burst and not _burstStarted and command.group == _burstCommand.group)
             {
-                _toTransmit.push((ch=='0')?0.0:_gain);
+                _burst.reset();
+                _pending.insert(_pending.begin(), command);
+                continue;
+            }
+
+            //a repeat of the burst on the air replaces any queued change and sends the whole burst
+            if (this->repeatsBurst(command))
+            {
+                _pending.erase(std::remove_if(_pending.begin(), _pending.end(),
+                    [&command](const Command &c){return c.group == command.group;}), _pending.end());
+                _burstEnd = _burst->size();
+                continue;
+            }
+
+            auto it = std::find_if(_pending.begin(), _pending.end(),
+                [&command](const Command &c){return c.group == command.group;});
+            if (it == _pending.end()) _pending.push_back(command);
+            else *it = command;
+
+            //a new mode for the group on the air ends its burst at the next packet boundary,
+            //after the output so far, so that the end label goes on a sample still to come
+            if (_burst and command.group == _burstCommand.group and command.mode != _burstCommand.mode)
+            {
+                _burstEnd = std::min(_burstEnd, this->packetBoundary(_burstOffset+1));
             }
         }
     }
 
+    //is the command for the mode and group of the burst on the air, by the end of that burst?
+    bool repeatsBurst(const Command &command) const
+    {
+        if (not _burst or not _burstStarted) return false;
+        if (command.mode != _burstCommand.mode or command.group != _burstCommand.group) return false;
+        if (command.timeNs == 0) return true;
+
+        //an untimed burst started about when its samples so far were produced
+        const long long startNs = (_burstCommand.timeNs != 0)?_burstCommand.timeNs:
+            this->hardwareNs() - std::llround(_burstOffset*1e9/_rate);
+        return command.timeNs <= startNs + std::llround(_burst->size()*1e9/_rate);
+    }
+
+    //the first packet boundary of the current burst at or after the sample offset
+    size_t packetBoundary(const size_t offset) const
+    {
+        const size_t codeLength = lookupCode(_burstCommand.mode, _burstCommand.group).size();
+        size_t packets = 0;
+        while (_renderer.chipOffset(packets*codeLength) < offset) packets++;
+        return _renderer.chipOffset(packets*codeLength);
+    }
+
+    //skip the late packets of the current burst, drop the burst when all are late
+    void skipPackets(const size_t offset)
+    {
+        _burstOffset = this->packetBoundary(offset);
+        if (_burstOffset >= _burstEnd) _burst.reset();
+    }
+
+    //start the burst for the next pending command
+    bool nextBurst(void)
+    {
+        while (not _pending.empty())
+        {
+            const auto command = _pending.front();
+            _pending.erase(_pending.begin());
+
+            auto &burst = _burstCache[std::make_pair(command.mode, command.group)];
+            if (not burst) burst = _renderer.render(lookupCode(command.mode, command.group), _repeat, _gain);
+            if (burst->empty()) continue;
+
+            _burst = burst;
+            _burstOffset = 0;
+            _burstEnd = burst->size();
+            _burstStarted = false;
+            _burstCommand = command;
+            return true;
+        }
+        return false;
+    }
+
+    static const std::string &lookupCode(const bool mode, const std::string &group)
+    {
+        //the code tables are loaded once and shared by all instances
+        static const auto codeMap = []
+        {
+            std::map<bool, std::map<std::string, std::string>> codes;
+            loadCodes(codes);
+            return codes;
+        }();
+        static const std::string none;
+        const auto &groups = codeMap.at(mode);
+        const auto it = groups.find(group);
+        return (it == groups.end())?none:it->second;
+    }
+
+    void updateRenderer(void)
+    {
+        _renderer = OOKBurstRenderer(_rate, CODE_RATE, _edgeShaping);
+        _burstCache.clear();
+    }
+
     //current state
-    std::queue<float> _toTransmit;
-    size_t _sampsPerSym;
-    size_t _samplesCount;
-    bool _doStartBurst;
+    std::shared_ptr<const OOKBurst> _burst;
+    size_t _burstOffset;
+    size_t _burstEnd;
+    bool _burstStarted;
+    Command _burstCommand;
+
+    //the continuous stream sample clock
+    uint64_t _streamIndex;
+    long long _streamStartNs;
+
+    //the offset from the system clock to the hardware time
+    long long _hardwareOffsetNs;
+    bool _hardwareTimeSet;
+
+    //commands from the setters and slots, and the coalesced commands waiting for the air
+    OOKCommandQueue<Command> _queue;
+    std::vector<Command> _pending;
+
+    //rendered bursts for the current rate, shaping, gain, and repeat
+    OOKBurstRenderer _renderer;
+    std::map<std::pair<bool, std::string>, std::shared_ptr<const OOKBurst>> _burstCache;
 
     //config
     bool _mode;
     std::string _group;
     double _rate;
+    double _edgeShaping;
     float _gain;
     size_t _repeat;
     std::string _startLabel;
     std::string _endLabel;
-
-    //map enable to group to list of codes
-    std::map<bool, std::map<std::string, std::string>> _codeMap;
+    long long _txDelayNs;
+    bool _continuous;
 };
 
 static Pothos::BlockRegistry registerBrennenstuhl3600(
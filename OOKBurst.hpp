@@ -0,0 +1,96 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+
+//! A rendered on-off keyed burst of complex baseband samples
+typedef std::vector<std::complex<float>> OOKBurst;
+
+//! Chip strings use '0' for off and anything else for on
+inline bool ookChipOn(const std::string &chips, const size_t i)
+{
+    return chips[i] != '0';
+}
+
+/*!
+ * Render chip sequences into bursts: strings of '0' and '1' characters,
+ * or any sequence type with size() and an ookChipOn(chips, index) overload.
+ *
+ * The chip clock is a 32.32 fixed point phase accumulator,
+ * so any output rate is supported without truncating the samples per chip,
+ * and the chip boundaries stay within one sample of the ideal timing
+ * over the whole burst.
+ *
+ * Optional raised cosine edges soften the on/off transitions.
+ * The edge length is a fraction of the chip period, and the edge
+ * shape is computed once per configuration into a lookup table.
+ *
+ * Bursts are rendered once and shared, so sending one again costs only a copy.
+ */
+class OOKBurstRenderer
+{
+public:
+    /*!
+     * \param sampleRate the output sample rate in Sps
+     * \param chipRate the chip rate in chips per second
+     * \param edgeFraction the edge length over the chip period (0 for square edges, up to 1)
+     */
+    OOKBurstRenderer(const double sampleRate = 1.0, const double chipRate = 1.0, const double edgeFraction = 0.0):
+        _step(uint64_t(std::llround(std::ldexp(chipRate/sampleRate, 32))))
+    {
+        const size_t edgeLength = size_t(std::lround(edgeFraction*sampleRate/chipRate));
+        for (size_t i = 0; i < edgeLength; i++)
+        {
+            _edge.push_back(float(0.5 - 0.5*std::cos(M_PI*(i+0.5)/edgeLength)));
+        }
+    }
+
+    //! Render the chips repeated the given number of times
+    template <typename Chips>
+    std::shared_ptr<const OOKBurst> render(const Chips &chips, const size_t repeat, const float gain) const
+    {
+        auto burst = std::make_shared<OOKBurst>();
+        const uint64_t numChips = chips.size()*repeat;
+        if (numChips == 0 or _step == 0) return burst;
+        burst->reserve(size_t(std::ldexp(double(numChips), 32)/_step)+1);
+
+        uint64_t acc = 0;
+        uint64_t chip = 0;
+        float prev = 0.0f, level = 0.0f, out = 0.0f;
+        size_t sinceEdge = 0;
+        for (; (chip = acc >> 32) < numChips; acc += _step)
+        {
+            //level change at a chip boundary: start a new edge
+            const float next = ookChipOn(chips, size_t(chip % chips.size()))?gain:0.0f;
+            if (next != level)
+            {
+                prev = out; //an edge may start before the last one finished
+                level = next;
+                sinceEdge = 0;
+            }
+
+            out = level;
+            if (sinceEdge < _edge.size()) out = prev + (level - prev)*_edge[sinceEdge++];
+            burst->push_back(std::complex<float>(out));
+        }
+        return burst;
+    }
+
+    //! The index of the first sample of the given chip in a rendered burst
+    size_t chipOffset(const uint64_t chip) const
+    {
+        return size_t(((chip << 32) + _step - 1)/_step);
+    }
+
+private:
+    uint64_t _step; //chips per sample in 32.32 fixed point
+    std::vector<float> _edge; //rising edge shape from 0 to 1
+};
@@ -0,0 +1,250 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <complex>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/*!
+ * Moving average envelope of the sample magnitude,
+ * a running sum over a ring of the last N magnitudes.
+ */
+class OOKEnvelope
+{
+public:
+    OOKEnvelope(const size_t length = 1):
+        _ring(std::max<size_t>(length, 1), 0.0f),
+        _index(0),
+        _sum(0.0)
+    {
+        return;
+    }
+
+    float feed(const float magnitude)
+    {
+        _sum += magnitude - _ring[_index];
+        _ring[_index] = magnitude;
+        if (++_index == _ring.size()) _index = 0;
+        return float(_sum/_ring.size());
+    }
+
+private:
+    std::vector<float> _ring;
+    size_t _index;
+    double _sum;
+};
+
+/*!
+ * Slice an envelope into on/off with an adaptive threshold.
+ * The threshold sits between a peak tracker and a floor tracker,
+ * which jump to new extremes and relax towards each other.
+ */
+class OOKThresholdSlicer
+{
+public:
+    //! \param decay the relaxation per sample, about 1/(time constant in samples)
+    OOKThresholdSlicer(const float decay = 1e-5f):
+        _decay(decay),
+        _peak(0.0f),
+        _floor(0.0f),
+        _state(false)
+    {
+        return;
+    }
+
+    bool feed(const float env)
+    {
+        const float span = _peak - _floor;
+        _peak = (env > _peak)?env:_peak - span*_decay;
+        _floor = (env < _floor)?env:_floor + span*_decay;
+
+        //hysteresis of 10% of the span around the midpoint
+        const float mid = (_peak + _floor)/2;
+        const float hyst = (_peak - _floor)*0.1f;
+        if (_state and env < mid - hyst) _state = false;
+        if (not _state and env > mid + hyst) _state = true;
+        return _state;
+    }
+
+private:
+    float _decay;
+    float _peak;
+    float _floor;
+    bool _state;
+};
+
+/*!
+ * Learn OOK remote codes from a stream of sliced samples.
+ *
+ * The start of a frame is found by correlating the sliced samples
+ * with a sync chip pattern. The pattern is stored as runs, and the
+ * correlation is updated per sample from a ring of running one counts,
+ * so its cost is per run rather than per sample of the pattern.
+ * The chips are then sampled at their centers by a fixed point chip clock.
+ * A code is reported once it has been seen the confirm number of times
+ * in a row, which rejects frames corrupted by noise.
+ * Memory is bounded by the length of the sync pattern.
+ */
+class OOKLearner
+{
+public:
+    /*!
+     * \param sampleRate the input rate in Sps
+     * \param chipRate the chip rate of the remote
+     * \param sync the chips at the start of a frame, ex: "111000"
+     * \param frameLength the total chips in a frame, including the sync
+     * \param matchThreshold the fraction of sync samples that must match
+     * \param confirm the number of identical frames in a row to report a code
+     */
+    OOKLearner(const double sampleRate, const double chipRate, const std::string &sync,
+        const size_t frameLength, const double matchThreshold = 0.9, const size_t confirm = 2):
+        _sampsPerChip(sampleRate/chipRate),
+        _frameLength(std::max(frameLength, sync.size())),
+        _confirm(std::max<size_t>(confirm, 1)),
+        _count(0),
+        _state(SEARCH),
+        _bestMatch(0),
+        _bestIndex(0),
+        _frameStart(0),
+        _numChips(0),
+        _repeats(0)
+    {
+        //sync runs in samples, boundaries rounded from the ideal chip times
+        size_t begin = 0;
+        for (size_t i = 0; i < sync.size();)
+        {
+            size_t j = i;
+            while (j < sync.size() and sync[j] == sync[i]) j++;
+            const size_t end = size_t(std::lround(j*_sampsPerChip));
+            _runs.push_back(Run{begin, end, sync[i] != '0'});
+            begin = end;
+            i = j;
+        }
+        _syncLength = begin;
+        _minMatch = size_t(std::ceil(matchThreshold*_syncLength));
+
+        //hold the sync and the time taken to find the best match
+        _ring.resize(_syncLength + size_t(2*_sampsPerChip) + 2);
+    }
+
+    /*!
+     * Feed one sliced sample.
+     * \return true when a code was learned, see code()
+     */
+    bool feed(const bool on)
+    {
+        //ring of running one counts, ones in (a, b] = ones(b) - ones(a)
+        const uint64_t n = _count++;
+        _ring[n % _ring.size()] = ((n == 0)?0:_ring[(n-1) % _ring.size()]) + (on?1:0);
+        if (n < _ring.size()) return false;
+
+        switch (_state)
+        {
+        case SEARCH:
+        {
+            const size_t match = this->syncMatch(n);
+            if (match >= _minMatch and match > _bestMatch)
+            {
+                _bestMatch = match;
+                _bestIndex = n;
+            }
+
+            //lock on the best match once a chip has passed without a better one
+            if (_bestMatch != 0 and n > _bestIndex + uint64_t(_sampsPerChip))
+            {
+                _frameStart = _bestIndex + 1 - _syncLength;
+                _bestMatch = 0;
+                _numChips = 0;
+                _chips.clear();
+                _state = SLICE;
+            }
+            break;
+        }
+        case SLICE:
+        {
+            //slice every chip whose center has been received
+            while (_numChips < _frameLength)
+            {
+                const uint64_t center = _frameStart + uint64_t((_numChips+0.5)*_sampsPerChip);
+                if (center > n) break;
+                _chips.push_back(this->bitAt(center)?'1':'0');
+                _numChips++;
+            }
+            if (_numChips < _frameLength) break;
+            _state = SEARCH;
+
+            //report the code after enough identical frames
+            if (_chips == _lastChips) _repeats++;
+            else
+            {
+                _lastChips = _chips;
+                _repeats = 1;
+            }
+            if (_repeats == _confirm) return true;
+            break;
+        }
+        }
+        return false;
+    }
+
+    //! The last learned code as a '0'/'1' chip string
+    const std::string &code(void) const
+    {
+        return _lastChips;
+    }
+
+private:
+    enum State {SEARCH, SLICE};
+
+    struct Run
+    {
+        size_t begin, end; //sample offsets in the sync
+        bool on;
+    };
+
+    uint64_t onesThrough(const uint64_t n) const
+    {
+        return _ring[n % _ring.size()];
+    }
+
+    bool bitAt(const uint64_t n) const
+    {
+        return this->onesThrough(n) != this->onesThrough(n-1);
+    }
+
+    //number of samples that match the sync ending at sample n
+    size_t syncMatch(const uint64_t n) const
+    {
+        const uint64_t start = n+1-_syncLength;
+        size_t match = 0;
+        for (const auto &run : _runs)
+        {
+            const auto ones = this->onesThrough(start+run.end-1) - this->onesThrough(start+run.begin-1);
+            match += run.on?size_t(ones):(run.end-run.begin-size_t(ones));
+        }
+        return match;
+    }
+
+    const double _sampsPerChip;
+    const size_t _frameLength;
+    const size_t _confirm;
+    std::vector<Run> _runs;
+    size_t _syncLength;
+    size_t _minMatch;
+    std::vector<uint64_t> _ring;
+    uint64_t _count;
+
+    State _state;
+    size_t _bestMatch;
+    uint64_t _bestIndex;
+    uint64_t _frameStart;
+    size_t _numChips;
+    std::string _chips;
+    std::string _lastChips;
+    size_t _repeats;
+};
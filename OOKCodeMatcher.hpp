@@ -0,0 +1,248 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <bitset>
+#include "OOKProtocol.hpp"
+
+/*!
+ * Classify the pulses of a sliced OOK stream into chips.
+ *
+ * Each on or off run is measured in samples when it ends and
+ * rounded to a whole number of chips, so timing errors do not
+ * accumulate across runs. A run that exceeds the longest run
+ * of the codes by a 25% timing tolerance is flushed early and the stream
+ * is marked idle, which ends the last frame of a burst without waiting for more input.
+ */
+class OOKPulseClassifier
+{
+public:
+    /*!
+     * \param sampsPerChip the samples per chip at the input rate
+     * \param maxRunChips the longest run in chips before the stream is idle
+     */
+    OOKPulseClassifier(const double sampsPerChip = 1.0, const size_t maxRunChips = 64):
+        _sampsPerChip(sampsPerChip),
+        _idleChips(maxRunChips + maxRunChips/4 + 1),
+        _idleSamps(uint64_t(std::ceil(_idleChips*sampsPerChip))),
+        _index(0),
+        _runStart(0),
+        _level(false),
+        _idle(true)
+    {
+        return;
+    }
+
+    /*!
+     * Feed one sliced sample.
+     * The callback is called as onChip(bool chip, uint64_t endIndex)
+     * for every classified chip, where endIndex is the sample index
+     * at the end of the chip; onIdle() is called when the stream goes idle.
+     */
+    template <typename OnChip, typename OnIdle>
+    void feed(const bool on, OnChip &&onChip, OnIdle &&onIdle)
+    {
+        const uint64_t n = _index++;
+        if (on != _level)
+        {
+            if (not _idle) this->flush(n, onChip);
+            _level = on;
+            _runStart = n;
+            _idle = false;
+        }
+        else if (not _idle and n+1-_runStart >= _idleSamps)
+        {
+            this->flush(n+1, onChip);
+            _idle = true;
+            onIdle();
+        }
+    }
+
+    //! The number of samples fed
+    uint64_t index(void) const
+    {
+        return _index;
+    }
+
+private:
+    template <typename OnChip>
+    void flush(const uint64_t end, OnChip &&onChip)
+    {
+        //runs shorter than half a chip are glitches and produce no chips
+        const double length = double(end-_runStart);
+        const size_t numChips = std::min(size_t(std::lround(length/_sampsPerChip)), _idleChips);
+        for (size_t i = 0; i < numChips; i++)
+        {
+            onChip(_level, _runStart + uint64_t((i+1)*length/numChips));
+        }
+    }
+
+    double _sampsPerChip;
+    size_t _idleChips;
+    uint64_t _idleSamps;
+    uint64_t _index;
+    uint64_t _runStart;
+    bool _level;
+    bool _idle;
+};
+
+/*!
+ * Match a chip stream against a table of codes.
+ *
+ * The most recent chips are kept in a bit-packed shift register,
+ * newest chip in bit 0. Each code is packed the same way, aligned so
+ * that its last chip is the newest, so the Hamming distance to every code
+ * is computed 64 chips at a time with a xor, mask, and popcount.
+ */
+class OOKCodeMatcher
+{
+public:
+    OOKCodeMatcher(void):
+        _numWords(0),
+        _maxLength(0),
+        _numChips(0),
+        _maxErrors(0),
+        _maxRunChips(1)
+    {
+        return;
+    }
+
+    //! Add a code to the table, returns the index of the code
+    size_t addCode(const std::string &name, const OOKChips &chips)
+    {
+        Code code;
+        code.name = name;
+        code.length = chips.size();
+        _codes.push_back(code);
+        _maxLength = std::max(_maxLength, code.length);
+
+        //the longest run in the table
+        size_t run = 0;
+        for (size_t i = 0; i < chips.size(); i++)
+        {
+            run = (i != 0 and chips[i] == chips[i-1])?run+1:1;
+            _maxRunChips = std::max(_maxRunChips, run);
+        }
+
+        //repack every code to the new history width, chip i of a length L code is bit L-1-i
+        _numWords = (_maxLength+63)/64;
+        _history.assign(_numWords, 0);
+        _patterns.clear();
+        _masks.clear();
+        _chips.push_back(chips);
+        for (size_t c = 0; c < _codes.size(); c++)
+        {
+            const auto &codeChips = _chips[c];
+            const size_t L = codeChips.size();
+            for (size_t w = 0; w < _numWords; w++)
+            {
+                uint64_t pattern = 0, mask = 0;
+                for (size_t b = 0; b < 64 and w*64+b < L; b++)
+                {
+                    const size_t k = w*64+b;
+                    mask |= uint64_t(1) << b;
+                    if (codeChips[L-1-k]) pattern |= uint64_t(1) << b;
+                }
+                _patterns.push_back(pattern);
+                _masks.push_back(mask);
+            }
+        }
+        return _codes.size()-1;
+    }
+
+    //! The most chip errors for a match
+    void setMaxErrors(const size_t maxErrors)
+    {
+        _maxErrors = maxErrors;
+    }
+
+    size_t size(void) const
+    {
+        return _codes.size();
+    }
+
+    const std::string &name(const size_t index) const
+    {
+        return _codes.at(index).name;
+    }
+
+    //! The longest on or off run of any code in chips
+    size_t maxRunChips(void) const
+    {
+        return _maxRunChips;
+    }
+
+    //! Clear the chip history
+    void reset(void)
+    {
+        std::fill(_history.begin(), _history.end(), 0);
+        _numChips = 0;
+    }
+
+    /*!
+     * Push one chip and match the history against every code.
+     * The closest code within the error limit is a match;
+     * two codes at the same closest distance are ambiguous and do not match.
+     * \param [out] errors the chip errors of the match
+     * \return the index of the matching code or -1
+     */
+    int push(const bool chip, size_t &errors)
+    {
+        //shift the history by one chip
+        for (size_t w = _numWords; w-- > 1;)
+        {
+            _history[w] = (_history[w] << 1) | (_history[w-1] >> 63);
+        }
+        if (_numWords != 0) _history[0] = (_history[0] << 1) | (chip?1:0);
+        _numChips++;
+
+        int best = -1;
+        size_t bestErrors = _maxErrors+1;
+        bool tie = false;
+        for (size_t c = 0; c < _codes.size(); c++)
+        {
+            if (_numChips < _codes[c].length) continue;
+            const uint64_t *pattern = _patterns.data() + c*_numWords;
+            const uint64_t *mask = _masks.data() + c*_numWords;
+            size_t distance = 0;
+            for (size_t w = 0; w < _numWords and distance <= bestErrors; w++)
+            {
+                distance += std::bitset<64>((_history[w] ^ pattern[w]) & mask[w]).count();
+            }
+            if (distance < bestErrors)
+            {
+                best = int(c);
+                bestErrors = distance;
+                tie = false;
+            }
+            else if (distance == bestErrors) tie = true;
+        }
+        if (tie) return -1;
+        errors = bestErrors;
+        return best;
+    }
+
+private:
+    struct Code
+    {
+        std::string name;
+        size_t length;
+    };
+
+    std::vector<Code> _codes;
+    std::vector<OOKChips> _chips;
+    std::vector<uint64_t> _patterns;
+    std::vector<uint64_t> _masks;
+    std::vector<uint64_t> _history;
+    size_t _numWords;
+    size_t _maxLength;
+    uint64_t _numChips;
+    size_t _maxErrors;
+    size_t _maxRunChips;
+};
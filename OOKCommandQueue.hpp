@@ -0,0 +1,89 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <memory>
+
+/*!
+ * A bounded lock-free queue of commands for the transmitter blocks.
+ *
+ * Any thread may push (setters, slots, or a monitor's own thread),
+ * and the block's work() pops. Each cell has a sequence number which
+ * tells a producer that the cell is free and the consumer that it is full,
+ * so push and pop are a compare-and-swap on the position and never block.
+ * A push fails when the queue is full rather than overwrite a command.
+ */
+template <typename T>
+class OOKCommandQueue
+{
+public:
+    //! Make a queue, the capacity is rounded up to a power of two
+    OOKCommandQueue(const size_t capacity = 64):
+        _mask(1),
+        _pushPos(0),
+        _popPos(0)
+    {
+        while (_mask < capacity) _mask <<= 1;
+        _cells.reset(new Cell[_mask]);
+        for (size_t i = 0; i < _mask; i++) _cells[i].seq.store(i, std::memory_order_relaxed);
+        _mask -= 1;
+    }
+
+    //! Push a command, returns false when the queue is full
+    bool push(const T &value)
+    {
+        size_t pos = _pushPos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = _cells[pos & _mask];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (not _pushPos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) continue;
+                cell.value = value;
+                cell.seq.store(pos+1, std::memory_order_release);
+                return true;
+            }
+            if (diff < 0) return false;
+            pos = _pushPos.load(std::memory_order_relaxed);
+        }
+    }
+
+    //! Pop the oldest command, returns false when the queue is empty
+    bool pop(T &value)
+    {
+        size_t pos = _popPos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = _cells[pos & _mask];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos+1);
+            if (diff == 0)
+            {
+                if (not _popPos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) continue;
+                value = std::move(cell.value);
+                cell.seq.store(pos+_mask+1, std::memory_order_release);
+                return true;
+            }
+            if (diff < 0) return false;
+            pos = _popPos.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> _cells;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _pushPos;
+    alignas(64) std::atomic<size_t> _popPos;
+};
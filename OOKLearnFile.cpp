@@ -0,0 +1,194 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include "OOKChipSlicer.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+
+/***********************************************************************
+ * ook_learn_file - learn OOK remote codes from a capture file
+ *
+ * The capture is read in fixed size blocks and streamed through the
+ * same envelope, slicer, and sync correlator as the OOK Learner block,
+ * so memory use does not depend on the size of the capture.
+ * Learned codes are printed as a protocol section for the OOK Transmitter
+ * profile file, one command per distinct code.
+ **********************************************************************/
+
+enum SampleFormat
+{
+    FORMAT_CF32, //complex float32
+    FORMAT_CI16, //complex int16
+    FORMAT_CI8, //complex int8
+    FORMAT_CU8, //complex uint8 (rtl_sdr)
+    FORMAT_UNKNOWN,
+};
+
+static size_t formatSize(const SampleFormat format)
+{
+    switch (format)
+    {
+    case FORMAT_CF32: return 8;
+    case FORMAT_CI16: return 4;
+    case FORMAT_CI8: return 2;
+    case FORMAT_CU8: return 2;
+    default: return 0;
+    }
+}
+
+static SampleFormat formatFromString(const std::string &name)
+{
+    if (name == "cf32" or name == "fc32" or name == "cfile") return FORMAT_CF32;
+    if (name == "ci16" or name == "cs16" or name == "sc16") return FORMAT_CI16;
+    if (name == "ci8" or name == "cs8" or name == "sc8") return FORMAT_CI8;
+    if (name == "cu8") return FORMAT_CU8;
+    return FORMAT_UNKNOWN;
+}
+
+//magnitude of sample i in a block of raw bytes, the scale does not matter
+static float magnitudeAt(const SampleFormat format, const uint8_t *data, const size_t i)
+{
+    switch (format)
+    {
+    case FORMAT_CF32:
+    {
+        float iq[2];
+        std::memcpy(iq, data+8*i, sizeof(iq));
+        return std::abs(std::complex<float>(iq[0], iq[1]));
+    }
+    case FORMAT_CI16:
+    {
+        int16_t iq[2];
+        std::memcpy(iq, data+4*i, sizeof(iq));
+        return std::abs(std::complex<float>(iq[0], iq[1]));
+    }
+    case FORMAT_CI8: return std::abs(std::complex<float>(int8_t(data[2*i]), int8_t(data[2*i+1])));
+    case FORMAT_CU8: return std::abs(std::complex<float>(data[2*i]-127.5f, data[2*i+1]-127.5f));
+    default: return 0.0f;
+    }
+}
+
+static void printUsage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [options] <capture file>" << std::endl
+        << "  --format=FMT     sample format: cf32, ci16, ci8, cu8 (default from file extension)" << std::endl
+        << "  --rate=SPS       sample rate (default 250e3)" << std::endl
+        << "  --chip-rate=CPS  chip rate of the remote (default 5e3)" << std::endl
+        << "  --sync=CHIPS     chips at the start of a frame (default Brennenstuhl 3600)" << std::endl
+        << "  --length=N       chips per frame including the sync (default 235)" << std::endl
+        << "  --envelope=SEC   envelope moving average length (default 80e-6)" << std::endl
+        << "  --threshold=F    fraction of sync samples that must match (default 0.9)" << std::endl
+        << "  --confirm=N      identical frames in a row to report a code (default 2)" << std::endl
+        << "  --name=NAME      protocol section name (default learned)" << std::endl;
+}
+
+static bool parseOption(const std::string &arg, const std::string &name, std::string &value)
+{
+    const std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    SampleFormat format = FORMAT_UNKNOWN;
+    double rate = 250e3;
+    double chipRate = 5e3;
+    std::string sync = std::string(15, '1') + std::string(35, '0');
+    size_t length = 235;
+    double envelopeTime = 80e-6;
+    double threshold = 0.9;
+    size_t confirm = 2;
+    std::string name = "learned";
+    std::string inPath;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+        std::string value;
+        if (parseOption(arg, "format", value)) format = formatFromString(value);
+        else if (parseOption(arg, "rate", value)) rate = std::stod(value);
+        else if (parseOption(arg, "chip-rate", value)) chipRate = std::stod(value);
+        else if (parseOption(arg, "sync", value)) sync = value;
+        else if (parseOption(arg, "length", value)) length = std::stoul(value);
+        else if (parseOption(arg, "envelope", value)) envelopeTime = std::stod(value);
+        else if (parseOption(arg, "threshold", value)) threshold = std::stod(value);
+        else if (parseOption(arg, "confirm", value)) confirm = std::stoul(value);
+        else if (parseOption(arg, "name", value)) name = value;
+        else if (arg == "--help" or arg == "-h") {printUsage(argv[0]); return EXIT_SUCCESS;}
+        else if (not arg.empty() and arg[0] != '-' and inPath.empty()) inPath = arg;
+        else {printUsage(argv[0]); return EXIT_FAILURE;}
+    }
+
+    if (inPath.empty()) {printUsage(argv[0]); return EXIT_FAILURE;}
+    if (format == FORMAT_UNKNOWN)
+    {
+        const auto dot = inPath.find_last_of('.');
+        if (dot != std::string::npos) format = formatFromString(inPath.substr(dot+1));
+    }
+    if (format == FORMAT_UNKNOWN)
+    {
+        std::cerr << "Unknown sample format, specify --format" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (rate < 2*chipRate or sync.empty() or sync.find_first_not_of("01") != std::string::npos)
+    {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = std::fopen(inPath.c_str(), "rb");
+    if (fp == nullptr)
+    {
+        std::cerr << "Cannot open " << inPath << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    OOKEnvelope envelope(size_t(std::lround(envelopeTime*rate)));
+    OOKThresholdSlicer slicer(float(chipRate/rate/1000));
+    OOKLearner learner(rate, chipRate, sync, length, threshold, confirm);
+
+    //stream the capture in fixed size blocks
+    const size_t elemSize = formatSize(format);
+    std::vector<uint8_t> block(elemSize << 16);
+    std::vector<std::string> codes;
+    uint64_t numSamples = 0;
+    size_t numFrames = 0;
+    size_t n;
+    while ((n = std::fread(block.data(), elemSize, block.size()/elemSize, fp)) != 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (not learner.feed(slicer.feed(envelope.feed(magnitudeAt(format, block.data(), i))))) continue;
+            numFrames++;
+            if (std::find(codes.begin(), codes.end(), learner.code()) == codes.end()) codes.push_back(learner.code());
+        }
+        numSamples += n;
+    }
+    std::fclose(fp);
+
+    //print a profile section for the OOK Transmitter
+    std::cout << "[" << name << "]" << std::endl;
+    std::cout << "unit = " << (1e6/chipRate) << "us" << std::endl;
+    std::cout << "symbol 1 = 1" << std::endl;
+    std::cout << "symbol 0 = 0 1" << std::endl;
+    std::cout << "frame = {command}" << std::endl;
+    for (size_t i = 0; i < codes.size(); i++)
+    {
+        std::cout << "command learned_" << (i+1) << " = " << codes[i] << std::endl;
+    }
+
+    std::cerr << "Read " << numSamples << " samples (" << (numSamples/rate) << " s), "
+        << numFrames << " confirmed frames, " << codes.size() << " distinct codes" << std::endl;
+    return EXIT_SUCCESS;
+}
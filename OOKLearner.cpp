@@ -0,0 +1,160 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <complex>
+#include <memory>
+#include "OOKChipSlicer.hpp"
+
+/***********************************************************************
+ * |PothosDoc OOK Learner
+ *
+ * Learn on-off keyed remote control codes from live or recorded samples.
+ * The block computes the envelope with a running sum, slices it with
+ * an adaptive threshold, correlates the sync pattern incrementally,
+ * and samples the chips of each frame, all in constant memory.
+ *
+ * A code is reported once it has been received the confirm number
+ * of times in a row. Each learned code is posted on output port 0
+ * as a command line for the OOK Transmitter profile file, ex:
+ * "command learned_1 = 1111...", and the chips are emitted from the "code" signal.
+ *
+ * The defaults match the Brennenstuhl 3600 remote at 433.92 MHz.
+ *
+ * |category /Control
+ * |keywords ook remote learn capture brennenstuhl
+ *
+ * |param sampleRate[Sample Rate] The sample rate of the input stream.
+ * |units Sps
+ * |default 250e3
+ *
+ * |param chipRate[Chip Rate] The chip rate of the remote, one over the time unit.
+ * |units chips/s
+ * |default 5e3
+ *
+ * |param sync[Sync] The chips at the start of each frame.
+ * |widget StringEntry()
+ * |default "11111111111111100000000000000000000000000000000000"
+ *
+ * |param frameLength[Frame Length] The total number of chips in a frame, including the sync.
+ * |default 235
+ *
+ * |param envelopeTime[Envelope Time] The length of the envelope moving average.
+ * |units seconds
+ * |default 80e-6
+ * |preview valid
+ *
+ * |param matchThreshold[Match Threshold] The fraction of the sync samples that must match.
+ * |default 0.9
+ * |preview valid
+ *
+ * |param confirm[Confirm] The number of identical frames in a row to report a code.
+ * |default 2
+ * |preview valid
+ *
+ * |factory /btle/ook_learner(sampleRate, chipRate, sync, frameLength)
+ * |initializer setEnvelopeTime(envelopeTime)
+ * |initializer setMatchThreshold(matchThreshold)
+ * |initializer setConfirm(confirm)
+ **********************************************************************/
+class OOKLearnerBlock : public Pothos::Block
+{
+public:
+    OOKLearnerBlock(const double sampleRate, const double chipRate, const std::string &sync, const size_t frameLength):
+        _sampleRate(sampleRate),
+        _chipRate(chipRate),
+        _sync(sync),
+        _frameLength(frameLength),
+        _envelopeTime(80e-6),
+        _matchThreshold(0.9),
+        _confirm(2),
+        _numLearned(0)
+    {
+        if (sampleRate < 2*chipRate) throw Pothos::InvalidArgumentException(
+            "OOKLearner("+std::to_string(sampleRate)+")", "sample rate below twice the chip rate");
+        if (sync.find_first_not_of("01") != std::string::npos or sync.empty()) throw Pothos::InvalidArgumentException(
+            "OOKLearner("+sync+")", "sync must be '0' and '1' chips");
+        this->setupInput(0);
+        this->setupOutput(0);
+        this->registerSignal("code");
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKLearnerBlock, setEnvelopeTime));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKLearnerBlock, setMatchThreshold));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKLearnerBlock, setConfirm));
+    }
+
+    static Block *make(const double sampleRate, const double chipRate, const std::string &sync, const size_t frameLength)
+    {
+        return new OOKLearnerBlock(sampleRate, chipRate, sync, frameLength);
+    }
+
+    void setEnvelopeTime(const double time)
+    {
+        _envelopeTime = time;
+    }
+
+    void setMatchThreshold(const double threshold)
+    {
+        _matchThreshold = threshold;
+    }
+
+    void setConfirm(const size_t confirm)
+    {
+        _confirm = confirm;
+    }
+
+    void activate(void)
+    {
+        _envelope.reset(new OOKEnvelope(size_t(std::lround(_envelopeTime*_sampleRate))));
+        _slicer.reset(new OOKThresholdSlicer(float(_chipRate/_sampleRate/1000)));
+        _learner.reset(new OOKLearner(_sampleRate, _chipRate, _sync, _frameLength, _matchThreshold, _confirm));
+    }
+
+    void work(void)
+    {
+        auto inPort = this->input(0);
+        auto inBuff = inPort->buffer();
+        const size_t N = inBuff.elements();
+        if (N == 0) return;
+
+        //complex samples use the magnitude, real samples are taken as the magnitude
+        if (inBuff.dtype.isComplex())
+        {
+            auto cf32Buff = inBuff.convert(typeid(std::complex<float>));
+            auto in = cf32Buff.as<const std::complex<float> *>();
+            for (size_t i = 0; i < N; i++) this->feed(std::abs(in[i]));
+        }
+        else
+        {
+            auto float32Buff = inBuff.convert(typeid(float));
+            auto in = float32Buff.as<const float *>();
+            for (size_t i = 0; i < N; i++) this->feed(std::abs(in[i]));
+        }
+
+        inPort->consume(N);
+    }
+
+private:
+    void feed(const float magnitude)
+    {
+        if (not _learner->feed(_slicer->feed(_envelope->feed(magnitude)))) return;
+        const auto &code = _learner->code();
+        this->output(0)->postMessage("command learned_" + std::to_string(++_numLearned) + " = " + code);
+        this->callVoid("code", code);
+    }
+
+    const double _sampleRate;
+    const double _chipRate;
+    const std::string _sync;
+    const size_t _frameLength;
+    double _envelopeTime;
+    double _matchThreshold;
+    size_t _confirm;
+
+    std::unique_ptr<OOKEnvelope> _envelope;
+    std::unique_ptr<OOKThresholdSlicer> _slicer;
+    std::unique_ptr<OOKLearner> _learner;
+    size_t _numLearned;
+};
+
+static Pothos::BlockRegistry registerOOKLearner(
+    "/btle/ook_learner", &OOKLearnerBlock::make);
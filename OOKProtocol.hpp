@@ -0,0 +1,305 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <charconv>
+#include <stdexcept>
+
+/*!
+ * A bit-packed sequence of on/off chips at the protocol time unit.
+ */
+struct OOKChips
+{
+    OOKChips(void):
+        length(0)
+    {
+        return;
+    }
+
+    size_t size(void) const
+    {
+        return length;
+    }
+
+    bool operator[](const size_t i) const
+    {
+        return ((words[i/64] >> (i%64)) & 1) != 0;
+    }
+
+    //! Append count chips of the same level
+    void append(const bool on, size_t count)
+    {
+        for (; count != 0; count--, length++)
+        {
+            if (length%64 == 0) words.push_back(0);
+            if (on) words.back() |= uint64_t(1) << (length%64);
+        }
+    }
+
+    void append(const OOKChips &other)
+    {
+        for (size_t i = 0; i < other.size(); i++) this->append(other[i], 1);
+    }
+
+    //! The chips as '0' and '1' characters
+    std::string toString(void) const
+    {
+        std::string s(length, '0');
+        for (size_t i = 0; i < length; i++) if ((*this)[i]) s[i] = '1';
+        return s;
+    }
+
+    std::vector<uint64_t> words;
+    size_t length;
+};
+
+inline bool ookChipOn(const OOKChips &chips, const size_t i)
+{
+    return chips[i];
+}
+
+/*!
+ * An on-off keyed remote control protocol loaded from a profile file.
+ *
+ * Every timing is a whole number of the protocol time unit,
+ * so each frame compiles into a bit-packed chip sequence at one chip
+ * per time unit, which the burst renderer plays at the output rate.
+ *
+ * Profile file syntax, one protocol per section:
+ *
+ *     [pt2262]
+ *     unit = 350us              # time unit (us, ms, or s)
+ *     symbol 0 = 1 3 1 3        # on/off durations in units, starting with on
+ *     symbol 1 = 3 1 3 1
+ *     symbol F = 1 3 3 1
+ *     preamble = 1 31           # optional durations before each frame
+ *     trailer = 1 31            # optional durations after each frame
+ *     gap = 0                   # optional off units between frames
+ *     repeat = 10               # frames per burst
+ *     address_width = 5         # symbols in the {address} field
+ *     frame = {address}{command}
+ *     command A_on = 0FFFF0F
+ *
+ * The frame is a template of symbols and the {address} and {command} fields.
+ * The address is given as symbols (ex: "0FF0F"), or as a number that is
+ * written in binary with the 0 and 1 symbols, most significant bit first.
+ */
+class OOKProtocol
+{
+public:
+    OOKProtocol(void):
+        unitSeconds(0.0),
+        repeat(1),
+        gap(0),
+        addressWidth(0),
+        frame("{command}")
+    {
+        return;
+    }
+
+    //! Compile every command with the given address
+    std::map<std::string, OOKChips> compile(const std::string &address) const
+    {
+        const auto addressSymbols = this->addressToSymbols(address);
+        std::map<std::string, OOKChips> codes;
+        for (const auto &pair : commands)
+        {
+            codes[pair.first] = this->compileFrame(addressSymbols, pair.first, pair.second);
+        }
+        return codes;
+    }
+
+    //! Does the frame have an {address} field?
+    bool hasAddress(void) const
+    {
+        return frame.find("{address}") != std::string::npos;
+    }
+
+    //! The chip rate of the compiled codes
+    double chipRate(void) const
+    {
+        return 1.0/unitSeconds;
+    }
+
+    std::string name;
+    double unitSeconds;
+    size_t repeat;
+    size_t gap;
+    size_t addressWidth;
+    std::string frame;
+    std::vector<size_t> preamble;
+    std::vector<size_t> trailer;
+    std::map<char, OOKChips> symbols;
+    std::map<std::string, std::string> commands;
+
+    /*!
+     * Load all protocols from a profile file.
+     * Throws std::runtime_error on a file or syntax error.
+     */
+    static std::map<std::string, OOKProtocol> load(const std::string &path)
+    {
+        std::ifstream file(path);
+        if (not file) throw std::runtime_error("cannot open OOK profile: " + path);
+        std::map<std::string, OOKProtocol> protocols;
+        OOKProtocol *current = nullptr;
+        std::string line;
+        for (size_t lineNo = 1; std::getline(file, line); lineNo++)
+        {
+            const auto where = path + ":" + std::to_string(lineNo) + ": ";
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty()) continue;
+
+            if (line.front() == '[' and line.back() == ']')
+            {
+                const auto name = trim(line.substr(1, line.size()-2));
+                current = &protocols[name];
+                current->name = name;
+                continue;
+            }
+
+            const auto eq = line.find('=');
+            if (current == nullptr or eq == std::string::npos) throw std::runtime_error(where + "expected [protocol] or key = value");
+            const auto key = trim(line.substr(0, eq));
+            const auto value = trim(line.substr(eq+1));
+            try
+            {
+                current->setKey(key, value);
+            }
+            catch (const std::invalid_argument &ex)
+            {
+                throw std::runtime_error(where + ex.what());
+            }
+        }
+
+        for (const auto &pair : protocols)
+        {
+            if (pair.second.unitSeconds <= 0.0) throw std::runtime_error(
+                path + ": protocol " + pair.first + " has no unit");
+        }
+        return protocols;
+    }
+
+private:
+    void setKey(const std::string &key, const std::string &value)
+    {
+        if (key == "unit") unitSeconds = parseTime(value);
+        else if (key == "repeat") repeat = parseNumber(value);
+        else if (key == "gap") gap = parseNumber(value);
+        else if (key == "address_width") addressWidth = parseNumber(value);
+        else if (key == "frame") frame = value;
+        else if (key == "preamble") preamble = parseDurations(value);
+        else if (key == "trailer") trailer = parseDurations(value);
+        else if (key.compare(0, 7, "symbol ") == 0)
+        {
+            const auto ch = trim(key.substr(7));
+            if (ch.size() != 1 or ch[0] == '{') throw std::invalid_argument("symbol names are one character");
+            symbols[ch[0]] = durationsToChips(parseDurations(value));
+        }
+        else if (key.compare(0, 8, "command ") == 0) commands[trim(key.substr(8))] = value;
+        else throw std::invalid_argument("unknown key " + key);
+    }
+
+    OOKChips compileFrame(const std::string &address, const std::string &name, const std::string &command) const
+    {
+        OOKChips chips = durationsToChips(preamble);
+        for (size_t i = 0; i < frame.size(); i++)
+        {
+            std::string symbolStr;
+            if (frame.compare(i, 9, "{address}") == 0) {symbolStr = address; i += 8;}
+            else if (frame.compare(i, 9, "{command}") == 0) {symbolStr = command; i += 8;}
+            else if (std::isspace(frame[i])) continue;
+            else symbolStr = frame.substr(i, 1);
+
+            for (const auto ch : symbolStr)
+            {
+                const auto it = symbols.find(ch);
+                if (it == symbols.end()) throw std::invalid_argument(
+                    "protocol " + this->name + " command " + name + ": unknown symbol '" + ch + "'");
+                chips.append(it->second);
+            }
+        }
+        chips.append(durationsToChips(trailer));
+        chips.append(false, gap);
+        return chips;
+    }
+
+    std::string addressToSymbols(const std::string &address) const
+    {
+        if (not this->hasAddress()) return "";
+
+        //already symbols of the address width
+        bool allSymbols = address.size() == addressWidth;
+        for (const auto ch : address) allSymbols = allSymbols and symbols.count(ch) != 0;
+        if (allSymbols) return address;
+
+        //a number in binary, most significant bit first
+        unsigned long long value = 0;
+        const bool hex = address.compare(0, 2, "0x") == 0;
+        const auto begin = address.data() + (hex?2:0);
+        const auto end = address.data() + address.size();
+        const auto result = std::from_chars(begin, end, value, hex?16:10);
+        if (address.empty() or result.ec != std::errc() or result.ptr != end or
+            addressWidth > 64 or (addressWidth < 64 and (value >> addressWidth) != 0))
+        {
+            throw std::invalid_argument("protocol " + name + ": bad address " + address);
+        }
+        std::string bits(addressWidth, '0');
+        for (size_t i = 0; i < addressWidth; i++)
+        {
+            if ((value >> (addressWidth-1-i)) & 1) bits[i] = '1';
+        }
+        return bits;
+    }
+
+    static OOKChips durationsToChips(const std::vector<size_t> &durations)
+    {
+        OOKChips chips;
+        for (size_t i = 0; i < durations.size(); i++) chips.append(i%2 == 0, durations[i]);
+        return chips;
+    }
+
+    static std::string trim(const std::string &s)
+    {
+        const auto begin = s.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) return "";
+        return s.substr(begin, s.find_last_not_of(" \t\r")-begin+1);
+    }
+
+    static size_t parseNumber(const std::string &s)
+    {
+        size_t value = 0;
+        const auto result = std::from_chars(s.data(), s.data()+s.size(), value);
+        if (s.empty() or result.ec != std::errc() or result.ptr != s.data()+s.size())
+            throw std::invalid_argument("bad number '" + s + "'");
+        return value;
+    }
+
+    static std::vector<size_t> parseDurations(const std::string &s)
+    {
+        std::vector<size_t> durations;
+        std::istringstream iss(s);
+        std::string token;
+        while (iss >> token) durations.push_back(parseNumber(token));
+        return durations;
+    }
+
+    static double parseTime(const std::string &s)
+    {
+        double value = 0.0;
+        const auto result = std::from_chars(s.data(), s.data()+s.size(), value);
+        if (result.ec != std::errc()) throw std::invalid_argument("bad time '" + s + "'");
+        const std::string unit = trim(std::string(result.ptr, s.data()+s.size()));
+        if (unit == "us") return value*1e-6;
+        if (unit == "ms") return value*1e-3;
+        if (unit == "s" or unit.empty()) return value;
+        throw std::invalid_argument("bad time unit '" + unit + "'");
+    }
+};
@@ -0,0 +1,312 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <complex>
+#include <map>
+#include <memory>
+#include "Brennenstuhl3600Codes.hpp"
+#include "OOKChipSlicer.hpp"
+#include "OOKCodeMatcher.hpp"
+
+/***********************************************************************
+ * |PothosDoc OOK Receiver
+ *
+ * Receive on-off keyed remote control commands, to verify over the air
+ * that a command was transmitted, or to monitor other remotes on the band.
+ *
+ * The envelope of the input is sliced with an adaptive threshold,
+ * each on and off pulse is classified into a whole number of chips,
+ * and the chip stream is matched against the known code tables
+ * by bit-packed Hamming distance after every chip.
+ * The codes are the built-in Brennenstuhl 3600 codes when the profile is empty,
+ * or the commands of a protocol in an OOK Transmitter profile file.
+ * The profile, protocol, and address are checked together on activation,
+ * so they can be changed in any order.
+ *
+ * <h2>Output format</h2>
+ *
+ * Each received burst results in one dictionary message of type Pothos::ObjectKwargs
+ * on output port 0, posted when the first frame of the burst is matched:
+ * "command" (the command name, ex: "on_A"), "errors" (chip errors in the frame),
+ * and "index" (the input sample index at the end of the frame).
+ * The Brennenstuhl 3600 codes also report "mode" (true for on) and "group".
+ * When the input carries "rxTime" labels (nanoseconds), such as from an SDR source,
+ * the message has an "rxTime" key with the time at the end of the frame,
+ * which measures the latency from command to air.
+ * The "command" signal emits the command name.
+ *
+ * |category /Decode
+ * |keywords ook remote brennenstuhl pt2262 ev1527 433
+ *
+ * |param sampleRate[Sample Rate] The sample rate of the input stream.
+ * |units Sps
+ * |default 250e3
+ *
+ * |param profile[Profile] The path of an OOK protocol profile file,
+ * or empty for the built-in Brennenstuhl 3600 codes.
+ * |widget FileEntry(mode=open)
+ * |default ""
+ * |preview valid
+ *
+ * |param protocol[Protocol] The name of a protocol in the profile file.
+ * |widget StringEntry()
+ * |default "brennenstuhl_3600"
+ * |preview valid
+ *
+ * |param address[Address] The device address for protocols with an address field.
+ * |widget StringEntry()
+ * |default ""
+ * |preview valid
+ *
+ * |param maxErrors[Max Errors] The most chip errors in a matching frame.
+ * |default 4
+ * |preview valid
+ *
+ * |param envelopeTime[Envelope Time] The length of the envelope moving average.
+ * |units seconds
+ * |default 40e-6
+ * |preview valid
+ *
+ * |factory /btle/ook_receiver(sampleRate)
+ * |setter setProfile(profile)
+ * |setter setProtocol(protocol)
+ * |setter setAddress(address)
+ * |setter setMaxErrors(maxErrors)
+ * |setter setEnvelopeTime(envelopeTime)
+ **********************************************************************/
+class OOKReceiver : public Pothos::Block
+{
+public:
+    OOKReceiver(const double sampleRate):
+        _sampleRate(sampleRate),
+        _maxErrors(0),
+        _envelopeTime(40e-6),
+        _chipRate(CODE_RATE),
+        _lastMatch(-1),
+        _timeIndex(0),
+        _timeNs(0),
+        _haveTime(false)
+    {
+        this->setupInput(0);
+        this->setupOutput(0);
+        this->registerSignal("command");
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKReceiver, setProfile));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKReceiver, setProtocol));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKReceiver, setAddress));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKReceiver, setMaxErrors));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKReceiver, setEnvelopeTime));
+        this->compile();
+    }
+
+    static Block *make(const double sampleRate)
+    {
+        return new OOKReceiver(sampleRate);
+    }
+
+    void setProfile(const std::string &path)
+    {
+        try
+        {
+            _protocols = path.empty()?std::map<std::string, OOKProtocol>():OOKProtocol::load(path);
+        }
+        catch (const std::runtime_error &ex)
+        {
+            throw Pothos::InvalidArgumentException("OOKReceiver::setProfile("+path+")", ex.what());
+        }
+        this->compile();
+    }
+
+    void setProtocol(const std::string &protocol)
+    {
+        _protocolName = protocol;
+        this->compile();
+    }
+
+    void setAddress(const std::string &address)
+    {
+        _address = address;
+        this->compile();
+    }
+
+    void setMaxErrors(const size_t maxErrors)
+    {
+        _maxErrors = maxErrors;
+        _matcher.setMaxErrors(maxErrors);
+    }
+
+    void setEnvelopeTime(const double time)
+    {
+        _envelopeTime = time;
+    }
+
+    void activate(void)
+    {
+        if (not _compileError.empty()) throw Pothos::InvalidArgumentException(
+            "OOKReceiver::activate()", _compileError);
+        _envelope = OOKEnvelope(size_t(std::lround(_envelopeTime*_sampleRate)));
+        _slicer = OOKThresholdSlicer(float(_chipRate/_sampleRate/1000));
+        _classifier = OOKPulseClassifier(_sampleRate/_chipRate, _matcher.maxRunChips());
+        _matcher.reset();
+        _lastMatch = -1;
+        _haveTime = false;
+    }
+
+    void work(void)
+    {
+        auto inPort = this->input(0);
+        auto inBuff = inPort->buffer();
+        const size_t N = inBuff.elements();
+        if (N == 0) return;
+
+        //keep the last rxTime label in this buffer as the time reference, the frame times count from it
+        for (const auto &label : inPort->labels())
+        {
+            if (label.index >= N) break;
+            if (label.id != "rxTime") continue;
+            _timeIndex = _classifier.index() + label.index;
+            _timeNs = label.data.convert<long long>();
+            _haveTime = true;
+        }
+
+        //complex samples use the magnitude, real samples are taken as the magnitude
+        if (inBuff.dtype.isComplex())
+        {
+            auto cf32Buff = inBuff.convert(typeid(std::complex<float>));
+            auto in = cf32Buff.as<const std::complex<float> *>();
+            for (size_t i = 0; i < N; i++) this->feed(std::abs(in[i]));
+        }
+        else
+        {
+            auto float32Buff = inBuff.convert(typeid(float));
+            auto in = float32Buff.as<const float *>();
+            for (size_t i = 0; i < N; i++) this->feed(std::abs(in[i]));
+        }
+
+        inPort->consume(N);
+    }
+
+private:
+    void feed(const float magnitude)
+    {
+        const bool on = _slicer.feed(_envelope.feed(magnitude));
+        _classifier.feed(on,
+            [this](const bool chip, const uint64_t endIndex)
+            {
+                size_t errors = 0;
+                const int match = _matcher.push(chip, errors);
+                if (match < 0) return;
+                if (match != _lastMatch) this->report(size_t(match), errors, endIndex);
+                _lastMatch = match;
+            },
+            [this](void)
+            {
+                //the end of a burst, the next match is reported again
+                _lastMatch = -1;
+            });
+    }
+
+    void report(const size_t match, const size_t errors, const uint64_t endIndex)
+    {
+        const auto &name = _matcher.name(match);
+        Pothos::ObjectKwargs msg;
+        msg["command"] = Pothos::Object(name);
+        msg["errors"] = Pothos::Object(errors);
+        msg["index"] = Pothos::Object((unsigned long long)(endIndex));
+        if (_protocols.empty())
+        {
+            msg["mode"] = Pothos::Object(name.compare(0, 3, "on_") == 0);
+            msg["group"] = Pothos::Object(name.substr(name.find('_')+1));
+        }
+        if (_haveTime)
+        {
+            const double delta = (double(endIndex) - double(_timeIndex))/_sampleRate;
+            msg["rxTime"] = Pothos::Object(_timeNs + (long long)(std::llround(delta*1e9)));
+        }
+        this->output(0)->postMessage(msg);
+        this->callVoid("command", name);
+    }
+
+    //build the code table for the current protocol and address,
+    //errors are kept for activate() since the setters run one at a time
+    void compile(void)
+    {
+        _compileError.clear();
+        _matcher = OOKCodeMatcher();
+        _matcher.setMaxErrors(_maxErrors);
+        _chipRate = CODE_RATE;
+
+        //the built-in Brennenstuhl 3600 codes, named like the profile commands
+        if (_protocols.empty())
+        {
+            std::map<bool, std::map<std::string, std::string>> codes;
+            loadCodes(codes);
+            for (const auto &mode : codes)
+            {
+                for (const auto &group : mode.second)
+                {
+                    OOKChips chips;
+                    for (const auto ch : group.second) chips.append(ch != '0', 1);
+                    _matcher.addCode((mode.first?"on_":"off_") + group.first, chips);
+                }
+            }
+            return;
+        }
+
+        const auto it = _protocols.find(_protocolName);
+        if (it == _protocols.end())
+        {
+            _compileError = "protocol " + _protocolName + " not in profile";
+            return;
+        }
+        const auto &protocol = it->second;
+        if (_sampleRate < 2*protocol.chipRate())
+        {
+            _compileError = "sample rate below twice the chip rate of protocol " + _protocolName;
+            return;
+        }
+        if (protocol.hasAddress() and _address.empty())
+        {
+            _compileError = "protocol " + _protocolName + " needs an address";
+            return;
+        }
+
+        std::map<std::string, OOKChips> codes;
+        try
+        {
+            codes = protocol.compile(_address);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            _compileError = ex.what();
+            return;
+        }
+        for (const auto &pair : codes) _matcher.addCode(pair.first, pair.second);
+        _chipRate = protocol.chipRate();
+    }
+
+    //config
+    const double _sampleRate;
+    std::map<std::string, OOKProtocol> _protocols;
+    std::string _protocolName;
+    std::string _address;
+    size_t _maxErrors;
+    double _envelopeTime;
+    double _chipRate;
+    std::string _compileError;
+
+    //receive chain
+    OOKEnvelope _envelope;
+    OOKThresholdSlicer _slicer;
+    OOKPulseClassifier _classifier;
+    OOKCodeMatcher _matcher;
+    int _lastMatch;
+
+    //the last rxTime label
+    uint64_t _timeIndex;
+    long long _timeNs;
+    bool _haveTime;
+};
+
+static Pothos::BlockRegistry registerOOKReceiver(
+    "/btle/ook_receiver", &OOKReceiver::make);
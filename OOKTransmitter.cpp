@@ -0,0 +1,316 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <complex>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include "OOKProtocol.hpp"
+#include "OOKBurst.hpp"
+
+/***********************************************************************
+ * |PothosDoc OOK Transmitter
+ *
+ * Generate on-off keyed remote control bursts for wireless outlets.
+ * The protocols are loaded from a profile file, which describes
+ * the pulse timings, symbol encodings, address and command fields,
+ * sync, and repeats of each protocol; see examples/ook_protocols.conf.
+ * One block can drive several brands of outlets by changing the protocol.
+ *
+ * Setting the command transmits a burst.
+ * The "send" slot transmits the current command again.
+ * The profile, protocol, address, and rate are checked together
+ * when a burst is transmitted, so they can be changed in any order.
+ * A protocol with an {address} field needs a non-empty address.
+ * The protocol frames are compiled once into bit-packed chip tables,
+ * and each burst is rendered once and cached.
+ *
+ * |category /Control
+ * |keywords ook remote power control pt2262 ev1527 brennenstuhl
+ *
+ * |param profile[Profile] The path of the protocol profile file.
+ * |widget FileEntry(mode=open)
+ * |default ""
+ *
+ * |param protocol[Protocol] The name of a protocol in the profile file.
+ * |widget StringEntry()
+ * |default "brennenstuhl_3600"
+ *
+ * |param address[Address] The device address for protocols with an address field,
+ * given as symbols or as a number (ex: "0FF0F" or "0x5A5A5").
+ * |widget StringEntry()
+ * |default ""
+ * |preview valid
+ *
+ * |param command[Command] The name of the command to transmit.
+ * |widget StringEntry()
+ * |default "off_A"
+ *
+ * |param rate The sample rate of the output stream
+ * |units Sps
+ * |default 250e3
+ *
+ * |param edgeShaping[Edge Shaping] Raised cosine on/off edges as a fraction of the time unit.
+ * |default 0.0
+ * |preview valid
+ *
+ * |param gain The level of the output samples.
+ * |default 0.7
+ *
+ * |param repeat The number of frames in a burst, or 0 for the protocol default.
+ * |default 0
+ * |preview valid
+ *
+ * |param startLabel[Start Label] An optional start of burst label.
+ * |widget StringEntry()
+ * |default ""
+ * |preview valid
+ *
+ * |param endLabel[End Label] An optional end of burst label.
+ * |widget StringEntry()
+ * |default "txEnd"
+ * |preview valid
+ *
+ * |factory /btle/ook_transmitter()
+ * |setter setRate(rate)
+ * |setter setEdgeShaping(edgeShaping)
+ * |setter setGain(gain)
+ * |setter setRepeat(repeat)
+ * |setter setProfile(profile)
+ * |setter setProtocol(protocol)
+ * |setter setAddress(address)
+ * |setter setStartLabel(startLabel)
+ * |setter setEndLabel(endLabel)
+ * |setter setCommand(command)
+ **********************************************************************/
+class OOKTransmitter : public Pothos::Block
+{
+public:
+    OOKTransmitter(void):
+        _burstOffset(0),
+        _protocolRepeat(1),
+        _rate(1.0),
+        _edgeShaping(0.0),
+        _gain(1.0),
+        _repeat(0)
+    {
+        this->setupOutput(0, typeid(std::complex<float>));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setProfile));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setProtocol));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setAddress));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setCommand));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setRate));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setEdgeShaping));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setGain));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setRepeat));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setStartLabel));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, setEndLabel));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, getCommands));
+        this->registerCall(this, POTHOS_FCN_TUPLE(OOKTransmitter, send));
+    }
+
+    static Block *make(void)
+    {
+        return new OOKTransmitter();
+    }
+
+    void setProfile(const std::string &path)
+    {
+        try
+        {
+            _protocols = path.empty()?std::map<std::string, OOKProtocol>():OOKProtocol::load(path);
+        }
+        catch (const std::runtime_error &ex)
+        {
+            throw Pothos::InvalidArgumentException("OOKTransmitter::setProfile("+path+")", ex.what());
+        }
+        this->compile();
+    }
+
+    void setProtocol(const std::string &protocol)
+    {
+        _protocolName = protocol;
+        this->compile();
+    }
+
+    void setAddress(const std::string &address)
+    {
+        _address = address;
+        this->compile();
+    }
+
+    void setCommand(const std::string &command)
+    {
+        const auto it = _protocols.find(_protocolName);
+        if (it != _protocols.end() and it->second.commands.count(command) == 0) throw Pothos::InvalidArgumentException(
+            "OOKTransmitter::setCommand("+command+")", "unknown command for protocol " + _protocolName);
+        _command = command;
+        this->trigger();
+    }
+
+    void setRate(const double rate)
+    {
+        _rate = rate;
+        this->compile();
+    }
+
+    void setEdgeShaping(const double edgeShaping)
+    {
+        if (edgeShaping < 0.0 or edgeShaping > 1.0) throw Pothos::InvalidArgumentException(
+            "OOKTransmitter::setEdgeShaping("+std::to_string(edgeShaping)+")", "expected 0.0 to 1.0");
+        _edgeShaping = edgeShaping;
+        this->compile();
+    }
+
+    void setGain(const float gain)
+    {
+        _gain = gain;
+        _burstCache.clear();
+    }
+
+    void setRepeat(const size_t repeat)
+    {
+        _repeat = repeat;
+        _burstCache.clear();
+    }
+
+    void setStartLabel(const std::string &label)
+    {
+        _startLabel = label;
+    }
+
+    void setEndLabel(const std::string &label)
+    {
+        _endLabel = label;
+    }
+
+    //! The command names of the current protocol
+    std::vector<std::string> getCommands(void) const
+    {
+        std::vector<std::string> names;
+        const auto it = _protocols.find(_protocolName);
+        if (it != _protocols.end()) for (const auto &pair : it->second.commands) names.push_back(pair.first);
+        return names;
+    }
+
+    void send(void)
+    {
+        this->trigger();
+    }
+
+    void activate(void)
+    {
+        this->trigger();
+    }
+
+    void work(void)
+    {
+        auto outPort = this->output(0);
+        const size_t N = outPort->elements();
+        if (N == 0) return;
+        if (not _burst) return;
+
+        if (_burstOffset == 0 and not _startLabel.empty())
+        {
+            outPort->postLabel(Pothos::Label(_startLabel, _burst->size(), 0));
+        }
+
+        //bulk copy from the cached burst
+        const size_t n = std::min(N, _burst->size()-_burstOffset);
+        auto out = outPort->buffer().as<std::complex<float> *>();
+        std::copy_n(_burst->data()+_burstOffset, n, out);
+        _burstOffset += n;
+
+        if (_burstOffset == _burst->size())
+        {
+            if (not _endLabel.empty())
+                outPort->postLabel(Pothos::Label(_endLabel, Pothos::Object(), n-1));
+            _burst.reset();
+        }
+
+        outPort->produce(n);
+    }
+
+private:
+
+    //compile the command tables for the current protocol and address,
+    //errors are kept for trigger() since the setters run one at a time
+    void compile(void)
+    {
+        _codes.clear();
+        _burstCache.clear();
+        _compileError.clear();
+        if (_protocols.empty() or _protocolName.empty()) return;
+
+        const auto it = _protocols.find(_protocolName);
+        if (it == _protocols.end())
+        {
+            _compileError = "protocol " + _protocolName + " not in profile";
+            return;
+        }
+        const auto &protocol = it->second;
+        if (_rate < protocol.chipRate())
+        {
+            _compileError = "rate " + std::to_string(_rate) + " below the protocol chip rate";
+            return;
+        }
+        if (protocol.hasAddress() and _address.empty())
+        {
+            _compileError = "protocol " + _protocolName + " needs an address";
+            return;
+        }
+
+        try
+        {
+            _codes = protocol.compile(_address);
+        }
+        catch (const std::invalid_argument &ex)
+        {
+            _compileError = ex.what();
+            return;
+        }
+        _protocolRepeat = protocol.repeat;
+        _renderer = OOKBurstRenderer(_rate, protocol.chipRate(), _edgeShaping);
+    }
+
+    void trigger(void)
+    {
+        _burst.reset();
+        _burstOffset = 0;
+        if (not _command.empty() and not _compileError.empty()) throw Pothos::InvalidArgumentException(
+            "OOKTransmitter::send("+_command+")", _compileError);
+        const auto it = _codes.find(_command);
+        if (it == _codes.end()) return;
+
+        auto &burst = _burstCache[_command];
+        if (not burst) burst = _renderer.render(it->second, (_repeat == 0)?_protocolRepeat:_repeat, _gain);
+        if (not burst->empty()) _burst = burst;
+    }
+
+    //current state
+    std::shared_ptr<const OOKBurst> _burst;
+    size_t _burstOffset;
+
+    //compiled protocol and rendered bursts
+    std::map<std::string, OOKProtocol> _protocols;
+    std::map<std::string, OOKChips> _codes;
+    size_t _protocolRepeat;
+    OOKBurstRenderer _renderer;
+    std::map<std::string, std::shared_ptr<const OOKBurst>> _burstCache;
+    std::string _compileError;
+
+    //config
+    std::string _protocolName;
+    std::string _address;
+    std::string _command;
+    double _rate;
+    double _edgeShaping;
+    float _gain;
+    size_t _repeat;
+    std::string _startLabel;
+    std::string _endLabel;
+};
+
+static Pothos::BlockRegistry registerOOKTransmitter(
+    "/btle/ook_transmitter", &OOKTransmitter::make);
@@ -0,0 +1,48 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <Pothos/Testing.hpp>
+#include "BTLETimerWheel.hpp"
+#include <vector>
+
+static const int64_t MS = 1000000;
+
+/***********************************************************************
+ * Deadlines fire at most one tick late, including a deadline
+ * that is shorter than the first one scheduled (ex: a shorter alarm timeout).
+ **********************************************************************/
+POTHOS_TEST_BLOCK("/btle/tests", test_timer_wheel_shorter_deadline)
+{
+    BTLETimerWheel wheel(5*MS);
+    const int64_t now = 1000000*MS;
+    wheel.schedule(0, now+60000*MS, now);
+    wheel.schedule(1, now+60000*MS, now);
+    wheel.schedule(0, now+5000*MS, now);
+
+    std::vector<size_t> fired;
+    const auto onExpire = [&fired](const size_t id){fired.push_back(id);};
+    wheel.advance(now+4990*MS, onExpire);
+    POTHOS_TEST_TRUE(fired.empty());
+    wheel.advance(now+5005*MS, onExpire);
+    POTHOS_TEST_EQUAL(fired.size(), 1);
+    POTHOS_TEST_EQUAL(fired[0], 0);
+
+    //a deadline in the past fires on the next tick
+    wheel.schedule(2, now, now+5005*MS);
+    wheel.advance(now+5010*MS, onExpire);
+    POTHOS_TEST_EQUAL(fired.size(), 2);
+    POTHOS_TEST_EQUAL(fired[1], 2);
+
+    wheel.advance(now+60005*MS, onExpire);
+    POTHOS_TEST_EQUAL(fired.size(), 3);
+    POTHOS_TEST_EQUAL(fired[2], 1);
+    POTHOS_TEST_TRUE(wheel.empty());
+
+    //an idle wheel starts again at the current time
+    wheel.schedule(3, now+100000*MS, now+90000*MS);
+    wheel.schedule(4, now+91000*MS, now+90000*MS);
+    wheel.advance(now+91005*MS, onExpire);
+    POTHOS_TEST_EQUAL(fired.size(), 4);
+    POTHOS_TEST_EQUAL(fired[3], 4);
+}
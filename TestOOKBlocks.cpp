@@ -0,0 +1,102 @@
+// Copyright (c) 2016-2016 Josh Blum
+// SPDX-License-Identifier: BSL-1.0
+
+#include <Pothos/Framework.hpp>
+#include <Pothos/Testing.hpp>
+#include <Poco/TemporaryFile.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+//protocols with an {address} field, from examples/ook_protocols.conf
+static const char *ADDRESS_PROFILE =
+    "[pt2262]\n"
+    "unit = 350us\n"
+    "symbol 0 = 1 3 1 3\n"
+    "symbol 1 = 3 1 3 1\n"
+    "symbol F = 1 3 3 1\n"
+    "trailer = 1 31\n"
+    "repeat = 10\n"
+    "address_width = 5\n"
+    "frame = {address}{command}\n"
+    "command on_A = 0FFFF0F\n"
+    "command off_A = 0FFFFF0\n"
+    "[ev1527]\n"
+    "unit = 300us\n"
+    "symbol 0 = 1 3\n"
+    "symbol 1 = 3 1\n"
+    "preamble = 1 31\n"
+    "repeat = 8\n"
+    "address_width = 20\n"
+    "frame = {address}{command}\n"
+    "command key_A = 0001\n"
+    "command key_B = 0010\n";
+
+/***********************************************************************
+ * The setters run in the order of the block description,
+ * so the protocol is set before its address.
+ **********************************************************************/
+POTHOS_TEST_BLOCK("/btle/tests", test_ook_transmitter_address_protocols)
+{
+    Poco::TemporaryFile profile;
+    std::ofstream(profile.path()) << ADDRESS_PROFILE;
+
+    auto tx = Pothos::BlockRegistry::make("/btle/ook_transmitter");
+    tx.call("setRate", 250e3);
+    tx.call("setProfile", profile.path());
+    tx.call("setProtocol", std::string("pt2262"));
+    tx.call("setAddress", std::string("0FF0F"));
+    tx.call("setCommand", std::string("on_A"));
+    POTHOS_TEST_EQUAL(tx.call<std::vector<std::string>>("getCommands").size(), 2);
+
+    //change the protocol while the address of the old protocol is set
+    tx.call("setProtocol", std::string("ev1527"));
+    tx.call("setAddress", std::string("0x5A5A5"));
+    tx.call("setCommand", std::string("key_B"));
+
+    //the address is required once a command is sent
+    auto noAddress = Pothos::BlockRegistry::make("/btle/ook_transmitter");
+    noAddress.call("setRate", 250e3);
+    noAddress.call("setProfile", profile.path());
+    noAddress.call("setProtocol", std::string("pt2262"));
+    noAddress.call("setAddress", std::string(""));
+    POTHOS_TEST_THROWS(noAddress.call("setCommand", std::string("on_A")), Pothos::Exception);
+}
+
+/***********************************************************************
+ * Receive a transmitted burst of an address protocol,
+ * with both blocks set up in setter order.
+ **********************************************************************/
+POTHOS_TEST_BLOCK("/btle/tests", test_ook_receiver_address_protocols)
+{
+    Poco::TemporaryFile profile;
+    std::ofstream(profile.path()) << ADDRESS_PROFILE;
+
+    auto tx = Pothos::BlockRegistry::make("/btle/ook_transmitter");
+    tx.call("setRate", 250e3);
+    tx.call("setProfile", profile.path());
+    tx.call("setProtocol", std::string("ev1527"));
+    tx.call("setAddress", std::string("0x5A5A5"));
+    tx.call("setCommand", std::string("key_B"));
+
+    //the default protocol is not in this profile until setProtocol
+    auto rx = Pothos::BlockRegistry::make("/btle/ook_receiver", 250e3);
+    rx.call("setProtocol", std::string("brennenstuhl_3600"));
+    rx.call("setProfile", profile.path());
+    rx.call("setProtocol", std::string("ev1527"));
+    rx.call("setAddress", std::string("0x5A5A5"));
+
+    auto collector = Pothos::BlockRegistry::make("/blocks/collector_sink");
+    {
+        Pothos::Topology topology;
+        topology.connect(tx, 0, rx, 0);
+        topology.connect(rx, 0, collector, 0);
+        topology.commit();
+        POTHOS_TEST_TRUE(topology.waitInactive());
+    }
+
+    const auto msgs = collector.call<Pothos::ObjectVector>("getMessages");
+    POTHOS_TEST_EQUAL(msgs.size(), 1);
+    const auto msg = msgs.at(0).convert<Pothos::ObjectKwargs>();
+    POTHOS_TEST_EQUAL(msg.at("command").convert<std::string>(), "key_B");
+}